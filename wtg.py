@@ -2,32 +2,21 @@ import os
 import sys
 import math
 import time
+import struct
 from subprocess import Popen
-from PIL import Image, ImageFilter
+from PIL import Image
+import wtglib
 
 core_executable_release = os.path.join(os.path.dirname(__file__), 'wtgcore/x64/Release/wtgcore.exe')
 core_executable_debug = os.path.join(os.path.dirname(__file__), 'wtgcore/x64/Debug/wtgcore.exe')
 
 """
 Usage: python wtg.py input_image [--debug [<debug-tile-index>]]
+png and qoi images are read and written by wtgcore itself, other formats go through PIL,
+and are passed to libwtgcore in memory when it's built, or else to wtgcore through temp files.
 """
-def main():
-	input_path = sys.argv[1]
-	input = Image.open(input_path)
-	resolution = input.size[0]
-	if resolution != input.size[1]:
-		raise Exception("input image must be square sized")
-	input = input.convert("RGB")
-	data = input.tobytes()
-	tmpinput = os.path.abspath(".\\input.img")
-	tmpoutput = os.path.abspath(".\\output.img")
-	tmpoutput_constraints = os.path.abspath(".\\graphcut_constraints.img")
-	f = open(tmpinput, "wb")
-	f.write(data)
-	f.close()
-
-	# invoke wtgcore.exe
-	command = ["exe_path(place holder)", "--tiles", str(resolution), tmpinput, tmpoutput, tmpoutput_constraints]
+def run_core(resolution, input_path, output_path, constraints_path, composite_path):
+	command = ["exe_path(place holder)", "--tiles", str(resolution), input_path, output_path, constraints_path, "--feather", "2", "--composite", composite_path]
 	if len(sys.argv) > 2 and sys.argv[2] == '--debug':
 		core_executable = core_executable_debug
 		if len(sys.argv) > 3:
@@ -41,19 +30,64 @@ def main():
 	if returncode != 0:
 		raise Exception("wtgcore returns error")
 
-	# read packed corners with its mask
+def image_size(path):
+	if path.lower().endswith(".qoi"):
+		f = open(path, "rb")
+		header = f.read(12)
+		f.close()
+		return struct.unpack(">II", header[4:12])
+	return Image.open(path).size
+
+def main():
+	input_path = sys.argv[1]
+	size = image_size(input_path)
+	resolution = size[0]
+	if resolution != size[1]:
+		raise Exception("input image must be square sized")
+
+	fn, ext = os.path.splitext(input_path)
+	output_path = fn + "_wangtiles" + ext
+	corners_path = fn + "_wangtiles_corners" + ext
+	constraints_path = fn + "_wangtiles_graphcut_constraints" + ext
+
+	if ext.lower() in (".png", ".qoi"):
+		run_core(resolution, input_path, corners_path, constraints_path, output_path)
+		return
+
+	input = Image.open(input_path).convert("RGB")
+	data = input.tobytes()
+
+	# the bytes of the image are read by the library in place, and the results are written into the bytearrays of the images
+	if not (len(sys.argv) > 2 and sys.argv[2] == '--debug') and wtglib.available():
+		results = wtglib.generate_tiles(data, resolution, wanted = ("corners_rgba", "composite", "constraints"), feather_sigma = 2.0)
+		constraints_resolution = int(math.sqrt(len(results["constraints"]) / 3))
+		Image.frombuffer("RGB", (resolution, resolution), results["composite"], "raw", "RGB", 0, 1).save(output_path)
+		Image.frombuffer("RGBA", (resolution, resolution), results["corners_rgba"], "raw", "RGBA", 0, 1).save(corners_path)
+		Image.frombuffer("RGB", (constraints_resolution, constraints_resolution), results["constraints"], "raw", "RGB", 0, 1).save(constraints_path)
+		return
+
+	tmpinput = os.path.abspath(".\\input.img")
+	tmpoutput = os.path.abspath(".\\output.img")
+	tmpoutput_constraints = os.path.abspath(".\\graphcut_constraints.img")
+	tmpoutput_composite = os.path.abspath(".\\output_composite.img")
+	f = open(tmpinput, "wb")
+	f.write(data)
+	f.close()
+
+	# invoke wtgcore.exe
+	run_core(resolution, tmpinput, tmpoutput, tmpoutput_constraints, tmpoutput_composite)
+
+	# read packed corners with its feathered mask
 	f = open(tmpoutput, "rb")
 	packed_corners = f.read()
 	f.close()
 	packed_corners = Image.frombytes("RGBA", (resolution, resolution), packed_corners)
 
-	# process mask
-	mask = packed_corners.getchannel("A")
-	mask = mask.filter(ImageFilter.GaussianBlur(2))
-	packed_corners.putalpha(mask)
-
-	# composite output wang tiles
-	output = Image.composite(packed_corners.convert("RGB"), input, mask)
+	# read output wang tiles, composited by wtgcore
+	f = open(tmpoutput_composite, "rb")
+	output = f.read()
+	f.close()
+	output = Image.frombytes("RGB", (resolution, resolution), output)
 
 	# read graphcut constraints for debugging output
 	f = open(tmpoutput_constraints, "rb")
@@ -62,19 +96,14 @@ def main():
 	constraints_resolution = int(math.sqrt(len(graphcut_constraints) / 3))
 	graphcut_constraints = Image.frombytes("RGB", (constraints_resolution, constraints_resolution), graphcut_constraints)
 
-	fn, ext = os.path.splitext(input_path)
-	output_path = fn + "_wangtiles" + ext
 	output.save(output_path)
-
-	output_path = fn + "_wangtiles_corners" + ext
-	packed_corners.save(output_path)
-
-	output_path = fn + "_wangtiles_graphcut_constraints" + ext
-	graphcut_constraints.save(output_path)
+	packed_corners.save(corners_path)
+	graphcut_constraints.save(constraints_path)
 
 	os.remove(tmpinput)
 	os.remove(tmpoutput)
 	os.remove(tmpoutput_constraints)
+	os.remove(tmpoutput_composite)
 
 
 
@@ -1,7 +1,12 @@
 #pragma once
 
 #include <cmath>
+#include <cstddef>
 #include <algorithm>
+#include <memory>
+#include <new>
+#include <iostream>
+#include <cstdlib>
 
 struct color_t
 {
@@ -28,39 +33,59 @@ struct patch_t
 	int size;
 };
 
+// a square patch of an image, addressed relative to its corner
 template <typename _p_t>
-struct generic_image_t
+struct generic_patch_view_t
+{
+	typedef _p_t _pixel_t;
+	_pixel_t *pixels; // the corner pixel of the patch
+	int stride; // pixels between two rows
+	int size;
+
+	generic_patch_view_t() :pixels(NULL), stride(0), size(0) {}
+	generic_patch_view_t(_pixel_t *pixels, int stride, int size) :pixels(pixels), stride(stride), size(size) {}
+
+	_pixel_t *row(int y) const { return pixels + y * stride; }
+	_pixel_t get_pixel(int x, int y) const { return pixels[y * stride + x]; }
+	void set_pixel(int x, int y, _pixel_t color) const { pixels[y * stride + x] = color; }
+};
+
+// the pixels of an image, without owning them. copying a view never copies the pixels.
+// pixels points to row 0 and the rows are stride pixels apart. the stride is the resolution
+// unless the view is over rows stored the other way round, e.g. a file mapped top row first, where it's negative.
+template <typename _p_t>
+struct generic_image_view_t
 {
 	typedef _p_t _pixel_t;
 	_pixel_t *pixels;
 	int resolution;
+	int stride;
 
-	generic_image_t() :pixels(NULL), resolution(0) {}
-	
-	void init(int resolution)
+	generic_image_view_t() :pixels(NULL), resolution(0), stride(0) {}
+	generic_image_view_t(_pixel_t *pixels, int resolution) :pixels(pixels), resolution(resolution), stride(resolution) {}
+	generic_image_view_t(_pixel_t *pixels, int resolution, int stride) :pixels(pixels), resolution(resolution), stride(stride) {}
+
+	ptrdiff_t offset(int x, int y) const
 	{
-		this->resolution = resolution;
-		pixels = new _pixel_t[resolution * resolution];
+		return (ptrdiff_t)y * stride + x;
 	}
 
-	void clear()
+	_pixel_t *row(int y) const
 	{
-		resolution = 0;
-		delete pixels;
-		pixels = NULL;
+		return pixels + (ptrdiff_t)y * stride;
 	}
 
 	_pixel_t get_pixel(int x, int y) const
 	{
-		return pixels[y * resolution + x];
+		return pixels[offset(x, y)];
 	}
 
 	void set_pixel(int x, int y, _pixel_t color)
 	{
-		pixels[y * resolution + x] = color;
+		pixels[offset(x, y)] = color;
 	}
 
-	_pixel_t get_pixel_in_patch(const patch_t &patch, int x, int y)
+	_pixel_t get_pixel_in_patch(const patch_t &patch, int x, int y) const
 	{
 		return get_pixel(patch.x + x, patch.y + y);
 	}
@@ -76,10 +101,146 @@ struct generic_image_t
 		y = y % resolution;
 		return get_pixel(x < 0 ? x + resolution : x, y < 0 ? y + resolution : y);
 	}
+
+	generic_patch_view_t<_p_t> get_patch(const patch_t &patch) const
+	{
+		return generic_patch_view_t<_p_t>(row(patch.y) + patch.x, stride, patch.size);
+	}
+};
+
+// hands out the pixels of several images from one allocation, e.g. all the levels of a mip chain.
+// it's sized up front, and the images taken from it must be cleared or destroyed before it's reset or destroyed.
+// the memory is kept when it's reset to a size that fits, so repeated runs do not touch the heap.
+class image_arena_t
+{
+public:
+	static const size_t alignment = 64;
+
+	image_arena_t() :capacity(0), used(0) {}
+	image_arena_t(const image_arena_t &) = delete;
+	image_arena_t &operator = (const image_arena_t &) = delete;
+
+	// false when the memory can't be allocated, the arena is left empty then
+	bool reset(size_t bytes)
+	{
+		used = 0;
+		if (bytes > capacity)
+		{
+			memory.reset(new (std::nothrow) unsigned char[bytes + alignment]);
+			capacity = memory ? bytes : 0;
+			if (!memory)
+			{
+				std::cerr << "image arena can't allocate " << bytes << " bytes\n";
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// null when the arena is out of memory
+	void *allocate(size_t bytes)
+	{
+		bytes = aligned_size(bytes);
+		if (used + bytes > capacity)
+		{
+			std::cerr << "image arena is out of memory\n";
+			return NULL;
+		}
+		unsigned char *base = memory.get() + (alignment - (size_t)memory.get() % alignment) % alignment;
+		void *p = base + used;
+		used += bytes;
+		return p;
+	}
+
+	static size_t aligned_size(size_t bytes) { return (bytes + alignment - 1) / alignment * alignment; }
+
+	// the bytes of the levels below the first one of a mip chain, the first level is the full resolution
+	template <typename _pixel_t>
+	static size_t mip_chain_size(int resolution, int levels)
+	{
+		size_t bytes = 0;
+		for (int i = 1; i < levels; i++)
+			bytes += aligned_size(sizeof(_pixel_t) * (resolution >> i) * (resolution >> i));
+		return bytes;
+	}
+
+private:
+	std::unique_ptr<unsigned char[]> memory;
+	size_t capacity;
+	size_t used;
+};
+
+// an image owning its pixels, which are freed with it. it can be moved but not copied,
+// functions only reading or writing the pixels take a view instead, which an image converts to.
+template <typename _p_t>
+struct generic_image_t : public generic_image_view_t<_p_t>
+{
+	typedef _p_t _pixel_t;
+	typedef generic_image_view_t<_p_t> view_t;
+
+	generic_image_t() :owned(false) {}
+	explicit generic_image_t(int resolution) :owned(false) { init(resolution); }
+	generic_image_t(generic_image_t &&other) :view_t(other), owned(other.owned) { other.release(); }
+	generic_image_t(const generic_image_t &) = delete;
+	~generic_image_t() { clear(); }
+
+	generic_image_t &operator = (generic_image_t &&other)
+	{
+		if (this == &other) return *this;
+		clear();
+		view_t::operator = (other);
+		owned = other.owned;
+		other.release();
+		return *this;
+	}
+	generic_image_t &operator = (const generic_image_t &) = delete;
+
+	void init(int resolution)
+	{
+		clear();
+		this->resolution = resolution;
+		this->stride = resolution;
+		this->pixels = new _pixel_t[(size_t)resolution * resolution];
+		owned = true;
+	}
+
+	// the pixels belong to the arena, which must outlive them. the image is left empty when the arena is out of memory.
+	void init(int resolution, image_arena_t &arena)
+	{
+		clear();
+		this->pixels = static_cast<_pixel_t *>(arena.allocate(sizeof(_pixel_t) * resolution * resolution));
+		if (!this->pixels) return;
+		this->resolution = resolution;
+		this->stride = resolution;
+		owned = false;
+	}
+
+	void clear()
+	{
+		if (owned) delete[] this->pixels;
+		release();
+	}
+
+	view_t view() const { return *this; }
+
+private:
+	void release()
+	{
+		this->resolution = 0;
+		this->stride = 0;
+		this->pixels = NULL;
+		owned = false;
+	}
+
+	bool owned;
 };
 
 typedef generic_image_t<color_t> image_t;
 typedef generic_image_t<unsigned char> mask_t;
+typedef generic_image_view_t<color_t> image_view_t;
+typedef generic_image_view_t<unsigned char> mask_view_t;
+typedef generic_patch_view_t<color_t> image_patch_view_t;
+typedef generic_patch_view_t<unsigned char> mask_patch_view_t;
 
 template <typename value_t>
 struct vector3_t
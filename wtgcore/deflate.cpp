@@ -0,0 +1,622 @@
+#include "pch.h"
+#include <cstring>
+#include <algorithm>
+#include "deflate.h"
+
+namespace
+{
+	const int window_size = 32768;
+	const int min_match = 3;
+	const int max_match = 258;
+	const int hash_bits = 15;
+	// the candidates tried for a match, a fast level which still finds the runs and repeats of the image rows
+	const int max_chain = 32;
+	// the symbols coded with the same huffman codes
+	const size_t block_symbols = 1 << 16;
+
+	const unsigned short length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+	const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+	const unsigned short distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769,
+		1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+	const unsigned char distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+	const unsigned char code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+	// a literal when distance is 0, then length is the byte
+	struct lz_symbol_t
+	{
+		unsigned short length;
+		unsigned short distance;
+	};
+
+	struct bit_writer_t
+	{
+		std::vector<unsigned char> &out;
+		unsigned long long buffer;
+		int count;
+
+		explicit bit_writer_t(std::vector<unsigned char> &out) :out(out), buffer(0), count(0) {}
+
+		void put(unsigned int bits, int n)
+		{
+			buffer |= (unsigned long long)bits << count;
+			count += n;
+			while (count >= 8)
+			{
+				out.push_back((unsigned char)buffer);
+				buffer >>= 8;
+				count -= 8;
+			}
+		}
+
+		void align()
+		{
+			if (count > 0) put(0, 8 - count);
+		}
+	};
+
+	struct bit_reader_t
+	{
+		const unsigned char *p;
+		const unsigned char *end;
+		unsigned long long buffer;
+		int count;
+		// the zero bytes loaded past the end
+		size_t padding;
+
+		bit_reader_t(const unsigned char *begin, const unsigned char *end) :p(begin), end(end), buffer(0), count(0), padding(0) {}
+
+		void refill()
+		{
+			while (count <= 56)
+			{
+				unsigned long long byte = 0;
+				if (p < end) byte = *p++;
+				else padding++;
+				buffer |= byte << count;
+				count += 8;
+			}
+		}
+
+		unsigned int bits(int n)
+		{
+			if (count < n) refill();
+			unsigned int v = (unsigned int)(buffer & ((1ull << n) - 1));
+			buffer >>= n;
+			count -= n;
+			return v;
+		}
+
+		void align()
+		{
+			const int drop = count & 7;
+			buffer >>= drop;
+			count -= drop;
+		}
+
+		// true when bits past the end of the data were taken
+		bool overrun() const { return padding * 8 > (size_t)count; }
+	};
+
+	// the huffman codes are sent lsb first, so they are kept bit reversed
+	unsigned int reverse_bits(unsigned int code, int n)
+	{
+		unsigned int r = 0;
+		for (int i = 0; i < n; i++, code >>= 1)
+			r = (r << 1) | (code & 1);
+		return r;
+	}
+
+	// the canonical codes of the lengths, bit reversed
+	void canonical_codes(const unsigned char *lengths, int n, unsigned short *codes)
+	{
+		int count[16] = { 0 };
+		for (int i = 0; i < n; i++) count[lengths[i]]++;
+		count[0] = 0;
+		int next[16] = { 0 };
+		int code = 0;
+		for (int bits = 1; bits < 16; bits++)
+		{
+			code = (code + count[bits - 1]) << 1;
+			next[bits] = code;
+		}
+		for (int i = 0; i < n; i++)
+			codes[i] = lengths[i] ? (unsigned short)reverse_bits(next[lengths[i]]++, lengths[i]) : 0;
+	}
+
+	// the lengths of a huffman code of the frequencies, no longer than max_bits.
+	// longer codes are cut to max_bits, and the code is made complete again by lengthening shorter ones, the way miniz does.
+	void huffman_lengths(const unsigned int *freq, int n, int max_bits, unsigned char *lengths)
+	{
+		memset(lengths, 0, n);
+		std::vector<int> symbols;
+		for (int i = 0; i < n; i++)
+			if (freq[i]) symbols.push_back(i);
+		if (symbols.empty()) return;
+		if (symbols.size() == 1)
+		{
+			// a lone symbol still gets a complete code of one bit
+			lengths[symbols[0]] = 1;
+			lengths[symbols[0] == 0 ? 1 : 0] = 1;
+			return;
+		}
+		std::stable_sort(symbols.begin(), symbols.end(), [freq](int a, int b) { return freq[a] < freq[b]; });
+
+		// the tree is built from two queues in ascending order, the sorted leaves and the inner nodes as they are made.
+		// a parent always comes after its children, so the depths are found walking back from the root.
+		const int m = (int)symbols.size();
+		std::vector<unsigned long long> weight(m * 2 - 1);
+		std::vector<int> parent(m * 2 - 1, -1);
+		for (int i = 0; i < m; i++) weight[i] = freq[symbols[i]];
+		int leaf = 0, inner = m;
+		for (int node = m; node < m * 2 - 1; node++)
+		{
+			int children[2];
+			for (int c = 0; c < 2; c++)
+				children[c] = leaf < m && (inner == node || weight[leaf] <= weight[inner]) ? leaf++ : inner++;
+			weight[node] = weight[children[0]] + weight[children[1]];
+			parent[children[0]] = parent[children[1]] = node;
+		}
+		std::vector<int> depth(m * 2 - 1, 0);
+		for (int i = m * 2 - 3; i >= 0; i--)
+			depth[i] = depth[parent[i]] + 1;
+
+		std::vector<int> count(std::max(max_bits, m) + 1, 0);
+		for (int i = 0; i < m; i++) count[std::min(depth[i], max_bits)]++;
+		unsigned long long total = 0;
+		for (int bits = 1; bits <= max_bits; bits++)
+			total += (unsigned long long)count[bits] << (max_bits - bits);
+		while (total != 1ull << max_bits)
+		{
+			count[max_bits]--;
+			for (int bits = max_bits - 1; bits > 0; bits--)
+			{
+				if (count[bits])
+				{
+					count[bits]--;
+					count[bits + 1] += 2;
+					break;
+				}
+			}
+			total--;
+		}
+		// the leaves are in ascending frequency, the last ones get the shortest codes
+		int s = m - 1;
+		for (int bits = 1; bits <= max_bits; bits++)
+			for (int k = 0; k < count[bits]; k++)
+				lengths[symbols[s--]] = (unsigned char)bits;
+	}
+
+	struct code_tables_t
+	{
+		unsigned char length_code[max_match + 1];
+
+		code_tables_t()
+		{
+			for (int length = min_match, code = 0; length <= max_match; length++)
+			{
+				while (code < 28 && length_base[code + 1] <= length) code++;
+				length_code[length] = (unsigned char)code;
+			}
+		}
+	};
+
+	const code_tables_t &code_tables()
+	{
+		static const code_tables_t tables;
+		return tables;
+	}
+
+	int distance_code(int distance)
+	{
+		const int d = distance - 1;
+		if (d < 4) return d;
+		int n = 2;
+		while ((d >> (n + 1)) != 0) n++;
+		return n * 2 + ((d >> (n - 1)) & 1);
+	}
+
+	unsigned int hash3(const unsigned char *p)
+	{
+		return (((unsigned int)p[0] | (unsigned int)p[1] << 8 | (unsigned int)p[2] << 16) * 2654435761u) >> (32 - hash_bits);
+	}
+
+	void write_block(bit_writer_t &writer, const std::vector<lz_symbol_t> &symbols, bool final)
+	{
+		const code_tables_t &tables = code_tables();
+		unsigned int litlen_freq[286] = { 0 };
+		unsigned int distance_freq[30] = { 0 };
+		for (const lz_symbol_t &s : symbols)
+		{
+			if (s.distance == 0)
+				litlen_freq[s.length]++;
+			else
+			{
+				litlen_freq[257 + tables.length_code[s.length]]++;
+				distance_freq[distance_code(s.distance)]++;
+			}
+		}
+		litlen_freq[256] = 1;
+		unsigned char litlen_lengths[286];
+		unsigned char distance_lengths[30];
+		huffman_lengths(litlen_freq, 286, 15, litlen_lengths);
+		huffman_lengths(distance_freq, 30, 15, distance_lengths);
+		unsigned short litlen_codes[286], distance_codes[30];
+		canonical_codes(litlen_lengths, 286, litlen_codes);
+		canonical_codes(distance_lengths, 30, distance_codes);
+		int hlit = 286;
+		while (hlit > 257 && !litlen_lengths[hlit - 1]) hlit--;
+		int hdist = 30;
+		while (hdist > 1 && !distance_lengths[hdist - 1]) hdist--;
+
+		// the lengths of both codes in a row, run length coded with the symbols 16 to 18, the extra bits are kept above bit 5
+		unsigned char lengths[286 + 30];
+		memcpy(lengths, litlen_lengths, hlit);
+		memcpy(lengths + hlit, distance_lengths, hdist);
+		const int total = hlit + hdist;
+		std::vector<unsigned short> runs;
+		for (int i = 0; i < total;)
+		{
+			const int length = lengths[i];
+			int run = 1;
+			while (i + run < total && lengths[i + run] == length) run++;
+			i += run;
+			if (length == 0)
+			{
+				while (run >= 11)
+				{
+					const int r = std::min(run, 138);
+					runs.push_back((unsigned short)(18 | (r - 11) << 5));
+					run -= r;
+				}
+				if (run >= 3)
+				{
+					runs.push_back((unsigned short)(17 | (run - 3) << 5));
+					run = 0;
+				}
+			}
+			else
+			{
+				runs.push_back((unsigned short)length);
+				run--;
+				while (run >= 3)
+				{
+					const int r = std::min(run, 6);
+					runs.push_back((unsigned short)(16 | (r - 3) << 5));
+					run -= r;
+				}
+			}
+			for (; run > 0; run--) runs.push_back((unsigned short)length);
+		}
+		unsigned int cl_freq[19] = { 0 };
+		for (unsigned short r : runs) cl_freq[r & 31]++;
+		unsigned char cl_lengths[19];
+		unsigned short cl_codes[19];
+		huffman_lengths(cl_freq, 19, 7, cl_lengths);
+		canonical_codes(cl_lengths, 19, cl_codes);
+		int hclen = 19;
+		while (hclen > 4 && !cl_lengths[code_length_order[hclen - 1]]) hclen--;
+
+		writer.put(final ? 1 : 0, 1);
+		writer.put(2, 2);
+		writer.put(hlit - 257, 5);
+		writer.put(hdist - 1, 5);
+		writer.put(hclen - 4, 4);
+		for (int i = 0; i < hclen; i++) writer.put(cl_lengths[code_length_order[i]], 3);
+		static const int run_extra[3] = { 2, 3, 7 };
+		for (unsigned short r : runs)
+		{
+			const int symbol = r & 31;
+			writer.put(cl_codes[symbol], cl_lengths[symbol]);
+			if (symbol >= 16) writer.put(r >> 5, run_extra[symbol - 16]);
+		}
+
+		for (const lz_symbol_t &s : symbols)
+		{
+			if (s.distance == 0)
+			{
+				writer.put(litlen_codes[s.length], litlen_lengths[s.length]);
+				continue;
+			}
+			const int lc = tables.length_code[s.length];
+			writer.put(litlen_codes[257 + lc], litlen_lengths[257 + lc]);
+			writer.put(s.length - length_base[lc], length_extra[lc]);
+			const int dc = distance_code(s.distance);
+			writer.put(distance_codes[dc], distance_lengths[dc]);
+			writer.put(s.distance - distance_base[dc], distance_extra[dc]);
+		}
+		writer.put(litlen_codes[256], litlen_lengths[256]);
+	}
+
+	struct huffman_table_t
+	{
+		// symbol << 4 | length, indexed by the next bits of the stream, zero for the bits of no code
+		std::vector<unsigned short> entries;
+		int bits;
+
+		// over-subscribed codes are broken, incomplete ones are allowed, e.g. a single distance code
+		bool build(const unsigned char *lengths, int n)
+		{
+			int count[16] = { 0 };
+			bits = 1;
+			for (int i = 0; i < n; i++)
+			{
+				count[lengths[i]]++;
+				bits = std::max(bits, (int)lengths[i]);
+			}
+			count[0] = 0;
+			int left = 1;
+			for (int length = 1; length < 16; length++)
+			{
+				left = (left << 1) - count[length];
+				if (left < 0) return false;
+			}
+			int next[16] = { 0 };
+			int code = 0;
+			for (int length = 1; length < 16; length++)
+			{
+				code = (code + count[length - 1]) << 1;
+				next[length] = code;
+			}
+			entries.assign((size_t)1 << bits, 0);
+			for (int symbol = 0; symbol < n; symbol++)
+			{
+				const int length = lengths[symbol];
+				if (!length) continue;
+				for (size_t k = reverse_bits(next[length]++, length); k < entries.size(); k += (size_t)1 << length)
+					entries[k] = (unsigned short)(symbol << 4 | length);
+			}
+			return true;
+		}
+
+		int decode(bit_reader_t &reader) const
+		{
+			if (reader.count < bits) reader.refill();
+			const unsigned short e = entries[reader.buffer & ((1u << bits) - 1)];
+			if (!e) return -1;
+			reader.buffer >>= e & 15;
+			reader.count -= e & 15;
+			return e >> 4;
+		}
+	};
+
+	bool read_dynamic_tables(bit_reader_t &reader, huffman_table_t &litlen, huffman_table_t &distance)
+	{
+		const int hlit = reader.bits(5) + 257;
+		const int hdist = reader.bits(5) + 1;
+		const int hclen = reader.bits(4) + 4;
+		if (hlit > 286 || hdist > 30) return false;
+		unsigned char cl_lengths[19] = { 0 };
+		for (int i = 0; i < hclen; i++) cl_lengths[code_length_order[i]] = (unsigned char)reader.bits(3);
+		huffman_table_t cl;
+		if (!cl.build(cl_lengths, 19)) return false;
+		unsigned char lengths[286 + 30];
+		const int total = hlit + hdist;
+		for (int i = 0; i < total;)
+		{
+			const int symbol = cl.decode(reader);
+			if (symbol < 0) return false;
+			if (symbol < 16)
+			{
+				lengths[i++] = (unsigned char)symbol;
+				continue;
+			}
+			int length = 0, run;
+			if (symbol == 16)
+			{
+				if (i == 0) return false;
+				length = lengths[i - 1];
+				run = 3 + reader.bits(2);
+			}
+			else if (symbol == 17)
+				run = 3 + reader.bits(3);
+			else
+				run = 11 + reader.bits(7);
+			if (i + run > total) return false;
+			memset(lengths + i, length, run);
+			i += run;
+		}
+		if (lengths[256] == 0) return false;
+		return litlen.build(lengths, hlit) && distance.build(lengths + hlit, hdist);
+	}
+
+	void fixed_tables(huffman_table_t &litlen, huffman_table_t &distance)
+	{
+		unsigned char lengths[288];
+		memset(lengths, 8, 144);
+		memset(lengths + 144, 9, 112);
+		memset(lengths + 256, 7, 24);
+		memset(lengths + 280, 8, 8);
+		litlen.build(lengths, 288);
+		memset(lengths, 5, 30);
+		distance.build(lengths, 30);
+	}
+}
+
+unsigned int crc32_update(unsigned int crc, const unsigned char *data, size_t size)
+{
+	struct crc_table_t
+	{
+		unsigned int entries[256];
+		crc_table_t()
+		{
+			for (unsigned int n = 0; n < 256; n++)
+			{
+				unsigned int c = n;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				entries[n] = c;
+			}
+		}
+	};
+	static const crc_table_t table;
+	crc = ~crc;
+	for (size_t i = 0; i < size; i++)
+		crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static const unsigned int adler_base = 65521;
+
+unsigned int adler32_update(unsigned int adler, const unsigned char *data, size_t size)
+{
+	unsigned int a = adler & 0xffff, b = adler >> 16;
+	while (size > 0)
+	{
+		// the largest run of bytes whose sums can't overflow 32 bits before the modulo
+		const size_t n = std::min(size, (size_t)5552);
+		for (size_t i = 0; i < n; i++)
+		{
+			a += data[i];
+			b += a;
+		}
+		a %= adler_base;
+		b %= adler_base;
+		data += n;
+		size -= n;
+	}
+	return b << 16 | a;
+}
+
+unsigned int adler32_combine(unsigned int adler1, unsigned int adler2, size_t size2)
+{
+	const unsigned int remainder = (unsigned int)(size2 % adler_base);
+	unsigned int a = adler1 & 0xffff;
+	unsigned int b = (unsigned int)(((unsigned long long)remainder * a) % adler_base);
+	a += (adler2 & 0xffff) + adler_base - 1;
+	b += (adler1 >> 16) + (adler2 >> 16) + adler_base - remainder;
+	if (a >= adler_base) a -= adler_base;
+	if (a >= adler_base) a -= adler_base;
+	if (b >= adler_base * 2) b -= adler_base * 2;
+	if (b >= adler_base) b -= adler_base;
+	return b << 16 | a;
+}
+
+void deflate_part(const unsigned char *data, size_t size, bool last, std::vector<unsigned char> &out)
+{
+	bit_writer_t writer(out);
+	// the newest position of every hash, and the position before it with the same hash, for the last window of positions
+	std::vector<int> head((size_t)1 << hash_bits, -1);
+	std::vector<int> prev(window_size, -1);
+	std::vector<lz_symbol_t> symbols;
+	symbols.reserve(block_symbols);
+	auto insert = [&](size_t pos)
+	{
+		if (pos + min_match > size) return;
+		const unsigned int h = hash3(data + pos);
+		prev[pos & (window_size - 1)] = head[h];
+		head[h] = (int)pos;
+	};
+
+	size_t i = 0;
+	while (i < size)
+	{
+		int best_length = 0, best_distance = 0;
+		if (i + min_match <= size)
+		{
+			const int max_length = (int)std::min(size - i, (size_t)max_match);
+			int candidate = head[hash3(data + i)];
+			for (int chain = max_chain; candidate >= 0 && chain > 0; chain--)
+			{
+				const int distance = (int)i - candidate;
+				if (distance > window_size) break;
+				if (data[candidate + best_length] == data[i + best_length])
+				{
+					int length = 0;
+					while (length < max_length && data[candidate + length] == data[i + length]) length++;
+					if (length > best_length)
+					{
+						best_length = length;
+						best_distance = distance;
+						if (length == max_length) break;
+					}
+				}
+				const int next = prev[candidate & (window_size - 1)];
+				if (next >= candidate) break;
+				candidate = next;
+			}
+		}
+		if (best_length >= min_match)
+		{
+			symbols.push_back({ (unsigned short)best_length, (unsigned short)best_distance });
+			for (int k = 0; k < best_length; k++) insert(i + k);
+			i += best_length;
+		}
+		else
+		{
+			symbols.push_back({ data[i], 0 });
+			insert(i);
+			i++;
+		}
+		if (symbols.size() >= block_symbols)
+		{
+			write_block(writer, symbols, false);
+			symbols.clear();
+		}
+	}
+	if (last || !symbols.empty())
+		write_block(writer, symbols, last);
+	if (!last)
+	{
+		// an empty stored block brings the part to a byte boundary
+		writer.put(0, 3);
+		writer.align();
+		writer.put(0, 16);
+		writer.put(0xffff, 16);
+	}
+	writer.align();
+}
+
+bool zlib_inflate(const unsigned char *data, size_t size, unsigned char *output, size_t output_size)
+{
+	if (size < 6) return false;
+	const int cmf = data[0], flg = data[1];
+	if ((cmf & 15) != 8 || (cmf >> 4) > 7 || (cmf * 256 + flg) % 31 != 0 || (flg & 0x20)) return false;
+	bit_reader_t reader(data + 2, data + size - 4);
+	huffman_table_t litlen, distance;
+	size_t out = 0;
+	bool final = false;
+	while (!final)
+	{
+		final = reader.bits(1) != 0;
+		const unsigned int type = reader.bits(2);
+		if (type == 0)
+		{
+			reader.align();
+			const unsigned int length = reader.bits(16);
+			const unsigned int nlength = reader.bits(16);
+			if ((length ^ 0xffff) != nlength || out + length > output_size) return false;
+			for (unsigned int k = 0; k < length; k++) output[out++] = (unsigned char)reader.bits(8);
+		}
+		else if (type == 1 || type == 2)
+		{
+			if (type == 1) fixed_tables(litlen, distance);
+			else if (!read_dynamic_tables(reader, litlen, distance)) return false;
+			for (;;)
+			{
+				int symbol = litlen.decode(reader);
+				if (symbol < 0) return false;
+				if (symbol < 256)
+				{
+					if (out >= output_size) return false;
+					output[out++] = (unsigned char)symbol;
+					continue;
+				}
+				if (symbol == 256) break;
+				symbol -= 257;
+				if (symbol >= 29) return false;
+				const size_t length = length_base[symbol] + reader.bits(length_extra[symbol]);
+				const int dsymbol = distance.decode(reader);
+				if (dsymbol < 0 || dsymbol >= 30) return false;
+				const size_t d = distance_base[dsymbol] + reader.bits(distance_extra[dsymbol]);
+				if (d > out || out + length > output_size) return false;
+				for (size_t k = 0; k < length; k++, out++) output[out] = output[out - d];
+			}
+		}
+		else
+			return false;
+		if (reader.overrun()) return false;
+	}
+	const unsigned char *trailer = data + size - 4;
+	const unsigned int adler = (unsigned int)trailer[0] << 24 | trailer[1] << 16 | trailer[2] << 8 | trailer[3];
+	return out == output_size && adler32_update(1, output, output_size) == adler;
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// the checksums of png chunks and zlib streams, crc starts from 0 and adler from 1
+unsigned int crc32_update(unsigned int crc, const unsigned char *data, size_t size);
+unsigned int adler32_update(unsigned int adler, const unsigned char *data, size_t size);
+// the adler32 of two parts joined, from the adler32 of each and the size of the second
+unsigned int adler32_combine(unsigned int adler1, unsigned int adler2, size_t size2);
+
+// compresses a part of a deflate stream and appends it to out, in blocks with dynamic huffman codes,
+// matching strings greedily within the part only. every part but the last ends with an empty stored block,
+// so it ends on a byte boundary, and parts compressed apart from each other (e.g. by several workers) can be joined.
+void deflate_part(const unsigned char *data, size_t size, bool last, std::vector<unsigned char> &out);
+
+// inflates a zlib stream into exactly output_size bytes, false if the stream is broken, or its size or checksum is wrong
+bool zlib_inflate(const unsigned char *data, size_t size, unsigned char *output, size_t output_size);
@@ -0,0 +1,198 @@
+#include "pch.h"
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include "feather.h"
+#include "simd.h"
+#include "jobsystem.h"
+
+gaussian_kernel_t::gaussian_kernel_t(float sigma)
+	:radius(sigma > 0 ? (int)std::ceil(sigma * 3) : 0)
+{
+	std::vector<double> g(taps());
+	double sum = 0;
+	for (int k = 0; k < taps(); k++)
+	{
+		const double d = k - radius;
+		g[k] = radius > 0 ? std::exp(-d * d / (2.0 * sigma * sigma)) : 1.0;
+		sum += g[k];
+	}
+	// the rounding error goes to the center tap, so the weights sum to exactly one
+	weights.assign(taps() + 1, 0);
+	int total = 0;
+	for (int k = 0; k < taps(); k++)
+	{
+		weights[k] = (short)std::lround(g[k] / sum * (1 << weight_bits));
+		total += weights[k];
+	}
+	weights[radius] += (short)((1 << weight_bits) - total);
+}
+
+// the horizontally blurred rows keep 7 fractional bits, so the vertical pass still fits the products in 32 bits
+static const int row_fraction_bits = 7;
+static const int row_shift = gaussian_kernel_t::weight_bits - row_fraction_bits;
+static const int column_shift = gaussian_kernel_t::weight_bits + row_fraction_bits;
+
+// filters a row of the mask horizontally, repeating the border pixels.
+// padded is scratch space for width + 2 * radius + 1 pixels.
+static void blur_row(const unsigned char *in, short *out, int width, const gaussian_kernel_t &kernel, unsigned char *padded)
+{
+	const int r = kernel.radius;
+	const short *w = kernel.weights.data();
+	for (int i = 0; i < width + r * 2 + 1; i++)
+		padded[i] = in[std::min(std::max(i - r, 0), width - 1)];
+	int x = 0;
+#ifdef WTG_SIMD_SSE2
+	// eight pixels per step. taps k and k + 1 are interleaved, so one madd applies a pair of weights.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i rounding = _mm_set1_epi32(1 << (row_shift - 1));
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i lo = rounding, hi = rounding;
+		for (int k = 0; k < kernel.taps(); k += 2)
+		{
+			const __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(padded + x + k)), zero);
+			const __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(padded + x + k + 1)), zero);
+			const __m128i wk = _mm_set1_epi32((int)(((unsigned)(unsigned short)w[k + 1] << 16) | (unsigned short)w[k]));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+		}
+		_mm_storeu_si128((__m128i *)(out + x), _mm_packs_epi32(_mm_srai_epi32(lo, row_shift), _mm_srai_epi32(hi, row_shift)));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int sum = 1 << (row_shift - 1);
+		for (int k = 0; k < kernel.taps(); k++)
+			sum += padded[x + k] * w[k];
+		out[x] = (short)(sum >> row_shift);
+	}
+}
+
+// filters the horizontally blurred rows vertically into a row of the blurred mask.
+// rows holds the taps + 1 rows centered on the output row, the last one repeats the one before and has zero weight.
+static void blur_column(const short *const *rows, unsigned char *out, int width, const gaussian_kernel_t &kernel)
+{
+	const short *w = kernel.weights.data();
+	int x = 0;
+#ifdef WTG_SIMD_SSE2
+	const __m128i rounding = _mm_set1_epi32(1 << (column_shift - 1));
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i lo = rounding, hi = rounding;
+		for (int k = 0; k < kernel.taps(); k += 2)
+		{
+			const __m128i a = _mm_loadu_si128((const __m128i *)(rows[k] + x));
+			const __m128i b = _mm_loadu_si128((const __m128i *)(rows[k + 1] + x));
+			const __m128i wk = _mm_set1_epi32((int)(((unsigned)(unsigned short)w[k + 1] << 16) | (unsigned short)w[k]));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
+		}
+		const __m128i sum = _mm_packs_epi32(_mm_srai_epi32(lo, column_shift), _mm_srai_epi32(hi, column_shift));
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(sum, sum));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		int sum = 1 << (column_shift - 1);
+		for (int k = 0; k < kernel.taps(); k++)
+			sum += rows[k][x] * w[k];
+		out[x] = (unsigned char)std::min(sum >> column_shift, 255);
+	}
+}
+
+// (c * a + s * (255 - a)) / 255 rounded to the nearest, which fits 16 bits all along
+inline unsigned char blend_channel(int s, int c, int a)
+{
+	const int t = c * a + s * (255 - a) + 128;
+	return (unsigned char)((t + (t >> 8)) >> 8);
+}
+
+// composites a row of the corners over a row of the source by the alpha of every pixel.
+// alpha3 is scratch space for 3 * width bytes, which holds the alpha of every channel.
+static void blend_row(const color_t *source, const color_t *corners, const unsigned char *alpha, color_t *out, int width, unsigned char *alpha3)
+{
+	for (int x = 0; x < width; x++)
+		alpha3[x * 3] = alpha3[x * 3 + 1] = alpha3[x * 3 + 2] = alpha[x];
+	const unsigned char *s = (const unsigned char *)source;
+	const unsigned char *c = (const unsigned char *)corners;
+	unsigned char *o = (unsigned char *)out;
+	const int bytes = width * 3;
+	int i = 0;
+#ifdef WTG_SIMD_SSE2
+	// sixteen channels per step, blended in 16 bits
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_set1_epi8(-1);
+	const __m128i rounding = _mm_set1_epi16(128);
+	auto blend = [rounding](__m128i s, __m128i c, __m128i a, __m128i na)
+	{
+		__m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(c, a), _mm_mullo_epi16(s, na)), rounding);
+		return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+	};
+	for (; i + 16 <= bytes; i += 16)
+	{
+		const __m128i vs = _mm_loadu_si128((const __m128i *)(s + i));
+		const __m128i vc = _mm_loadu_si128((const __m128i *)(c + i));
+		const __m128i va = _mm_loadu_si128((const __m128i *)(alpha3 + i));
+		const __m128i vna = _mm_xor_si128(va, ones);
+		const __m128i lo = blend(_mm_unpacklo_epi8(vs, zero), _mm_unpacklo_epi8(vc, zero), _mm_unpacklo_epi8(va, zero), _mm_unpacklo_epi8(vna, zero));
+		const __m128i hi = blend(_mm_unpackhi_epi8(vs, zero), _mm_unpackhi_epi8(vc, zero), _mm_unpackhi_epi8(va, zero), _mm_unpackhi_epi8(vna, zero));
+		_mm_storeu_si128((__m128i *)(o + i), _mm_packus_epi16(lo, hi));
+	}
+#endif
+	for (; i < bytes; i++)
+		o[i] = blend_channel(s[i], c[i], alpha3[i]);
+}
+
+void feather_composite(const image_view_t &source, const image_view_t &corners, const mask_view_t &mask, float sigma,
+	image_view_t output, mask_view_t feathered_mask)
+{
+	const int resolution = mask.resolution;
+	const gaussian_kernel_t kernel(sigma);
+	const int r = kernel.radius;
+	const int taps = kernel.taps();
+	// a chunk covers about 64k pixels, and is 16 radii tall at least, since the 2 * radius rows
+	// around it are blurred horizontally by both of its neighbours.
+	const int grain = std::max(std::max(1, 65536 / std::max(resolution, 1)), r * 16);
+	jobsystem_t::shared().parallel_for(0, resolution, grain, [&](int y_begin, int y_end)
+	{
+		std::vector<unsigned char> padded(resolution + r * 2 + 1);
+		std::vector<unsigned char> alpha(resolution);
+		std::vector<unsigned char> alpha3(resolution * 3);
+		// the horizontally blurred rows y - radius to y + radius, in a ring
+		std::vector<short> ring(taps * resolution);
+		std::vector<const short *> rows(taps + 1);
+		auto ring_row = [&](int y) { return &ring[(((y % taps) + taps) % taps) * resolution]; };
+		auto blur_into_ring = [&](int y)
+		{
+			const int mask_y = std::min(std::max(y, 0), resolution - 1);
+			blur_row(mask.pixels + mask_y * resolution, ring_row(y), resolution, kernel, padded.data());
+		};
+		if (r > 0)
+		{
+			for (int y = y_begin - r; y < y_begin + r; y++)
+				blur_into_ring(y);
+		}
+		for (int y = y_begin; y < y_end; y++)
+		{
+			const unsigned char *mask_row = mask.pixels + y * resolution;
+			unsigned char *alpha_row = feathered_mask.pixels ? feathered_mask.pixels + y * resolution : alpha.data();
+			const unsigned char *blend_alpha = alpha_row;
+			if (r > 0)
+			{
+				blur_into_ring(y + r);
+				for (int k = 0; k < taps; k++)
+					rows[k] = ring_row(y - r + k);
+				rows[taps] = rows[taps - 1];
+				blur_column(rows.data(), alpha_row, resolution, kernel);
+			}
+			else if (feathered_mask.pixels)
+				memcpy(alpha_row, mask_row, resolution);
+			else
+				blend_alpha = mask_row;
+
+			if (output.pixels)
+				blend_row(source.row(y), corners.row(y), blend_alpha, output.row(y), resolution, alpha3.data());
+		}
+	});
+}
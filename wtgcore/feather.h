@@ -0,0 +1,25 @@
+#pragma once
+
+#include <vector>
+#include "common_types.h"
+
+// a normalized gaussian kernel in 14 bit fixed point, truncated at 3 standard deviations.
+// weights holds the 2 * radius + 1 taps followed by a zero, so the vector kernels can take the taps in pairs.
+struct gaussian_kernel_t
+{
+	int radius;
+	std::vector<short> weights;
+
+	static const int weight_bits = 14;
+
+	explicit gaussian_kernel_t(float sigma);
+	int taps() const { return radius * 2 + 1; }
+};
+
+// blurs the mask with a gaussian of the given standard deviation, like GaussianBlur(sigma) of PIL,
+// and composites the corners over the source by the blurred mask: output = (corners * a + source * (255 - a)) / 255.
+// the rows are blurred and blended in one pass, in chunks of rows split among the workers,
+// so the blurred mask is never stored unless feathered_mask has pixels.
+// a sigma of zero or less composites by the mask as it is. output and feathered_mask may be empty to skip them.
+void feather_composite(const image_view_t &source, const image_view_t &corners, const mask_view_t &mask, float sigma,
+	image_view_t output, mask_view_t feathered_mask);
@@ -0,0 +1,292 @@
+#include "pch.h"
+#include <cstring>
+#include "fileio.h"
+#include "simd.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+mapped_file_t::mapped_file_t()
+{
+	release();
+}
+
+mapped_file_t::mapped_file_t(mapped_file_t &&other)
+{
+	take(other);
+}
+
+mapped_file_t &mapped_file_t::operator = (mapped_file_t &&other)
+{
+	if (this == &other) return *this;
+	close();
+	take(other);
+	return *this;
+}
+
+void mapped_file_t::take(mapped_file_t &other)
+{
+	bytes = other.bytes;
+	length = other.length;
+	writable = other.writable;
+#ifdef _WIN32
+	file_handle = other.file_handle;
+	mapping_handle = other.mapping_handle;
+#else
+	fd = other.fd;
+#endif
+	other.release();
+}
+
+void mapped_file_t::release()
+{
+	bytes = NULL;
+	length = 0;
+	writable = false;
+#ifdef _WIN32
+	file_handle = INVALID_HANDLE_VALUE;
+	mapping_handle = NULL;
+#else
+	fd = -1;
+#endif
+}
+
+#ifdef _WIN32
+bool mapped_file_t::open_read(const char *path)
+{
+	close();
+	file_handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	LARGE_INTEGER file_size;
+	if (file_handle == INVALID_HANDLE_VALUE || !GetFileSizeEx(file_handle, &file_size) || file_size.QuadPart == 0)
+	{
+		close();
+		return false;
+	}
+	length = (size_t)file_size.QuadPart;
+	mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping_handle) bytes = (unsigned char *)MapViewOfFile(mapping_handle, FILE_MAP_READ, 0, 0, length);
+	if (!bytes)
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+bool mapped_file_t::create(const char *path, size_t size)
+{
+	close();
+	file_handle = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file_handle == INVALID_HANDLE_VALUE || size == 0)
+	{
+		close();
+		return false;
+	}
+	// the mapping grows the file to its size
+	length = size;
+	mapping_handle = CreateFileMappingA(file_handle, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, NULL);
+	if (mapping_handle) bytes = (unsigned char *)MapViewOfFile(mapping_handle, FILE_MAP_WRITE, 0, 0, length);
+	if (!bytes)
+	{
+		close();
+		return false;
+	}
+	writable = true;
+	return true;
+}
+
+void mapped_file_t::close()
+{
+	if (bytes) UnmapViewOfFile(bytes);
+	if (mapping_handle) CloseHandle(mapping_handle);
+	if (file_handle != INVALID_HANDLE_VALUE) CloseHandle(file_handle);
+	release();
+}
+#else
+bool mapped_file_t::open_read(const char *path)
+{
+	close();
+	fd = ::open(path, O_RDONLY);
+	struct stat file_stat;
+	if (fd < 0 || fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+	{
+		close();
+		return false;
+	}
+	length = (size_t)file_stat.st_size;
+	void *p = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	bytes = (unsigned char *)p;
+	return true;
+}
+
+bool mapped_file_t::create(const char *path, size_t size)
+{
+	close();
+	fd = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0 || size == 0 || ftruncate(fd, (off_t)size) != 0)
+	{
+		close();
+		return false;
+	}
+	length = size;
+	void *p = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+	{
+		close();
+		return false;
+	}
+	bytes = (unsigned char *)p;
+	writable = true;
+	return true;
+}
+
+void mapped_file_t::close()
+{
+	if (bytes) munmap(bytes, length);
+	if (fd >= 0) ::close(fd);
+	release();
+}
+#endif
+
+shared_memory_t::shared_memory_t()
+{
+	release();
+}
+
+shared_memory_t::shared_memory_t(shared_memory_t &&other)
+{
+	take(other);
+}
+
+shared_memory_t &shared_memory_t::operator = (shared_memory_t &&other)
+{
+	if (this == &other) return *this;
+	close();
+	take(other);
+	return *this;
+}
+
+void shared_memory_t::take(shared_memory_t &other)
+{
+	bytes = other.bytes;
+	length = other.length;
+	name = std::move(other.name);
+#ifdef _WIN32
+	mapping_handle = other.mapping_handle;
+#endif
+	other.release();
+}
+
+void shared_memory_t::release()
+{
+	bytes = NULL;
+	length = 0;
+	name.clear();
+#ifdef _WIN32
+	mapping_handle = NULL;
+#endif
+}
+
+#ifdef _WIN32
+bool shared_memory_t::create(const char *region_name, size_t size)
+{
+	close();
+	if (size == 0) return false;
+	// the region is backed by the paging file
+	mapping_handle = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((unsigned long long)size >> 32), (DWORD)size, region_name);
+	if (mapping_handle && GetLastError() == ERROR_ALREADY_EXISTS)
+	{
+		close();
+		return false;
+	}
+	if (mapping_handle) bytes = (unsigned char *)MapViewOfFile(mapping_handle, FILE_MAP_WRITE, 0, 0, size);
+	if (!bytes)
+	{
+		close();
+		return false;
+	}
+	length = size;
+	name = region_name;
+	return true;
+}
+
+void shared_memory_t::close()
+{
+	if (bytes) UnmapViewOfFile(bytes);
+	if (mapping_handle) CloseHandle(mapping_handle);
+	release();
+}
+#else
+bool shared_memory_t::create(const char *region_name, size_t size)
+{
+	close();
+	if (size == 0) return false;
+	int fd = shm_open(region_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) return false;
+	void *p = ftruncate(fd, (off_t)size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+	::close(fd);
+	if (p == MAP_FAILED)
+	{
+		shm_unlink(region_name);
+		return false;
+	}
+	bytes = (unsigned char *)p;
+	length = size;
+	name = region_name;
+	return true;
+}
+
+void shared_memory_t::close()
+{
+	if (bytes)
+	{
+		munmap(bytes, length);
+		shm_unlink(name.c_str());
+	}
+	release();
+}
+#endif
+
+void interleave_rgba_row(const color_t *rgb, const unsigned char *alpha, unsigned char *out, int width)
+{
+	int x = 0;
+#ifdef WTG_SIMD_SSE2
+	// four pixels per step: each pixel of the 12 color bytes is shifted to its own 32 bit lane, and the alpha is or'ed on top.
+	// the load reads 4 bytes past the four pixels, so the step stops before the last two pixels of the row.
+	const unsigned char *p = (const unsigned char *)rgb;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i lane0 = _mm_setr_epi32(0xffffff, 0, 0, 0);
+	const __m128i lane1 = _mm_setr_epi32(0, 0xffffff, 0, 0);
+	const __m128i lane2 = _mm_setr_epi32(0, 0, 0xffffff, 0);
+	const __m128i lane3 = _mm_setr_epi32(0, 0, 0, 0xffffff);
+	for (; x + 6 <= width; x += 4)
+	{
+		const __m128i v = _mm_loadu_si128((const __m128i *)(p + x * 3));
+		__m128i c = _mm_or_si128(_mm_and_si128(v, lane0), _mm_and_si128(_mm_slli_si128(v, 1), lane1));
+		c = _mm_or_si128(c, _mm_or_si128(_mm_and_si128(_mm_slli_si128(v, 2), lane2), _mm_and_si128(_mm_slli_si128(v, 3), lane3)));
+		int a4;
+		memcpy(&a4, alpha + x, sizeof(a4));
+		__m128i a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(a4), zero), zero);
+		_mm_storeu_si128((__m128i *)(out + x * 4), _mm_or_si128(c, _mm_slli_epi32(a, 24)));
+	}
+#endif
+	for (; x < width; x++)
+	{
+		out[x * 4] = rgb[x].r;
+		out[x * 4 + 1] = rgb[x].g;
+		out[x * 4 + 2] = rgb[x].b;
+		out[x * 4 + 3] = alpha[x];
+	}
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include "common_types.h"
+
+// a whole file mapped into memory, either an existing file read-only, or a new file of a given size for writing.
+// the pages are read and written by the os as they are touched, so the pixels go between the file and the images
+// without any buffer in between, and without a libc call per row or pixel.
+class mapped_file_t
+{
+public:
+	mapped_file_t();
+	mapped_file_t(mapped_file_t &&other);
+	mapped_file_t(const mapped_file_t &) = delete;
+	~mapped_file_t() { close(); }
+	mapped_file_t &operator = (mapped_file_t &&other);
+	mapped_file_t &operator = (const mapped_file_t &) = delete;
+
+	bool open_read(const char *path);
+	// creates or truncates the file to the size, and maps it for writing
+	bool create(const char *path, size_t size);
+	// unmaps the file, the written pages are flushed to it by the os
+	void close();
+
+	const unsigned char *data() const { return bytes; }
+	unsigned char *writable_data() { return writable ? bytes : NULL; }
+	size_t size() const { return length; }
+
+private:
+	void take(mapped_file_t &other);
+	void release();
+
+	unsigned char *bytes;
+	size_t length;
+	bool writable;
+#ifdef _WIN32
+	void *file_handle;
+	void *mapping_handle;
+#else
+	int fd;
+#endif
+};
+
+// a named region of memory created by this process, for handing the pixels to another process without a file.
+// the other process opens it by its name, with shm_open on posix and OpenFileMapping on windows.
+// names start with a slash on posix, windows names may start with Local\ to stay within the session.
+class shared_memory_t
+{
+public:
+	shared_memory_t();
+	shared_memory_t(shared_memory_t &&other);
+	shared_memory_t(const shared_memory_t &) = delete;
+	~shared_memory_t() { close(); }
+	shared_memory_t &operator = (shared_memory_t &&other);
+	shared_memory_t &operator = (const shared_memory_t &) = delete;
+
+	// fails if the name is taken
+	bool create(const char *name, size_t size);
+	// unmaps the region and removes its name. on posix a process which opened it keeps its mapping,
+	// on windows the region lives as long as any process holds it open.
+	void close();
+
+	unsigned char *data() { return bytes; }
+	size_t size() const { return length; }
+	const std::string &get_name() const { return name; }
+
+private:
+	void take(shared_memory_t &other);
+	void release();
+
+	unsigned char *bytes;
+	size_t length;
+	std::string name;
+#ifdef _WIN32
+	void *mapping_handle;
+#endif
+};
+
+// packs a row of colors and a row of alpha into rgba bytes
+void interleave_rgba_row(const color_t *rgb, const unsigned char *alpha, unsigned char *out, int width);
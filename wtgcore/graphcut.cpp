@@ -1,181 +1,758 @@
 #include "pch.h"
 #include "graphcut.h"
 #include <iostream>
+#include <algorithm>
+#include "jobsystem.h"
+
+const int edge_none = -1;
+const int edge_terminal = -2; // the infinite link between a constrained pixel and its terminal
 
 // patch a (the source) is put on a layer over patch b (the sink).
 // this class generates a best-matching mask of patch a, given the initial constraints.
-graphcut_t::graphcut_t(image_t image_a, patch_t patch_a, image_t image_b, patch_t patch_b, image_t constraints)
-	:image_a(image_a), patch_a(patch_a), image_b(image_b), patch_b(patch_b), constraints(constraints)
+graphcut_t::graphcut_t(const image_patch_view_t &patch_a, const image_patch_view_t &patch_b, const image_view_t &constraints)
+	:graphcut_t(patch_a, patch_b, constraints, seam_cost_normalized_l2_t())
+{
+}
+
+bool graphcut_t::check_patch_size(int size_a, int size_b)
 {
-	patch_size = patch_a.size;
-	if (patch_size < 2 || patch_size != patch_b.size)
+	patch_size = size_a;
+	if (patch_size < 2 || patch_size != size_b)
 	{
 		std::cerr << "invalid patch size\n";
-		exit(-1);
+		return false;
 	}
-	graph.nodes.resize(patch_size * patch_size + 2);
-
-	node_t &source = get_source_node();
-	node_t &sink = get_sink_node();
-#ifdef _DEBUG
-	source.coord_x = source.coord_y = -2;
-	sink.coord_x = sink.coord_y = -1;
-#endif
+	return true;
+}
 
+// the graph holds the free pixels, and the pinned pixels next to them, which link them to the terminals.
+// when they are under a quarter of the patch, e.g. when refining a seam within a band, only they are in the graph,
+// so its size follows the length of the seam instead of the area of the patch. otherwise it's the whole grid.
+void graphcut_t::find_graph_pixels()
+{
+	std::vector<pixel_runs_t::run_t> &runs = graph_pixels.runs;
+	graph_pixels.row_runs.resize(patch_size + 1);
+	std::vector<unsigned char> free_rows[3];
+	for (int i = 0; i < 3; i++)
+		free_rows[i].assign(patch_size, 0);
+	auto fill_free_row = [&](int y, std::vector<unsigned char> &row)
+	{
+		for (int x = 0; x < patch_size; x++)
+			row[x] = y >= 0 && y < patch_size && constraints.get_pixel(x, y) == CONSTRAINT_COLOR_FREE;
+	};
+	fill_free_row(0, free_rows[1]);
+	int node_count = 0;
 	for (int y = 0; y < patch_size; y++)
 	{
+		// the free pixels of the rows y - 1, y and y + 1
+		fill_free_row(y + 1, free_rows[(y + 2) % 3]);
+		const unsigned char *below = free_rows[y % 3].data(), *at = free_rows[(y + 1) % 3].data(), *above = free_rows[(y + 2) % 3].data();
+		graph_pixels.row_runs[y] = (int)runs.size();
+		bool in_run = false;
 		for (int x = 0; x < patch_size; x++)
 		{
+			const bool in_graph = at[x] || below[x] || above[x] || (x > 0 && at[x - 1]) || (x < patch_size - 1 && at[x + 1]);
+			if (in_graph && !in_run)
+			{
+				pixel_runs_t::run_t run = { x, y, 0, node_count };
+				runs.push_back(run);
+			}
+			if (in_graph)
+			{
+				runs.back().count++;
+				node_count++;
+			}
+			in_run = in_graph;
+		}
+	}
+	graph_pixels.row_runs[patch_size] = (int)runs.size();
+	graph_pixels.node_count = node_count;
+	if ((size_t)node_count * 4 < (size_t)patch_size * patch_size) return;
+
+	runs.clear();
+	for (int y = 0; y < patch_size; y++)
+	{
+		pixel_runs_t::run_t run = { 0, y, patch_size, y * patch_size };
+		graph_pixels.row_runs[y] = y;
+		runs.push_back(run);
+	}
+	graph_pixels.row_runs[patch_size] = patch_size;
+	graph_pixels.node_count = patch_size * patch_size;
+}
+
+void graphcut_t::build_graph(const seam_costs_t &costs)
+{
+	const std::vector<pixel_runs_t::run_t> &runs = graph_pixels.runs;
+	if (graph_pixels.node_count < patch_size * patch_size)
+		graph.init_compact(graph_pixels.node_count);
+	else
+		graph.init(patch_size);
+	for (size_t i = 0; i < runs.size(); i++)
+	{
+		const pixel_runs_t::run_t &run = runs[i];
+		for (int k = 0; k < run.count; k++)
+		{
+			const int x = run.x + k, y = run.y, node = run.first_node + k;
 			color_t constraint = constraints.get_pixel(x, y);
+			unsigned char &terminal = graph.terminal[node];
 			if (constraint == CONSTRAINT_COLOR_SOURCE)
-				make_edge(x, y, source);
+				terminal = terminal_source;
 			else if (constraint == CONSTRAINT_COLOR_SINK)
-				make_edge(x, y, sink);
-			if (y > 0) make_edge(x, y, x, y - 1);
-			if (y < patch_size - 1) make_edge(x, y, x, y + 1);
-			if (x > 0) make_edge(x, y, x - 1, y);
-			if (x < patch_size - 1) make_edge(x, y, x + 1, y);
-#ifdef _DEBUG
-			node_t &node = get_pixel_node(x, y);
-			node.coord_x = x;
-			node.coord_y = y;
-#endif
+				terminal = terminal_sink;
+			if (terminal != terminal_none) edge_count++;
+			if (k < run.count - 1) make_edge(node, node + 1, x, y, x + 1, y, grid_east, costs.horizontal[node]);
 		}
 	}
+	for (int y = 0; y < patch_size - 1; y++)
+	{
+		graph_pixels.for_each_vertical_overlap(y, [&](int x, int count, const pixel_runs_t::run_t &run, const pixel_runs_t::run_t &next_run)
+		{
+			const int node = run.first_node + x - run.x, next_node = next_run.first_node + x - next_run.x;
+			for (int k = 0; k < count; k++)
+				make_edge(node + k, next_node + k, x + k, y, x + k, y + 1, grid_north, costs.vertical[node + k]);
+		});
+	}
 }
 
 graphcut_t::~graphcut_t()
 {
 }
 
-void graphcut_t::bfs(bool stop_on_sink)
+// search the residual graph from all the pixels linked to the source.
+// returns the first reached pixel linked to the sink if stop_on_sink is true, otherwise -1.
+int graphcut_t::bfs(bool stop_on_sink)
 {
-	node_t &source = get_source_node();
-	node_t &sink = get_sink_node();
-	for (size_t i = 0; i < graph.nodes.size(); i++)
+	const int node_count = graph.node_count();
+	bfs_prev_edge.assign(node_count, edge_none);
+	bfs_queue.clear();
+	for (int i = 0; i < node_count; i++)
 	{
-		graph.nodes[i].prev = NULL;
-		graph.nodes[i].prev_edge = NULL;
+		if (graph.terminal[i] != terminal_source) continue;
+		bfs_prev_edge[i] = edge_terminal;
+		bfs_queue.push_back(i);
 	}
 
-	while (bfs_queue.size() > 0) bfs_queue.pop();
-	bfs_queue.push(&source);
-	source.prev = &source;
-
-	while (bfs_queue.size() > 0)
+	for (size_t head = 0; head < bfs_queue.size(); head++)
 	{
-		node_t &cur = *bfs_queue.front();
-		bfs_queue.pop();
-		for (auto it = cur.neighbors.begin(), itend = cur.neighbors.end(); it != itend; ++it)
+		int cur = bfs_queue[head];
+		visited_nodes++;
+		if (stop_on_sink && graph.terminal[cur] == terminal_sink) return cur;
+		for (int d = 0; d < grid_direction_count; d++)
 		{
-			edge_t &edge = *it;
-			node_t &next = *edge.node;
-			if (next.prev != NULL) continue;
-			if (edge.capacity == infinite_capacity || edge.flow < edge.capacity)
-			{
-				next.prev = &cur;
-				next.prev_edge = &edge;
-				bfs_queue.push(&next);
-			}
+			int edge = graph.edge_index(cur, d);
+			if (graph.residual[edge] <= 0) continue;
+			int next = graph.edge_head(edge);
+			if (bfs_prev_edge[next] != edge_none) continue;
+			bfs_prev_edge[next] = edge;
+			bfs_queue.push_back(next);
 		}
-		if (stop_on_sink && sink.prev != NULL) break;
 	}
+	return -1;
+}
+
+// the bottleneck edge is snapped to zero residual so that rounding never leaves a tiny capacity behind.
+void graphcut_t::push_flow(int edge, float flow)
+{
+	float &residual = graph.residual[edge];
+	residual = residual <= flow ? 0.0f : residual - flow;
+	graph.residual[graph.reverse_edge(edge)] += flow;
 }
 
 // get a mask which should be applied to patch a
-void graphcut_t::compute_cut_mask(mask_t mask_image, patch_t mask_patch, algorithm_statistics_t &statistics)
+bool graphcut_t::compute_cut_mask(const mask_patch_view_t &mask, algorithm_statistics_t &statistics)
 {
-	if (patch_size != mask_patch.size)
+	if (!valid) return false;
+	if (patch_size != mask.size)
 	{
 		std::cerr << "invalid mask patch size\n";
-		exit(-1);
+		return false;
+	}
+	statistics = algorithm_statistics_t();
+	statistics.construction_seconds = construction_seconds;
+	statistics.edge_count = edge_count;
+	auto start = std::chrono::steady_clock::now();
+	visited_nodes = 0;
+
+	// calculate the max flow of the graph.
+	maxflow_solver_t actual_solver = solver;
+	if (actual_solver == maxflow_solver_auto)
+		actual_solver = worker_count >= auto_push_relabel_workers ? maxflow_solver_push_relabel : maxflow_solver_boykov_kolmogorov;
+	switch (actual_solver)
+	{
+	case maxflow_solver_dinic: solve_dinic(statistics); break;
+	case maxflow_solver_push_relabel: solve_push_relabel(statistics); break;
+	case maxflow_solver_edmonds_karp: solve_edmonds_karp(statistics); break;
+	default: solve_boykov_kolmogorov(statistics); break;
+	}
+	statistics.graph_memory = graph_memory();
+
+	// find the cut by the reachable set from source in the residual graph
+	bfs(false);
+	statistics.visited_nodes = visited_nodes;
+	statistics.solve_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	// fill the mask, the pixels out of the graph are pinned to the side they are on
+	if (graph_pixels.node_count < patch_size * patch_size)
+	{
+		for (int y = 0; y < patch_size; y++)
+			for (int x = 0; x < patch_size; x++)
+				mask.set_pixel(x, y, constraints.get_pixel(x, y) == CONSTRAINT_COLOR_SOURCE ? 255 : 0);
+	}
+	for (size_t i = 0; i < graph_pixels.runs.size(); i++)
+	{
+		const pixel_runs_t::run_t &run = graph_pixels.runs[i];
+		for (int k = 0; k < run.count; k++)
+		{
+			bool reachable = bfs_prev_edge[run.first_node + k] != edge_none;
+			mask.set_pixel(run.x + k, run.y, reachable ? 255 : 0);
+		}
 	}
-	statistics.iteration_count = 0;
-	statistics.max_flow = 0;
+	return true;
+}
 
-	// calculate the max flow of the graph
-	node_t &source = get_source_node();
-	node_t &sink = get_sink_node();
+// the reference solver, which runs a full bfs from the source for every augmenting path.
+void graphcut_t::solve_edmonds_karp(algorithm_statistics_t &statistics)
+{
 	while (1)
 	{
 		statistics.iteration_count++;
 		// find augmenting path
-		bfs(true);
-		if (sink.prev == NULL) break;
+		int sink_side = bfs(true);
+		if (sink_side < 0) break;
 
 		// find min flow on this path
-		node_t *pnode = &sink;
-		float flow = infinite_capacity;
-		while (pnode != &source)
-		{
-			edge_t *edge = pnode->prev_edge;
-			float remain_cap = edge->capacity == infinite_capacity ? infinite_capacity : edge->capacity - edge->flow;
-			if (flow == infinite_capacity)
-				flow = remain_cap;
+		float flow = graph.residual[bfs_prev_edge[sink_side]];
+		unsigned int length = 0;
+		for (int edge = bfs_prev_edge[sink_side]; edge != edge_terminal; edge = bfs_prev_edge[graph.edge_tail(edge)], length++)
+			flow = std::min(flow, graph.residual[edge]);
+		statistics.add_augmenting_path(length);
+		// add this flow
+		for (int edge = bfs_prev_edge[sink_side]; edge != edge_terminal; edge = bfs_prev_edge[graph.edge_tail(edge)])
+			push_flow(edge, flow);
+		statistics.max_flow += flow;
+	}
+}
+
+// the solver proposed by the paper "An Experimental Comparison of Min-Cut/Max-Flow Algorithms for Energy Minimization in Vision".
+// two search trees are grown from the source and the sink, and they are kept across augmentations.
+// nodes cut off from their trees by saturated edges are re-attached (adopted) instead of searching from scratch.
+// the pixels linked to a terminal are the roots of its tree, and a node's tree is tagged by the terminal it leads to.
+void graphcut_t::solve_boykov_kolmogorov(algorithm_statistics_t &statistics)
+{
+	const int node_count = graph.node_count();
+	search_nodes.resize(node_count);
+	active_nodes.clear();
+	orphan_nodes.clear();
+	bk_time = 0;
+	for (int i = 0; i < node_count; i++)
+	{
+		search_node_t &node = search_nodes[i];
+		node.tree = graph.terminal[i];
+		node.parent = node.tree == terminal_none ? edge_none : edge_terminal;
+		node.active = false;
+		node.timestamp = 0;
+		node.dist = 0;
+		if (node.tree != terminal_none) bk_set_active(i);
+	}
+
+	while (1)
+	{
+		statistics.iteration_count++;
+		int mid_edge = bk_grow();
+		if (mid_edge == edge_none) break;
+
+		bk_time++;
+		statistics.max_flow += bk_augment(mid_edge, statistics);
+		bk_adopt();
+	}
+}
+
+void graphcut_t::bk_set_active(int node)
+{
+	if (search_nodes[node].active) return;
+	search_nodes[node].active = true;
+	active_nodes.push_back(node);
+}
+
+void graphcut_t::bk_set_orphan(int node)
+{
+	search_nodes[node].parent = edge_none;
+	orphan_nodes.push_back(node);
+}
+
+// grow both search trees until they touch, returns the edge from the source tree into the sink tree.
+int graphcut_t::bk_grow()
+{
+	while (active_nodes.size() > 0)
+	{
+		int cur_index = active_nodes.front();
+		search_node_t &cur = search_nodes[cur_index];
+		if (cur.tree != terminal_none)
+		{
+			visited_nodes++;
+			for (int d = 0; d < grid_direction_count; d++)
+			{
+				int edge = graph.edge_index(cur_index, d);
+				int edge_to_cur = graph.reverse_edge(edge);
+				// the tree edge always points away from the root
+				if (graph.residual[cur.tree == terminal_source ? edge : edge_to_cur] <= 0) continue;
+
+				search_node_t &next = search_nodes[graph.edge_head(edge)];
+				if (next.tree == terminal_none)
+				{
+					next.tree = cur.tree;
+					next.parent = edge_to_cur;
+					next.timestamp = cur.timestamp;
+					next.dist = cur.dist + 1;
+					bk_set_active(graph.edge_head(edge));
+				}
+				else if (next.tree != cur.tree)
+				{
+					// keep the current node active, it may still touch the other tree elsewhere
+					return cur.tree == terminal_source ? edge : edge_to_cur;
+				}
+				else if (next.timestamp <= cur.timestamp && next.dist > cur.dist + 1)
+				{
+					// prefer shorter paths to the root
+					next.parent = edge_to_cur;
+					next.timestamp = cur.timestamp;
+					next.dist = cur.dist + 1;
+				}
+			}
+		}
+		active_nodes.pop_front();
+		cur.active = false;
+	}
+	return edge_none;
+}
+
+float graphcut_t::bk_augment(int mid_edge, algorithm_statistics_t &statistics)
+{
+	int source_side = graph.edge_tail(mid_edge);
+	int sink_side = graph.edge_head(mid_edge);
+
+	// find min flow on this path
+	float flow = graph.residual[mid_edge];
+	unsigned int length = 1;
+	for (int node = source_side; search_nodes[node].parent != edge_terminal; node = graph.edge_head(search_nodes[node].parent), length++)
+		flow = std::min(flow, graph.residual[graph.reverse_edge(search_nodes[node].parent)]);
+	for (int node = sink_side; search_nodes[node].parent != edge_terminal; node = graph.edge_head(search_nodes[node].parent), length++)
+		flow = std::min(flow, graph.residual[search_nodes[node].parent]);
+	statistics.add_augmenting_path(length);
+
+	// add this flow, nodes whose tree edges get saturated become orphans
+	push_flow(mid_edge, flow);
+	for (int node = source_side; search_nodes[node].parent != edge_terminal;)
+	{
+		int edge = search_nodes[node].parent;
+		int tree_edge = graph.reverse_edge(edge);
+		push_flow(tree_edge, flow);
+		int parent = graph.edge_head(edge);
+		if (graph.residual[tree_edge] <= 0) bk_set_orphan(node);
+		node = parent;
+	}
+	for (int node = sink_side; search_nodes[node].parent != edge_terminal;)
+	{
+		int edge = search_nodes[node].parent;
+		push_flow(edge, flow);
+		int parent = graph.edge_head(edge);
+		if (graph.residual[edge] <= 0) bk_set_orphan(node);
+		node = parent;
+	}
+	return flow;
+}
+
+// find new parents for orphans, or release them (and their subtrees) as free nodes.
+void graphcut_t::bk_adopt()
+{
+	const int infinite_dist = 0x7fffffff;
+
+	while (orphan_nodes.size() > 0)
+	{
+		int orphan_index = orphan_nodes.front();
+		orphan_nodes.pop_front();
+		search_node_t &orphan = search_nodes[orphan_index];
+		bool in_source_tree = orphan.tree == terminal_source;
+
+		// look for a valid parent whose path leads to a root, preferring the shortest one
+		int best_parent = edge_none;
+		int best_dist = infinite_dist;
+		for (int d = 0; d < grid_direction_count; d++)
+		{
+			int edge = graph.edge_index(orphan_index, d);
+			if (graph.residual[in_source_tree ? graph.reverse_edge(edge) : edge] <= 0) continue;
+			int next_index = graph.edge_head(edge);
+			if (search_nodes[next_index].tree != orphan.tree) continue;
+
+			int dist = 0;
+			int node = next_index;
+			while (1)
+			{
+				search_node_t &pnode = search_nodes[node];
+				if (pnode.timestamp == bk_time)
+				{
+					dist += pnode.dist;
+					break;
+				}
+				if (pnode.parent == edge_terminal)
+				{
+					pnode.timestamp = bk_time;
+					pnode.dist = 0;
+					break;
+				}
+				if (pnode.parent == edge_none)
+				{
+					dist = infinite_dist;
+					break;
+				}
+				dist++;
+				node = graph.edge_head(pnode.parent);
+			}
+			if (dist == infinite_dist) continue;
+
+			if (dist < best_dist)
+			{
+				best_parent = edge;
+				best_dist = dist;
+			}
+			// cache the distances on the verified path
+			for (node = next_index; search_nodes[node].timestamp != bk_time; node = graph.edge_head(search_nodes[node].parent))
+			{
+				search_nodes[node].timestamp = bk_time;
+				search_nodes[node].dist = dist--;
+			}
+		}
+
+		if (best_parent != edge_none)
+		{
+			orphan.parent = best_parent;
+			orphan.timestamp = bk_time;
+			orphan.dist = best_dist + 1;
+			continue;
+		}
+
+		// no parent found, the orphan becomes free and its children become orphans
+		for (int d = 0; d < grid_direction_count; d++)
+		{
+			int edge = graph.edge_index(orphan_index, d);
+			if (graph.residual[edge] <= 0 && graph.residual[graph.reverse_edge(edge)] <= 0) continue;
+			int next_index = graph.edge_head(edge);
+			search_node_t &next = search_nodes[next_index];
+			if (next.tree != orphan.tree) continue;
+			if (graph.residual[in_source_tree ? graph.reverse_edge(edge) : edge] > 0) bk_set_active(next_index);
+			if (next.parent != edge_none && next.parent != edge_terminal && graph.edge_head(next.parent) == orphan_index) bk_set_orphan(next_index);
+		}
+		orphan.tree = terminal_none;
+	}
+}
+
+// dinic's algorithm: a bfs from the source builds the level graph of shortest augmenting paths,
+// then a blocking flow on it is found by depth-first searches, which never retry an arc (the current arc) that led nowhere.
+void graphcut_t::solve_dinic(algorithm_statistics_t &statistics)
+{
+	const int node_count = graph.node_count();
+	current_arcs.resize(node_count);
+	while (1)
+	{
+		statistics.iteration_count++;
+		if (!dinic_levels()) break;
+
+		std::fill(current_arcs.begin(), current_arcs.end(), 0);
+		for (int i = 0; i < node_count; i++)
+			if (graph.terminal[i] == terminal_source) dinic_blocking_flow(i, statistics);
+	}
+}
+
+// label the nodes by their distance from the source, returns false if the sink can not be reached.
+// the search stops at the level where the sink is first reached, longer paths are left to later phases.
+bool graphcut_t::dinic_levels()
+{
+	const int node_count = graph.node_count();
+	labels.assign(node_count, -1);
+	bfs_queue.clear();
+	for (int i = 0; i < node_count; i++)
+	{
+		if (graph.terminal[i] != terminal_source) continue;
+		labels[i] = 0;
+		bfs_queue.push_back(i);
+	}
+
+	int sink_level = -1;
+	for (size_t head = 0; head < bfs_queue.size(); head++)
+	{
+		int cur = bfs_queue[head];
+		visited_nodes++;
+		if (sink_level >= 0 && labels[cur] >= sink_level) break;
+		for (int d = 0; d < grid_direction_count; d++)
+		{
+			int edge = graph.edge_index(cur, d);
+			if (graph.residual[edge] <= 0) continue;
+			int next = graph.edge_head(edge);
+			if (labels[next] >= 0) continue;
+			labels[next] = labels[cur] + 1;
+			// the flow into a pixel linked to the sink goes straight into the sink
+			if (graph.terminal[next] == terminal_sink)
+				sink_level = labels[next];
 			else
-				flow = remain_cap == infinite_capacity ? flow : std::min(flow, remain_cap);
-			pnode = pnode->prev;
+				bfs_queue.push_back(next);
 		}
-		// add this flow
-		pnode = &sink;
-		while (pnode != &source)
+	}
+	return sink_level >= 0;
+}
+
+void graphcut_t::dinic_blocking_flow(int root, algorithm_statistics_t &statistics)
+{
+	path_edges.clear();
+	int node = root;
+	while (1)
+	{
+		if (graph.terminal[node] == terminal_sink)
+		{
+			// augment along the path, then retreat to the tail of its first saturated edge
+			float flow = graph.residual[path_edges[0]];
+			for (size_t i = 1; i < path_edges.size(); i++)
+				flow = std::min(flow, graph.residual[path_edges[i]]);
+			size_t first_saturated = path_edges.size();
+			for (size_t i = 0; i < path_edges.size(); i++)
+			{
+				push_flow(path_edges[i], flow);
+				if (graph.residual[path_edges[i]] <= 0 && first_saturated == path_edges.size()) first_saturated = i;
+			}
+			statistics.max_flow += flow;
+			statistics.add_augmenting_path((unsigned int)path_edges.size());
+			node = graph.edge_tail(path_edges[first_saturated]);
+			path_edges.resize(first_saturated);
+			continue;
+		}
+
+		// advance along the current arc
+		bool advanced = false;
+		for (; current_arcs[node] < grid_direction_count; current_arcs[node]++)
 		{
-			edge_t &edge = *pnode->prev_edge;
-			edge_t &inv_edge = edge.node->neighbors[edge.inv_edge_index];
-			edge.flow += flow;
-			inv_edge.flow = -edge.flow;
-			pnode = pnode->prev;
+			int edge = graph.edge_index(node, current_arcs[node]);
+			if (graph.residual[edge] <= 0) continue;
+			int next = graph.edge_head(edge);
+			if (labels[next] != labels[node] + 1) continue;
+			path_edges.push_back(edge);
+			node = next;
+			advanced = true;
+			break;
 		}
-		statistics.max_flow += flow;
+		if (advanced) continue;
+
+		// dead end, remove the node from the level graph and retreat
+		labels[node] = -1;
+		if (path_edges.empty()) break;
+		node = graph.edge_tail(path_edges.back());
+		path_edges.pop_back();
+		current_arcs[node]++;
 	}
-	// find the cut by the reachable set from source in the residual graph
-	bfs(false);
-	// fill the mask
-	for (int y = 0; y < patch_size; y++)
+}
+
+// a push-relabel solver that splits one patch across several workers.
+// pixels are colored as a checkerboard, and the two colors are discharged in alternating phases.
+// all the neighbors of a pixel have the other color, so within a phase a pixel only reads labels that are not changing,
+// and the flow it pushes is parked on the reverse edge (owned by exactly one pusher) until the receiver gathers it.
+// thus the rows can be split among workers freely, with a barrier after each phase and no other synchronization.
+// labels are recomputed exactly by a global relabel whenever the workers have relabeled a small fraction of the nodes,
+// without it the excess that can not reach the sink takes thousands of phases to climb back to the source.
+void graphcut_t::solve_push_relabel(algorithm_statistics_t &statistics)
+{
+	const int node_count = graph.node_count();
+	excess.assign(node_count, 0.0f);
+	incoming.assign(graph.residual.size(), 0.0f);
+
+	// saturate all the edges leaving the source
+	for (int i = 0; i < node_count; i++)
 	{
-		for (int x = 0; x < patch_size; x++)
+		if (graph.terminal[i] != terminal_source) continue;
+		for (int d = 0; d < grid_direction_count; d++)
+		{
+			int edge = graph.edge_index(i, d);
+			float flow = graph.residual[edge];
+			if (flow <= 0) continue;
+			graph.residual[edge] = 0.0f;
+			graph.residual[graph.reverse_edge(edge)] += flow;
+			excess[graph.edge_head(edge)] += flow;
+		}
+	}
+	pr_global_relabel();
+
+	const int workers = std::max(1, std::min(worker_count, patch_size));
+	std::vector<unsigned int> operations(workers), relabels(workers);
+	// the rows are split so that every worker gets about as many nodes
+	auto nodes_before_row = [this, node_count](int y)
+	{
+		const int run = graph_pixels.row_runs[y];
+		return run < (int)graph_pixels.runs.size() ? graph_pixels.runs[run].first_node : node_count;
+	};
+	std::vector<int> row_bounds(workers + 1, patch_size);
+	row_bounds[0] = 0;
+	for (int w = 1, y = 0; w < workers; w++)
+	{
+		const int first_node = (int)((long long)node_count * w / workers);
+		while (y < patch_size && nodes_before_row(y) < first_node) y++;
+		row_bounds[w] = y;
+	}
+	const unsigned int global_relabel_threshold = std::max(1, node_count / 64);
+	unsigned int relabels_since_global = 0;
+	bool done = false;
+	barrier_t barrier(workers);
+	auto worker = [&](int w)
+	{
+		const int row_begin = row_bounds[w];
+		const int row_end = row_bounds[w + 1];
+		while (1)
+		{
+			operations[w] = relabels[w] = 0;
+			for (int color = 0; color < 2; color++)
+			{
+				pr_discharge_rows(row_begin, row_end, color, operations[w], relabels[w]);
+				barrier.arrive_and_wait();
+			}
+			if (w == 0)
+			{
+				statistics.iteration_count++;
+				unsigned int total_operations = 0;
+				for (int i = 0; i < workers; i++)
+				{
+					total_operations += operations[i];
+					relabels_since_global += relabels[i];
+				}
+				done = total_operations == 0;
+				if (!done && relabels_since_global >= global_relabel_threshold)
+				{
+					pr_global_relabel();
+					relabels_since_global = 0;
+				}
+			}
+			barrier.arrive_and_wait();
+			if (done) break;
+		}
+	};
+
+	// the first worker runs on this thread, and the others on the helper workers, which run nothing else meanwhile
+	jobsystem_t &jobsystem = jobsystem_t::shared();
+	jobgroup_t group;
+	for (int w = 1; w < workers; w++)
+		jobsystem.submit_to_worker(group, helper_workers[w - 1], [&worker, w]() { worker(w); });
+	worker(0);
+	jobsystem.wait(group);
+
+	// all the flow ends up in the pixels linked to the sink
+	for (int i = 0; i < node_count; i++)
+	{
+		pr_gather(i);
+		if (graph.terminal[i] == terminal_sink) statistics.max_flow += excess[i];
+	}
+}
+
+void graphcut_t::pr_gather(int node)
+{
+	for (int d = 0; d < grid_direction_count; d++)
+	{
+		float &flow = incoming[graph.edge_index(node, d)];
+		excess[node] += flow;
+		flow = 0.0f;
+	}
+}
+
+// push the excess of every active pixel of the given color in the rows, or relabel it if nothing is admissible.
+void graphcut_t::pr_discharge_rows(int row_begin, int row_end, int color, unsigned int &operations, unsigned int &relabels)
+{
+	const int max_label = graph.node_count() * 2;
+	for (int i = graph_pixels.row_runs[row_begin]; i < graph_pixels.row_runs[row_end]; i++)
+	{
+		const pixel_runs_t::run_t &run = graph_pixels.runs[i];
+		for (int k = (run.x + run.y + color) & 1; k < run.count; k += 2)
+		{
+			int node = run.first_node + k;
+			pr_gather(node);
+			if (graph.terminal[node] != terminal_none || excess[node] <= 0) continue;
+
+			int label = labels[node];
+			int min_label = max_label;
+			for (int d = 0; d < grid_direction_count && excess[node] > 0; d++)
+			{
+				int edge = graph.edge_index(node, d);
+				float residual = graph.residual[edge];
+				if (residual <= 0) continue;
+				int next_label = labels[graph.edge_head(edge)];
+				if (next_label != label - 1)
+				{
+					min_label = std::min(min_label, next_label);
+					continue;
+				}
+				float flow = std::min(excess[node], residual);
+				push_flow(edge, flow);
+				incoming[graph.reverse_edge(edge)] += flow;
+				excess[node] = residual <= flow ? excess[node] - residual : 0.0f;
+				operations++;
+			}
+			if (excess[node] > 0 && min_label + 1 > label && min_label < max_label)
+			{
+				labels[node] = min_label + 1;
+				operations++;
+				relabels++;
+			}
+		}
+	}
+}
+
+// set every label to the exact distance to the sink in the residual graph,
+// or to the distance to the source plus the node count for the pixels that can not reach the sink any more.
+void graphcut_t::pr_global_relabel()
+{
+	const int node_count = graph.node_count();
+	labels.assign(node_count, node_count * 2);
+	for (int i = 0; i < node_count; i++)
+		pr_gather(i);
+
+	for (int terminal = terminal_sink; terminal >= terminal_source; terminal--)
+	{
+		bfs_queue.clear();
+		for (int i = 0; i < node_count; i++)
+		{
+			if (graph.terminal[i] != terminal) continue;
+			labels[i] = terminal == terminal_sink ? 0 : node_count;
+			bfs_queue.push_back(i);
+		}
+		for (size_t head = 0; head < bfs_queue.size(); head++)
 		{
-			bool reachable = get_pixel_node(x, y).prev != NULL;
-			mask_image.set_pixel(x + mask_patch.x, y + mask_patch.y, reachable ? 255 : 0);
+			int cur = bfs_queue[head];
+			visited_nodes++;
+			for (int d = 0; d < grid_direction_count; d++)
+			{
+				int edge_to_cur = graph.reverse_edge(graph.edge_index(cur, d));
+				if (graph.residual[edge_to_cur] <= 0) continue;
+				int next = graph.edge_tail(edge_to_cur);
+				if (labels[next] != node_count * 2) continue;
+				labels[next] = labels[cur] + 1;
+				bfs_queue.push_back(next);
+			}
 		}
 	}
 }
 
+size_t graphcut_t::graph_memory() const
+{
+	return graph.residual.capacity() * sizeof(float) + graph.terminal.capacity() + graph.heads.capacity() * sizeof(int) +
+		graph_pixels.runs.capacity() * sizeof(pixel_runs_t::run_t) + graph_pixels.row_runs.capacity() * sizeof(int) +
+		bfs_prev_edge.capacity() * sizeof(int) + bfs_queue.capacity() * sizeof(int) +
+		search_nodes.capacity() * sizeof(search_node_t) + (active_nodes.size() + orphan_nodes.size()) * sizeof(int) +
+		excess.capacity() * sizeof(float) + incoming.capacity() * sizeof(float) + labels.capacity() * sizeof(int) +
+		current_arcs.capacity() + path_edges.capacity() * sizeof(int);
+}
+
 // this method must guarantee edge weight is symmetric
-void graphcut_t::make_edge(int x0, int y0, int x1, int y1)
+void graphcut_t::make_edge(int node0, int node1, int x0, int y0, int x1, int y1, grid_direction_t direction, float cost)
 {
 	color_t constraint0 = constraints.get_pixel(x0, y0);
 	color_t constraint1 = constraints.get_pixel(x1, y1);
 	if (constraint0 == constraint1 && constraint0 != CONSTRAINT_COLOR_FREE) return;
 
-	node_t &node0 = get_pixel_node(x0, y0);
-	node_t &node1 = get_pixel_node(x1, y1);
-	if (&node0 > &node1) return;
-
-	vector3f_t a0 = get_vector3f(image_a.get_pixel(patch_a.x + x0, patch_a.y + y0));
-	vector3f_t a1 = get_vector3f(image_a.get_pixel(patch_a.x + x1, patch_a.y + y1));
-	vector3f_t b0 = get_vector3f(image_b.get_pixel(patch_b.x + x0, patch_b.y + y0));
-	vector3f_t b1 = get_vector3f(image_b.get_pixel(patch_b.x + x1, patch_b.y + y1));
-	float cost = (a0 - b0).magnitude() + (a1 - b1).magnitude();
-	float gradient = (a0 - a1).magnitude() + (b0 - b1).magnitude();
-	cost /= gradient + 1e-3f;
-	
-	node0.neighbors.emplace_back(&node1, cost);
-	node1.neighbors.emplace_back(&node0, cost);
-	edge_t &edge0 = node0.neighbors.back();
-	edge_t &edge1 = node1.neighbors.back();
-	edge0.inv_edge_index = node1.neighbors.size() - 1;
-	edge1.inv_edge_index = node0.neighbors.size() - 1;
-}
-
-void graphcut_t::make_edge(int x, int y, node_t & src_or_sink)
-{
-	node_t &node = get_pixel_node(x, y);
-	node.neighbors.emplace_back(&src_or_sink, infinite_capacity);
-	src_or_sink.neighbors.emplace_back(&node, infinite_capacity);
-
-	edge_t &edge0 = node.neighbors.back();
-	edge_t &edge1 = src_or_sink.neighbors.back();
-	edge0.inv_edge_index = src_or_sink.neighbors.size() - 1;
-	edge1.inv_edge_index = node.neighbors.size() - 1;
+	int edge = graph.edge_index(node0, direction);
+	graph.link_edge(edge, node1);
+	graph.residual[edge] = cost;
+	graph.residual[graph.reverse_edge(edge)] = cost;
+	edge_count++;
 }
@@ -1,74 +1,221 @@
 #pragma once
 
 #include <vector>
-#include <queue>
+#include <deque>
+#include <chrono>
 #include "common_types.h"
+#include "seamcost.h"
 
-struct node_t;
-const float infinite_capacity = -1.0f;
-
-struct edge_t
+// edges of a pixel node, in the order they are stored.
+// opposite directions only differ in the lowest bit.
+enum grid_direction_t
 {
-	node_t *node;
-	float capacity;
-	float flow;
-	size_t inv_edge_index;
-
-	edge_t(node_t *node, float capacity)
-		:node(node), capacity(capacity), flow(0), inv_edge_index(-1) { }
+	grid_west,
+	grid_east,
+	grid_south,
+	grid_north,
+	grid_direction_count,
 };
 
-struct node_t
+// pixels with a hard constraint are linked to the source or the sink with infinite capacity.
+// such links never saturate, so they are kept as a tag on the pixel instead of as edges.
+enum terminal_t
 {
-	std::vector<edge_t> neighbors;
-	// temp for bfs
-	node_t *prev;
-	edge_t *prev_edge;
-#ifdef _DEBUG
-	int coord_x, coord_y;
-#endif
-
-	node_t() :prev(NULL), prev_edge(NULL) { }
+	terminal_none,
+	terminal_source,
+	terminal_sink,
 };
 
+// the 4-connected grid graph of a patch, stored in flat arrays indexed by pixel (y * width + x).
+// every pixel owns a fixed block of 4 consecutive edges, so the csr offsets are implicit,
+// and the reverse of edge (i, d) is found arithmetically as edge (neighbor(i, d), d ^ 1).
+// missing edges (out of the patch, or between two pixels under the same constraint) have zero capacity.
+// the residual array is padded by a row of pixels on both ends, so edges leaving the patch can be read without bounds checks.
+// a compact graph only holds some pixels of the patch, e.g. a band around a seam, so the head of every edge is stored instead.
+// its missing edges lead to an extra node past the last one, which has no edges.
 struct graph_t
 {
-	std::vector<node_t> nodes;
+	int width;
+	int neighbor_offset[grid_direction_count];
+	std::vector<float> residual;
+	std::vector<unsigned char> terminal;
+	std::vector<int> heads; // empty for a grid
+
+	void init(int width)
+	{
+		this->width = width;
+		neighbor_offset[grid_west] = -1;
+		neighbor_offset[grid_east] = 1;
+		neighbor_offset[grid_south] = -width;
+		neighbor_offset[grid_north] = width;
+		residual.assign((width * width + width * 2) * grid_direction_count, 0.0f);
+		terminal.assign(width * width, terminal_none);
+		heads.clear();
+	}
+
+	// the edges are linked by link_edge
+	void init_compact(int node_count)
+	{
+		width = 0;
+		residual.assign((node_count + 1) * grid_direction_count, 0.0f);
+		terminal.assign(node_count, terminal_none);
+		heads.assign((node_count + 1) * grid_direction_count, node_count);
+	}
+
+	// links the edge and its reverse, which the grid does implicitly
+	void link_edge(int edge, int head)
+	{
+		if (heads.empty()) return;
+		heads[edge] = head;
+		heads[edge_index(head, (edge & 3) ^ 1)] = edge_tail(edge);
+	}
+
+	int node_count() const { return (int)terminal.size(); }
+	// edge indices are never negative, so shifts and masks are used instead of divisions
+	int edge_index(int node, int direction) const { return ((node + width) << 2) | direction; }
+	int edge_tail(int edge) const { return (edge >> 2) - width; }
+	int edge_head(int edge) const { return heads.empty() ? edge_tail(edge) + neighbor_offset[edge & 3] : heads[edge]; }
+	int reverse_edge(int edge) const
+	{
+		return heads.empty() ? (edge + (neighbor_offset[edge & 3] << 2)) ^ 1 : (heads[edge] << 2) | ((edge & 3) ^ 1);
+	}
+};
+
+enum maxflow_solver_t
+{
+	maxflow_solver_auto, // boykov-kolmogorov, or push-relabel when there are enough workers for the patch
+	maxflow_solver_boykov_kolmogorov,
+	maxflow_solver_dinic,
+	maxflow_solver_push_relabel,
+	maxflow_solver_edmonds_karp, // the reference, one full bfs per augmenting path
 };
 
 struct algorithm_statistics_t
 {
 	unsigned int iteration_count;
 	float max_flow;
+	double construction_seconds;
+	double solve_seconds;
+	unsigned long long visited_nodes; // nodes taken from the queues of all the graph searches
+	unsigned int augmenting_paths;
+	unsigned long long augmenting_path_length; // summed over all the augmenting paths
+	unsigned int max_augmenting_path_length;
+	unsigned int edge_count; // edges between pixels, plus links to the terminals
+	size_t graph_memory; // bytes held by the graph and the solver when the max flow is found
+
+	algorithm_statistics_t()
+		:iteration_count(0), max_flow(0), construction_seconds(0), solve_seconds(0), visited_nodes(0),
+		augmenting_paths(0), augmenting_path_length(0), max_augmenting_path_length(0), edge_count(0), graph_memory(0) { }
+
+	float average_augmenting_path_length() const { return augmenting_paths > 0 ? (float)augmenting_path_length / augmenting_paths : 0.0f; }
+
+	void add_augmenting_path(unsigned int length)
+	{
+		augmenting_paths++;
+		augmenting_path_length += length;
+		max_augmenting_path_length = std::max(max_augmenting_path_length, length);
+	}
 };
 
 class graphcut_t
 {
 public:
-	graphcut_t(image_t image_a, patch_t patch_a, image_t image_b, patch_t patch_b, image_t constraints);
+	// the patches are only read while the graph is built, the constraints while the max flow is solved
+	graphcut_t(const image_patch_view_t &patch_a, const image_patch_view_t &patch_b, const image_view_t &constraints);
+	// the seam cost is one of the policy functors in seamcost.h, each of them gets its own inlined cost kernel.
+	// the patches are views of interleaved or of planar images.
+	template <typename patch_view_t, typename seam_cost_t>
+	graphcut_t(const patch_view_t &patch_a, const patch_view_t &patch_b, const image_view_t &constraints, seam_cost_t seam_cost)
+		:constraints(constraints), solver(maxflow_solver_auto), worker_count(1), edge_count(0), construction_seconds(0), visited_nodes(0)
+	{
+		auto start = std::chrono::steady_clock::now();
+		valid = check_patch_size(patch_a.size, patch_b.size);
+		if (!valid) return;
+		find_graph_pixels();
+		seam_costs_t costs;
+		compute_seam_costs(patch_a, patch_b, graph_pixels, seam_cost, costs);
+		build_graph(costs);
+		construction_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
 	~graphcut_t();
 
-	void compute_cut_mask(mask_t mask_image, patch_t mask_patch, algorithm_statistics_t &statistics);
+	// push-relabel does a few times more work than boykov-kolmogorov, so auto only picks it with this many workers
+	static const int auto_push_relabel_workers = 4;
+
+	void set_solver(maxflow_solver_t solver) { this->solver = solver; }
+	// the workers claimed from the shared pool to help the calling thread solve this patch, only push-relabel makes use of them
+	void set_helper_workers(const std::vector<int> &workers) { helper_workers = workers; worker_count = (int)workers.size() + 1; }
+	// false when the patches or the mask are of an invalid size, the mask is left as it is then
+	bool compute_cut_mask(const mask_patch_view_t &mask, algorithm_statistics_t &statistics);
 
 private:
-	node_t &get_pixel_node(int x, int y) { return graph.nodes[y * patch_size + x]; }
-	node_t &get_source_node() { return graph.nodes[graph.nodes.size() - 2]; }
-	node_t &get_sink_node() { return graph.nodes[graph.nodes.size() - 1]; }
+	bool check_patch_size(int size_a, int size_b);
+	void find_graph_pixels();
+	void build_graph(const seam_costs_t &costs);
+	size_t graph_memory() const;
+
+	void make_edge(int node0, int node1, int x0, int y0, int x1, int y1, grid_direction_t direction, float cost);
+
+	int bfs(bool stop_on_sink);
+	void push_flow(int edge, float flow);
 
-	void make_edge(int x0, int y0, int x1, int y1);
-	void make_edge(int x, int y, node_t &src_or_sink);
+	void solve_edmonds_karp(algorithm_statistics_t &statistics);
+	void solve_boykov_kolmogorov(algorithm_statistics_t &statistics);
+	int bk_grow();
+	float bk_augment(int mid_edge, algorithm_statistics_t &statistics);
+	void bk_adopt();
+	void bk_set_active(int node);
+	void bk_set_orphan(int node);
 
-	void bfs(bool stop_on_sink);
+	void solve_dinic(algorithm_statistics_t &statistics);
+	bool dinic_levels();
+	void dinic_blocking_flow(int root, algorithm_statistics_t &statistics);
+
+	void solve_push_relabel(algorithm_statistics_t &statistics);
+	void pr_discharge_rows(int row_begin, int row_end, int color, unsigned int &operations, unsigned int &relabels);
+	void pr_gather(int node);
+	void pr_global_relabel();
 
 private:
-	image_t image_a;
-	patch_t patch_a;
-	image_t image_b;
-	patch_t patch_b;
-	image_t constraints;
+	image_view_t constraints;
 
 	graph_t graph;
+	// the pixels of the nodes, all of them unless most of the patch is pinned
+	pixel_runs_t graph_pixels;
+	bool valid;
 	int patch_size;
-
-	std::queue<node_t *> bfs_queue;
+	maxflow_solver_t solver;
+	int worker_count;
+	std::vector<int> helper_workers;
+	unsigned int edge_count;
+	double construction_seconds;
+	unsigned long long visited_nodes;
+
+	// temp for bfs, the edge through which a node is reached
+	std::vector<int> bfs_prev_edge;
+	std::vector<int> bfs_queue;
+
+	// temp for boykov-kolmogorov search trees
+	struct search_node_t
+	{
+		int parent; // edge from this node to its parent
+		int timestamp;
+		int dist;
+		unsigned char tree;
+		bool active;
+	};
+	std::vector<search_node_t> search_nodes;
+	std::deque<int> active_nodes;
+	std::deque<int> orphan_nodes;
+	int bk_time;
+
+	// temp for dinic, the level graph and the current arc of every node.
+	// labels are shared with push-relabel, which never runs on the same graph.
+	std::vector<unsigned char> current_arcs;
+	std::vector<int> path_edges;
+
+	// temp for push-relabel, the flow pushed into a node is parked on the reverse edge until the node gathers it
+	std::vector<float> excess;
+	std::vector<float> incoming;
+	std::vector<int> labels;
 };
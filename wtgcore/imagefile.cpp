@@ -0,0 +1,434 @@
+#include "pch.h"
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <algorithm>
+#include "imagefile.h"
+#include "deflate.h"
+#include "fileio.h"
+#include "jobsystem.h"
+
+image_file_format_t image_file_format(const char *path)
+{
+	const char *extension = strrchr(path, '.');
+	if (!extension || strlen(extension) != 4) return image_file_format_raw;
+	char lower[5];
+	for (int i = 0; i < 5; i++) lower[i] = (char)tolower((unsigned char)extension[i]);
+	if (strcmp(lower, ".png") == 0) return image_file_format_png;
+	if (strcmp(lower, ".qoi") == 0) return image_file_format_qoi;
+	return image_file_format_raw;
+}
+
+// both formats store their integers big endian
+static unsigned int read_u32(const unsigned char *p)
+{
+	return (unsigned int)p[0] << 24 | (unsigned int)p[1] << 16 | (unsigned int)p[2] << 8 | p[3];
+}
+
+static void put_u32(std::vector<unsigned char> &out, unsigned int v)
+{
+	out.push_back((unsigned char)(v >> 24));
+	out.push_back((unsigned char)(v >> 16));
+	out.push_back((unsigned char)(v >> 8));
+	out.push_back((unsigned char)v);
+}
+
+static const unsigned char png_signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+static bool write_png_chunk(FILE *f, const char *type, const unsigned char *data, size_t size)
+{
+	std::vector<unsigned char> header;
+	put_u32(header, (unsigned int)size);
+	header.insert(header.end(), type, type + 4);
+	std::vector<unsigned char> trailer;
+	put_u32(trailer, crc32_update(crc32_update(0, header.data() + 4, 4), data, size));
+	return fwrite(header.data(), 1, header.size(), f) == header.size() && (size == 0 || fwrite(data, 1, size, f) == size)
+		&& fwrite(trailer.data(), 1, trailer.size(), f) == trailer.size();
+}
+
+// the predictor of the paeth filter, from the bytes on the left, above and above left
+inline int paeth_predictor(int a, int b, int c)
+{
+	const int p = a + b - c;
+	const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+	if (pa <= pb && pa <= pc) return a;
+	return pb <= pc ? b : c;
+}
+
+static void filter_row(int type, const unsigned char *row, const unsigned char *prev, int bpp, int n, unsigned char *out)
+{
+	switch (type)
+	{
+	case 0:
+		memcpy(out, row, n);
+		break;
+	case 1:
+		for (int i = 0; i < n; i++) out[i] = (unsigned char)(row[i] - (i >= bpp ? row[i - bpp] : 0));
+		break;
+	case 2:
+		for (int i = 0; i < n; i++) out[i] = (unsigned char)(row[i] - prev[i]);
+		break;
+	case 3:
+		for (int i = 0; i < n; i++) out[i] = (unsigned char)(row[i] - (((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1));
+		break;
+	default:
+		for (int i = 0; i < n; i++)
+			out[i] = (unsigned char)(row[i] - (i >= bpp ? paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]) : prev[i]));
+		break;
+	}
+}
+
+static bool unfilter_row(int type, unsigned char *row, const unsigned char *prev, int bpp, int n)
+{
+	switch (type)
+	{
+	case 0:
+		return true;
+	case 1:
+		for (int i = bpp; i < n; i++) row[i] = (unsigned char)(row[i] + row[i - bpp]);
+		return true;
+	case 2:
+		for (int i = 0; i < n; i++) row[i] = (unsigned char)(row[i] + prev[i]);
+		return true;
+	case 3:
+		for (int i = 0; i < n; i++) row[i] = (unsigned char)(row[i] + (((i >= bpp ? row[i - bpp] : 0) + prev[i]) >> 1));
+		return true;
+	case 4:
+		for (int i = 0; i < n; i++)
+			row[i] = (unsigned char)(row[i] + (i >= bpp ? paeth_predictor(row[i - bpp], prev[i], prev[i - bpp]) : prev[i]));
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool write_png(const char *path, const encode_rows_t &image)
+{
+	const int bpp = image.channels;
+	const int row_bytes = image.width * bpp;
+	// a stripe of about 256k filtered bytes is deflated by one worker, into a part of the zlib stream
+	const int stripe_rows = std::max(1, (1 << 18) / (row_bytes + 1));
+	const int stripes = (image.height + stripe_rows - 1) / stripe_rows;
+	std::vector<std::vector<unsigned char>> parts(stripes);
+	std::vector<unsigned int> adlers(stripes);
+	std::vector<size_t> sizes(stripes);
+	jobsystem_t::shared().parallel_for(0, stripes, 1, [&](int stripe_begin, int stripe_end)
+	{
+		std::vector<unsigned char> prev(row_bytes), row(row_bytes), candidates(row_bytes * 5);
+		for (int stripe = stripe_begin; stripe < stripe_end; stripe++)
+		{
+			const int y_begin = stripe * stripe_rows;
+			const int y_end = std::min(image.height, y_begin + stripe_rows);
+			std::vector<unsigned char> filtered((size_t)(y_end - y_begin) * (row_bytes + 1));
+			if (y_begin > 0) image.read_row(y_begin - 1, prev.data());
+			else std::fill(prev.begin(), prev.end(), 0);
+			for (int y = y_begin; y < y_end; y++)
+			{
+				image.read_row(y, row.data());
+				// the filter whose bytes are the smallest as signed values, the heuristic of libpng
+				int best = 0;
+				long long best_sum = -1;
+				for (int type = 0; type < 5; type++)
+				{
+					unsigned char *candidate = &candidates[(size_t)type * row_bytes];
+					filter_row(type, row.data(), prev.data(), bpp, row_bytes, candidate);
+					long long sum = 0;
+					for (int i = 0; i < row_bytes; i++) sum += abs((int)(signed char)candidate[i]);
+					if (best_sum < 0 || sum < best_sum)
+					{
+						best = type;
+						best_sum = sum;
+					}
+				}
+				unsigned char *out = &filtered[(size_t)(y - y_begin) * (row_bytes + 1)];
+				out[0] = (unsigned char)best;
+				memcpy(out + 1, &candidates[(size_t)best * row_bytes], row_bytes);
+				std::swap(prev, row);
+			}
+			adlers[stripe] = adler32_update(1, filtered.data(), filtered.size());
+			sizes[stripe] = filtered.size();
+			deflate_part(filtered.data(), filtered.size(), stripe == stripes - 1, parts[stripe]);
+		}
+	});
+	unsigned int adler = adlers[0];
+	for (int stripe = 1; stripe < stripes; stripe++)
+		adler = adler32_combine(adler, adlers[stripe], sizes[stripe]);
+	// the zlib header of a fast level, and the checksum at the end
+	const unsigned char zlib_header[2] = { 0x78, 0x5e };
+	parts.front().insert(parts.front().begin(), zlib_header, zlib_header + 2);
+	put_u32(parts.back(), adler);
+
+	FILE *f;
+	if (fopen_s(&f, path, "wb")) return false;
+	std::vector<unsigned char> header;
+	put_u32(header, image.width);
+	put_u32(header, image.height);
+	header.push_back(8);
+	header.push_back(bpp == 4 ? 6 : 2);
+	header.push_back(0);
+	header.push_back(0);
+	header.push_back(0);
+	bool succeeded = fwrite(png_signature, 1, 8, f) == 8 && write_png_chunk(f, "IHDR", header.data(), header.size());
+	for (size_t i = 0; i < parts.size() && succeeded; i++)
+		succeeded = write_png_chunk(f, "IDAT", parts[i].data(), parts[i].size());
+	succeeded = succeeded && write_png_chunk(f, "IEND", NULL, 0);
+	fclose(f);
+	return succeeded;
+}
+
+bool read_png(const char *path, const decode_rows_t &image)
+{
+	mapped_file_t file;
+	if (!file.open_read(path)) return false;
+	const unsigned char *data = file.data();
+	const size_t size = file.size();
+	if (size < 8 || memcmp(data, png_signature, 8) != 0) return false;
+
+	int width = 0, height = 0, depth = 0, color_type = -1;
+	unsigned char palette[256][3] = { { 0 } };
+	int palette_size = 0;
+	std::vector<unsigned char> stream;
+	for (size_t pos = 8;;)
+	{
+		if (size - pos < 12) return false;
+		const size_t length = read_u32(data + pos);
+		if (length > size - pos - 12) return false;
+		const unsigned char *type = data + pos + 4;
+		const unsigned char *chunk = type + 4;
+		if (crc32_update(0, type, length + 4) != read_u32(chunk + length)) return false;
+		pos += length + 12;
+		if (memcmp(type, "IHDR", 4) == 0)
+		{
+			if (length != 13) return false;
+			width = (int)read_u32(chunk);
+			height = (int)read_u32(chunk + 4);
+			depth = chunk[8];
+			color_type = chunk[9];
+			const bool valid_depth = (color_type == 0 && (depth == 1 || depth == 2 || depth == 4 || depth == 8 || depth == 16))
+				|| (color_type == 3 && (depth == 1 || depth == 2 || depth == 4 || depth == 8))
+				|| ((color_type == 2 || color_type == 4 || color_type == 6) && (depth == 8 || depth == 16));
+			// interlaced images are not read
+			if (width <= 0 || height <= 0 || !valid_depth || chunk[10] != 0 || chunk[11] != 0 || chunk[12] != 0) return false;
+			if (!image.begin(width, height)) return false;
+		}
+		else if (memcmp(type, "PLTE", 4) == 0)
+		{
+			palette_size = (int)std::min(length / 3, (size_t)256);
+			memcpy(palette, chunk, palette_size * 3);
+		}
+		else if (memcmp(type, "IDAT", 4) == 0)
+			stream.insert(stream.end(), chunk, chunk + length);
+		else if (memcmp(type, "IEND", 4) == 0)
+			break;
+		else if (!(type[0] & 0x20))
+			return false; // an unknown critical chunk
+	}
+	if (color_type < 0 || (color_type == 3 && palette_size == 0)) return false;
+
+	static const int channels_of_type[7] = { 1, 0, 3, 1, 2, 0, 4 };
+	const int channels = channels_of_type[color_type];
+	const int bits_per_pixel = channels * depth;
+	const int row_bytes = (int)(((size_t)width * bits_per_pixel + 7) / 8);
+	const int bpp = std::max(1, bits_per_pixel / 8);
+	std::vector<unsigned char> raw((size_t)height * (row_bytes + 1));
+	if (!zlib_inflate(stream.data(), stream.size(), raw.data(), raw.size())) return false;
+	stream = std::vector<unsigned char>();
+
+	std::vector<unsigned char> zeros(row_bytes, 0);
+	std::vector<color_t> pixels(width);
+	const int max_sample = (1 << std::min(depth, 8)) - 1;
+	for (int y = 0; y < height; y++)
+	{
+		unsigned char *row = &raw[(size_t)y * (row_bytes + 1)];
+		const unsigned char *prev = y > 0 ? row - row_bytes : zeros.data();
+		if (!unfilter_row(row[0], row + 1, prev, bpp, row_bytes)) return false;
+		row++;
+		// the 8 bits of the i-th sample of the row
+		auto sample = [row, depth](int i) -> int
+		{
+			if (depth == 8) return row[i];
+			if (depth == 16) return row[i * 2];
+			const int bit = i * depth;
+			return (row[bit >> 3] >> (8 - depth - (bit & 7))) & ((1 << depth) - 1);
+		};
+		for (int x = 0; x < width; x++)
+		{
+			switch (color_type)
+			{
+			case 0:
+			case 4:
+			{
+				const int gray = sample(x * channels) * 255 / max_sample;
+				pixels[x] = color_t(gray, gray, gray);
+				break;
+			}
+			case 3:
+			{
+				const int index = sample(x);
+				pixels[x] = index < palette_size ? color_t(palette[index][0], palette[index][1], palette[index][2]) : color_t(0, 0, 0);
+				break;
+			}
+			default:
+				pixels[x] = color_t(sample(x * channels), sample(x * channels + 1), sample(x * channels + 2));
+				break;
+			}
+		}
+		image.write_row(y, pixels.data());
+	}
+	return true;
+}
+
+static const unsigned char qoi_op_index = 0x00;
+static const unsigned char qoi_op_diff = 0x40;
+static const unsigned char qoi_op_luma = 0x80;
+static const unsigned char qoi_op_run = 0xc0;
+static const unsigned char qoi_op_rgb = 0xfe;
+static const unsigned char qoi_op_rgba = 0xff;
+static const unsigned char qoi_end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+inline int qoi_hash(const unsigned char *px)
+{
+	return (px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64;
+}
+
+bool write_qoi(const char *path, const encode_rows_t &image)
+{
+	const int channels = image.channels;
+	std::vector<unsigned char> out;
+	out.reserve(14 + (size_t)image.width * image.height * (channels + 1) + 8);
+	out.insert(out.end(), { 'q', 'o', 'i', 'f' });
+	put_u32(out, image.width);
+	put_u32(out, image.height);
+	out.push_back((unsigned char)channels);
+	out.push_back(0);
+
+	unsigned char index[64][4] = { { 0 } };
+	unsigned char prev[4] = { 0, 0, 0, 255 };
+	unsigned char px[4] = { 0, 0, 0, 255 };
+	int run = 0;
+	std::vector<unsigned char> row((size_t)image.width * channels);
+	for (int y = 0; y < image.height; y++)
+	{
+		image.read_row(y, row.data());
+		for (int x = 0; x < image.width; x++)
+		{
+			memcpy(px, &row[(size_t)x * channels], channels);
+			if (memcmp(px, prev, 4) == 0)
+			{
+				if (++run == 62)
+				{
+					out.push_back((unsigned char)(qoi_op_run | (run - 1)));
+					run = 0;
+				}
+				continue;
+			}
+			if (run > 0)
+			{
+				out.push_back((unsigned char)(qoi_op_run | (run - 1)));
+				run = 0;
+			}
+			const int h = qoi_hash(px);
+			if (memcmp(index[h], px, 4) == 0)
+				out.push_back((unsigned char)(qoi_op_index | h));
+			else
+			{
+				memcpy(index[h], px, 4);
+				if (px[3] == prev[3])
+				{
+					const signed char vr = (signed char)(px[0] - prev[0]);
+					const signed char vg = (signed char)(px[1] - prev[1]);
+					const signed char vb = (signed char)(px[2] - prev[2]);
+					const int vg_r = vr - vg, vg_b = vb - vg;
+					if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2)
+						out.push_back((unsigned char)(qoi_op_diff | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2)));
+					else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 && vg_b > -9 && vg_b < 8)
+					{
+						out.push_back((unsigned char)(qoi_op_luma | (vg + 32)));
+						out.push_back((unsigned char)((vg_r + 8) << 4 | (vg_b + 8)));
+					}
+					else
+						out.insert(out.end(), { qoi_op_rgb, px[0], px[1], px[2] });
+				}
+				else
+					out.insert(out.end(), { qoi_op_rgba, px[0], px[1], px[2], px[3] });
+			}
+			memcpy(prev, px, 4);
+		}
+	}
+	if (run > 0) out.push_back((unsigned char)(qoi_op_run | (run - 1)));
+	out.insert(out.end(), qoi_end_marker, qoi_end_marker + 8);
+
+	FILE *f;
+	if (fopen_s(&f, path, "wb")) return false;
+	const bool succeeded = fwrite(out.data(), 1, out.size(), f) == out.size();
+	fclose(f);
+	return succeeded;
+}
+
+bool read_qoi(const char *path, const decode_rows_t &image)
+{
+	mapped_file_t file;
+	if (!file.open_read(path)) return false;
+	const unsigned char *data = file.data();
+	const size_t size = file.size();
+	if (size < 14 + 8 || memcmp(data, "qoif", 4) != 0) return false;
+	const int width = (int)read_u32(data + 4);
+	const int height = (int)read_u32(data + 8);
+	if (width <= 0 || height <= 0 || (data[12] != 3 && data[12] != 4)) return false;
+	if (!image.begin(width, height)) return false;
+
+	unsigned char index[64][4] = { { 0 } };
+	unsigned char px[4] = { 0, 0, 0, 255 };
+	int run = 0;
+	size_t pos = 14;
+	const size_t end = size - 8;
+	std::vector<color_t> pixels(width);
+	for (int y = 0; y < height; y++)
+	{
+		for (int x = 0; x < width; x++)
+		{
+			if (run > 0)
+				run--;
+			else
+			{
+				if (pos >= end) return false;
+				const unsigned char b1 = data[pos++];
+				if (b1 == qoi_op_rgb)
+				{
+					if (end - pos < 3) return false;
+					memcpy(px, data + pos, 3);
+					pos += 3;
+				}
+				else if (b1 == qoi_op_rgba)
+				{
+					if (end - pos < 4) return false;
+					memcpy(px, data + pos, 4);
+					pos += 4;
+				}
+				else if ((b1 & 0xc0) == qoi_op_index)
+					memcpy(px, index[b1], 4);
+				else if ((b1 & 0xc0) == qoi_op_diff)
+				{
+					px[0] = (unsigned char)(px[0] + ((b1 >> 4) & 3) - 2);
+					px[1] = (unsigned char)(px[1] + ((b1 >> 2) & 3) - 2);
+					px[2] = (unsigned char)(px[2] + (b1 & 3) - 2);
+				}
+				else if ((b1 & 0xc0) == qoi_op_luma)
+				{
+					if (pos >= end) return false;
+					const unsigned char b2 = data[pos++];
+					const int vg = (b1 & 0x3f) - 32;
+					px[0] = (unsigned char)(px[0] + vg - 8 + ((b2 >> 4) & 15));
+					px[1] = (unsigned char)(px[1] + vg);
+					px[2] = (unsigned char)(px[2] + vg - 8 + (b2 & 15));
+				}
+				else
+					run = b1 & 0x3f;
+				memcpy(index[qoi_hash(px)], px, 4);
+			}
+			pixels[x] = color_t(px[0], px[1], px[2]);
+		}
+		image.write_row(y, pixels.data());
+	}
+	return true;
+}
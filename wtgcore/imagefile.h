@@ -0,0 +1,41 @@
+#pragma once
+
+#include <functional>
+#include "common_types.h"
+
+enum image_file_format_t
+{
+	image_file_format_raw,
+	image_file_format_png,
+	image_file_format_qoi,
+};
+
+// told by the extension of the path, .png or .qoi, anything else holds the raw pixels
+image_file_format_t image_file_format(const char *path);
+
+// the rows of an image to encode, top row first, with 3 (rgb) or 4 (rgba) bytes per pixel.
+// read_row fills the bytes of a row, it may be called more than once for a row, and from several threads at once.
+struct encode_rows_t
+{
+	int width;
+	int height;
+	int channels;
+	std::function<void(int y, unsigned char *row)> read_row;
+};
+
+// decoders call begin with the size of the image, which may refuse it, and then give all the rows as rgb, top row first.
+// an alpha channel is dropped.
+struct decode_rows_t
+{
+	std::function<bool(int width, int height)> begin;
+	std::function<void(int y, const color_t *row)> write_row;
+};
+
+// the image data is filtered and deflated in stripes of rows by all the workers
+bool write_png(const char *path, const encode_rows_t &image);
+// images of any color type and bit depth which aren't interlaced, 16 bit samples are cut to 8 bits
+bool read_png(const char *path, const decode_rows_t &image);
+
+// qoi is written in a single pass over the rows, much faster than png and for intermediate files
+bool write_qoi(const char *path, const encode_rows_t &image);
+bool read_qoi(const char *path, const decode_rows_t &image);
@@ -3,47 +3,338 @@
 #include <algorithm>
 #include <iostream>
 
-jobsystem_t::jobsystem_t()
-	:jobindex(0)
+namespace
+{
+	// the pool and the worker index of the current thread, so jobs submitted from a job go to its own deque
+	thread_local jobsystem_t *current_pool = NULL;
+	thread_local int current_worker = -1;
+
+	int shared_worker_count = 0;
+}
+
+jobgroup_t::jobgroup_t()
+	:pending(0)
 {
 }
 
+jobsystem_t::jobsystem_t(int worker_count)
+	:next_worker(0), queued_count(0), stopping(false)
+{
+	worker_count = std::max(1, worker_count);
+	for (int i = 0; i < worker_count; i++)
+		workers.emplace_back(new worker_t());
+	for (int i = 0; i < worker_count; i++)
+		workers[i]->thread = std::thread(&jobsystem_t::threadentry, this, i);
+}
 
 jobsystem_t::~jobsystem_t()
 {
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		stopping = true;
+	}
+	sleep_condition.notify_all();
+	reserved_condition.notify_all();
+	for (size_t i = 0; i < workers.size(); i++)
+		workers[i]->thread.join();
+}
+
+jobsystem_t &jobsystem_t::shared()
+{
+	// never destroyed, a worker may still be running when exit() is called from a job
+	static jobsystem_t *pool = NULL;
+	static std::once_flag once;
+	std::call_once(once, []()
+	{
+		int count = shared_worker_count > 0 ? shared_worker_count : (int)std::thread::hardware_concurrency();
+		pool = new jobsystem_t(count);
+		std::cout << "there are " << std::thread::hardware_concurrency() << " hardware threads.\n";
+		std::cout << pool->get_worker_count() << " worker threads are started.\n";
+	});
+	return *pool;
+}
+
+void jobsystem_t::set_shared_worker_count(int count)
+{
+	shared_worker_count = count;
+}
+
+jobnode_t *jobsystem_t::submit(jobgroup_t &group, job_t job)
+{
+	return submit_after(group, std::vector<jobnode_t *>(), std::move(job));
+}
+
+jobnode_t *jobsystem_t::submit_after(jobgroup_t &group, const std::vector<jobnode_t *> &dependencies, job_t job)
+{
+	return submit_after(group, dependencies, std::move(job), nullptr);
 }
 
-void jobsystem_t::addjob(job_t job)
+jobnode_t *jobsystem_t::create_node(jobgroup_t &group, job_t job)
 {
-	jobs.push_back(job);
+	jobnode_t *node;
+	{
+		std::lock_guard<std::mutex> lock(group.mutex);
+		group.nodes.emplace_back();
+		node = &group.nodes.back();
+		group.pending++;
+	}
+	node->job = std::move(job);
+	node->group = &group;
+	node->unfinished = 1;
+	node->cost = 0.0f;
+	node->finished = false;
+	return node;
 }
 
-void jobsystem_t::startjobs()
+jobnode_t *jobsystem_t::submit_after(jobgroup_t &group, const std::vector<jobnode_t *> &dependencies, job_t job, cost_estimate_t estimate_cost)
 {
-	jobcount = (int)jobs.size();
-	size_t hardware_threads = (size_t)std::thread::hardware_concurrency();
-	size_t threadcount = std::max((size_t)1, std::min(hardware_threads / 2, jobs.size()));
-	std::cout << "there are " << hardware_threads << " hardware threads.\n";
-	std::cout << threadcount << " threads is starting for " << jobcount << " jobs.\n";
-	for (size_t i = 0; i < threadcount; i++)
+	jobnode_t *node = create_node(group, std::move(job));
+	node->estimate_cost = std::move(estimate_cost);
+	for (size_t i = 0; i < dependencies.size(); i++)
 	{
-		threads.emplace_back(&jobsystem_t::threadentry, this);
+		jobnode_t *dependency = dependencies[i];
+		if (!dependency) continue;
+		std::lock_guard<std::mutex> lock(dependency->mutex);
+		if (dependency->finished) continue;
+		dependency->successors.push_back(node);
+		node->unfinished++;
 	}
+	release(node);
+	return node;
 }
 
-void jobsystem_t::wait()
+// drop one unfinished dependency of the node, and queue it when there are none left
+void jobsystem_t::release(jobnode_t *node)
 {
-	for (size_t i = 0; i < threads.size(); i++)
-		threads[i].join();
+	if (--node->unfinished > 0) return;
+	if (node->estimate_cost)
+	{
+		node->cost = node->estimate_cost();
+		node->estimate_cost = nullptr;
+	}
+	if (node->cost > 0.0f)
+	{
+		std::lock_guard<std::mutex> lock(costed_mutex);
+		costed_jobs.push_back(node);
+		std::push_heap(costed_jobs.begin(), costed_jobs.end(), compare_cost);
+	}
+	else
+	{
+		int index = current_pool == this ? current_worker : (int)(next_worker++ % workers.size());
+		std::lock_guard<std::mutex> lock(workers[index]->mutex);
+		workers[index]->jobs.push_back(node);
+	}
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		queued_count++;
+	}
+	sleep_condition.notify_one();
 }
 
-void jobsystem_t::threadentry()
+jobnode_t *jobsystem_t::submit_to_worker(jobgroup_t &group, int worker, job_t job)
 {
+	jobnode_t *node = create_node(group, std::move(job));
+	node->unfinished = 0;
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		workers[worker]->handed_jobs.push_back(node);
+	}
+	// the other workers can't take the job, so it's not counted as queued
+	reserved_condition.notify_all();
+	return node;
+}
+
+void jobsystem_t::wait(jobgroup_t &group)
+{
+	int index = current_pool == this ? current_worker : -1;
+	jobnode_t *node;
+	while (group.pending > 0)
+	{
+		if (take_job(index, node))
+		{
+			run_job(node);
+			continue;
+		}
+		// the rest of the group is running on other threads
+		std::unique_lock<std::mutex> lock(group.mutex);
+		group.condition.wait(lock, [&group]() { return group.pending == 0; });
+	}
+	// the last job may still hold the lock of the group, which must be released before the group goes away
+	std::lock_guard<std::mutex> lock(group.mutex);
+}
+
+void jobsystem_t::parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &body)
+{
+	grain = std::max(grain, 1);
+	if (end - begin <= grain)
+	{
+		if (end > begin) body(begin, end);
+		return;
+	}
+	jobgroup_t group;
+	for (int chunk = begin + grain; chunk < end; chunk += grain)
+	{
+		const int chunk_end = std::min(chunk + grain, end);
+		submit(group, [&body, chunk, chunk_end]() { body(chunk, chunk_end); });
+	}
+	body(begin, begin + grain);
+	wait(group);
+}
+
+bool jobsystem_t::take_job(int index, jobnode_t *&out_node)
+{
+	if (queued_count == 0) return false;
+	const int count = (int)workers.size();
+	if (index >= 0)
+	{
+		worker_t &own = *workers[index];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.jobs.empty())
+		{
+			out_node = own.jobs.back();
+			own.jobs.pop_back();
+			queued_count--;
+			return true;
+		}
+	}
+	{
+		std::lock_guard<std::mutex> lock(costed_mutex);
+		if (!costed_jobs.empty())
+		{
+			std::pop_heap(costed_jobs.begin(), costed_jobs.end(), compare_cost);
+			out_node = costed_jobs.back();
+			costed_jobs.pop_back();
+			queued_count--;
+			return true;
+		}
+	}
+	for (int i = 1; i <= count; i++)
+	{
+		worker_t &victim = *workers[(std::max(index, 0) + i) % count];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.jobs.empty())
+		{
+			out_node = victim.jobs.front();
+			victim.jobs.pop_front();
+			queued_count--;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<int> jobsystem_t::claim_idle_workers(int max_count)
+{
+	std::vector<int> claimed;
+	for (int i = 0; i < (int)workers.size() && (int)claimed.size() < max_count; i++)
+	{
+		// a worker is idle between jobs, and only takes a job once it has turned itself running
+		int expected = worker_idle;
+		if (workers[i]->state.compare_exchange_strong(expected, worker_reserved))
+			claimed.push_back(i);
+	}
+	// the claimed workers sleeping as idle ones move over to reserved_condition
+	if (!claimed.empty())
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		sleep_condition.notify_all();
+	}
+	return claimed;
+}
+
+void jobsystem_t::return_workers(const std::vector<int> &claimed)
+{
+	if (claimed.empty()) return;
+	{
+		std::lock_guard<std::mutex> lock(sleep_mutex);
+		for (size_t i = 0; i < claimed.size(); i++)
+			workers[claimed[i]]->state = worker_idle;
+	}
+	// the workers may have slept through jobs queued while they were reserved
+	reserved_condition.notify_all();
+}
+
+void jobsystem_t::run_job(jobnode_t *node)
+{
+	node->job();
+	node->job = nullptr;
+	std::vector<jobnode_t *> successors;
+	{
+		std::lock_guard<std::mutex> lock(node->mutex);
+		node->finished = true;
+		successors.swap(node->successors);
+	}
+	for (size_t i = 0; i < successors.size(); i++)
+		release(successors[i]);
+
+	jobgroup_t &group = *node->group;
+	// the waiter may destroy the group as soon as it sees zero, so it is only touched under its lock
+	std::lock_guard<std::mutex> lock(group.mutex);
+	if (--group.pending == 0)
+		group.condition.notify_all();
+}
+
+void jobsystem_t::threadentry(int index)
+{
+	current_pool = this;
+	current_worker = index;
+	worker_t &self = *workers[index];
+	jobnode_t *node;
 	while (1)
 	{
-		int fetchindex = jobindex++;
-		if (fetchindex >= jobcount) break;
-		job_t job = jobs[fetchindex];
-		job();
+		int expected = worker_idle;
+		if (self.state.compare_exchange_strong(expected, worker_running))
+		{
+			const bool taken = take_job(index, node);
+			if (taken) run_job(node);
+			self.state = worker_idle;
+			if (taken) continue;
+		}
+		std::unique_lock<std::mutex> lock(sleep_mutex);
+		if (!self.handed_jobs.empty())
+		{
+			node = self.handed_jobs.front();
+			self.handed_jobs.pop_front();
+			lock.unlock();
+			run_job(node);
+			continue;
+		}
+		if (self.state == worker_reserved)
+		{
+			// a reserved worker only wakes for the jobs handed to it, or once it's given back
+			reserved_condition.wait(lock, [this, &self]()
+			{
+				return stopping || !self.handed_jobs.empty() || self.state != worker_reserved;
+			});
+		}
+		else
+		{
+			sleep_condition.wait(lock, [this, &self]()
+			{
+				return stopping || queued_count > 0 || self.state == worker_reserved;
+			});
+			// a worker claimed while sleeping may have taken the wakeup of a queued job, which it can't run, so it's passed on
+			if (self.state == worker_reserved && queued_count > 0) sleep_condition.notify_one();
+		}
+		if (stopping) break;
+	}
+}
+
+barrier_t::barrier_t(int count)
+	:count(count), waiting(0), generation(0)
+{
+}
+
+void barrier_t::arrive_and_wait()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	unsigned int arrival_generation = generation;
+	if (++waiting == count)
+	{
+		waiting = 0;
+		generation++;
+		condition.notify_all();
+		return;
 	}
+	condition.wait(lock, [this, arrival_generation]() { return generation != arrival_generation; });
 }
@@ -1,29 +1,147 @@
 #pragma once
 
 #include <vector>
+#include <deque>
+#include <memory>
 #include <functional>
 #include <atomic>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 
-// a simple job system, where all jobs must be added before start the system
+class jobgroup_t;
+
+// a submitted job, which jobs submitted later can depend on.
+// it is owned by its group, and stays valid until the group is destroyed.
+class jobnode_t
+{
+private:
+	friend class jobsystem_t;
+	std::function<void()> job;
+	jobgroup_t *group;
+	// the dependencies not finished yet, plus one while the node is being submitted
+	std::atomic<int> unfinished;
+	std::function<float()> estimate_cost;
+	float cost;
+	std::mutex mutex;
+	bool finished;
+	std::vector<jobnode_t *> successors;
+};
+
+// a set of submitted jobs that can be waited on together
+class jobgroup_t
+{
+public:
+	jobgroup_t();
+
+private:
+	friend class jobsystem_t;
+	std::atomic<int> pending;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::deque<jobnode_t> nodes;
+};
+
+// a persistent pool of worker threads, shared by all the stages.
+// every worker owns a deque of jobs: it takes the newest job of its own deque,
+// and when that is empty it steals the oldest job from another worker.
+// jobs may be submitted at any time, also from inside a running job,
+// and a job may depend on other jobs, so a chain of stages is a chain of jobs, without waiting in between.
+// jobs given an estimated cost are kept apart in a shared queue, and are taken longest first
+// by any worker whose own deque is empty, before it tries stealing.
+// jobs that split themselves across workers in lockstep claim idle workers first, and hand the parts to them directly,
+// so a part never waits behind another job, and locksteps never wait on each other.
 class jobsystem_t
 {
 public:
-	jobsystem_t();
+	explicit jobsystem_t(int worker_count);
 	~jobsystem_t();
 
 	typedef std::function<void()> job_t;
-	void addjob(job_t job);
-	void startjobs();
-	void wait();
+	typedef std::function<float()> cost_estimate_t;
+	jobnode_t *submit(jobgroup_t &group, job_t job);
+	// the job is queued once all the dependencies are finished, null dependencies are ignored
+	jobnode_t *submit_after(jobgroup_t &group, const std::vector<jobnode_t *> &dependencies, job_t job);
+	// the cost is estimated when the dependencies are finished, so it may use their results.
+	// it's only compared between jobs, a cost of zero or less queues the job like any other.
+	jobnode_t *submit_after(jobgroup_t &group, const std::vector<jobnode_t *> &dependencies, job_t job, cost_estimate_t estimate_cost);
+	// blocks until all the jobs of the group are finished, running queued jobs meanwhile
+	void wait(jobgroup_t &group);
+	// calls body(chunk_begin, chunk_end) for chunks of at most grain indices covering [begin, end), and waits for all of them.
+	// the first chunk runs on the calling thread, so it may be called from inside a job.
+	void parallel_for(int begin, int end, int grain, const std::function<void(int, int)> &body);
+	int get_worker_count() const { return (int)workers.size(); }
+	// true when every queued job has been taken by a thread
+	bool is_drained() const { return queued_count == 0; }
+	// reserves up to max_count workers which are neither running a job nor reserved already, and returns their indices.
+	// a reserved worker runs nothing but the jobs handed to it by submit_to_worker, until it's given back by return_workers.
+	// a running job splitting itself into a lockstep of n jobs must claim the n - 1 workers beforehand, and hand each one its part.
+	std::vector<int> claim_idle_workers(int max_count);
+	jobnode_t *submit_to_worker(jobgroup_t &group, int worker, job_t job);
+	void return_workers(const std::vector<int> &claimed);
+
+	// the pool used by all the stages, it is started on first use
+	static jobsystem_t &shared();
+	// the number of workers of the shared pool, must be set before its first use. 0 uses all the hardware threads.
+	static void set_shared_worker_count(int count);
+	// the max number of threads running jobs at the same time
+	static int worker_count() { return shared().get_worker_count(); }
 
 private:
-	void threadentry();
+	enum worker_state_t
+	{
+		worker_idle,
+		worker_running,
+		worker_reserved,
+	};
+
+	struct worker_t
+	{
+		std::mutex mutex;
+		std::deque<jobnode_t *> jobs;
+		std::atomic<int> state;
+		std::deque<jobnode_t *> handed_jobs; // the jobs handed to the worker while it's reserved, guarded by sleep_mutex
+		std::thread thread;
+
+		worker_t() :state(worker_idle) {}
+	};
+
+	static bool compare_cost(const jobnode_t *a, const jobnode_t *b) { return a->cost < b->cost; }
+	void threadentry(int index);
+	jobnode_t *create_node(jobgroup_t &group, job_t job);
+	void release(jobnode_t *node);
+	bool take_job(int index, jobnode_t *&out_node);
+	void run_job(jobnode_t *node);
 
 private:
-	std::vector<job_t> jobs;
-	std::atomic<int> jobindex;
-	int jobcount;
-	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<worker_t>> workers;
+	std::mutex costed_mutex;
+	std::vector<jobnode_t *> costed_jobs; // a max heap by cost
+	std::atomic<unsigned int> next_worker;
+	// queued jobs not yet taken by a thread, idle workers sleep while it is zero
+	std::atomic<int> queued_count;
+	std::mutex sleep_mutex;
+	// the idle workers sleep on sleep_condition, and the reserved ones on reserved_condition,
+	// so waking a worker for a queued job never wakes one which can't take it
+	std::condition_variable sleep_condition;
+	std::condition_variable reserved_condition;
+	bool stopping;
 };
 
+
+// blocks the arriving threads until all the participants arrive, then releases them together.
+// jobs running in lockstep must not outnumber jobsystem_t::worker_count(), otherwise they never all get a thread.
+class barrier_t
+{
+public:
+	barrier_t(int count);
+
+	void arrive_and_wait();
+
+private:
+	std::mutex mutex;
+	std::condition_variable condition;
+	int count;
+	int waiting;
+	unsigned int generation;
+};
@@ -0,0 +1,123 @@
+#include "pch.h"
+#include "mipmap.h"
+#include "simd.h"
+#include "jobsystem.h"
+
+#ifdef WTG_SIMD_SSE2
+// downsample_channel on four lanes, with the same float operations in the same order
+static __m128i downsample_lanes(__m128i a, __m128i b, __m128i c, __m128i d)
+{
+	const __m128 full = _mm_set1_ps(255.0f);
+	__m128 v = _mm_div_ps(_mm_cvtepi32_ps(a), full);
+	v = _mm_add_ps(v, _mm_div_ps(_mm_cvtepi32_ps(b), full));
+	v = _mm_add_ps(v, _mm_div_ps(_mm_cvtepi32_ps(c), full));
+	v = _mm_add_ps(v, _mm_div_ps(_mm_cvtepi32_ps(d), full));
+	return _mm_cvttps_epi32(_mm_mul_ps(_mm_mul_ps(v, _mm_set1_ps(0.25f)), full));
+}
+#endif
+
+void downsample_row(const color_t *in0, const color_t *in1, color_t *out, int width)
+{
+	int x = 0;
+#ifdef WTG_SIMD_SSE2
+	// two pixels per step, the channels of every output pixel are filtered in a vector of 4 lanes, the last one unused.
+	// the loads read 2 bytes past the input pixels and the store writes 2 bytes past the output pixels,
+	// so the step stops a pixel before the end of the row, and the scalar loop does the rest.
+	const unsigned char *p0 = (const unsigned char *)in0;
+	const unsigned char *p1 = (const unsigned char *)in1;
+	unsigned char *q = (unsigned char *)out;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i first_pixel = _mm_setr_epi16(-1, -1, -1, 0, 0, 0, 0, 0);
+	// the 16 bit lanes 0 to 2 hold the even input pixel and the lanes 3 to 5 the odd one
+	auto filter = [zero](__m128i a, __m128i b)
+	{
+		return downsample_lanes(_mm_unpacklo_epi16(a, zero), _mm_unpacklo_epi16(_mm_srli_si128(a, 6), zero),
+			_mm_unpacklo_epi16(b, zero), _mm_unpacklo_epi16(_mm_srli_si128(b, 6), zero));
+	};
+	for (; x + 3 <= width; x += 2)
+	{
+		// the low half holds the input pixels of out[x], the high half the ones of out[x + 1]
+		__m128i a = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(p0 + x * 6)), _mm_loadl_epi64((const __m128i *)(p0 + x * 6 + 6)));
+		__m128i b = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(p1 + x * 6)), _mm_loadl_epi64((const __m128i *)(p1 + x * 6 + 6)));
+		__m128i lo = _mm_packs_epi32(filter(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero)), zero);
+		__m128i hi = _mm_packs_epi32(filter(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero)), zero);
+		__m128i pixels = _mm_or_si128(_mm_and_si128(lo, first_pixel), _mm_slli_si128(hi, 6));
+		_mm_storel_epi64((__m128i *)(q + x * 3), _mm_packus_epi16(pixels, zero));
+	}
+#endif
+	for (; x < width; x++)
+		out[x] = downsample_pixel(in0[x * 2], in0[x * 2 + 1], in1[x * 2], in1[x * 2 + 1]);
+}
+
+void downsample_plane_row(const unsigned char *in0, const unsigned char *in1, unsigned char *out, int width)
+{
+	int x = 0;
+#ifdef WTG_SIMD_SSE2
+	// eight pixels per step. in 16 bit lanes, the low byte is the even pixel of a pair and the high byte the odd one.
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i low_byte = _mm_set1_epi16(0xff);
+	for (; x + 8 <= width; x += 8)
+	{
+		const __m128i a = _mm_loadu_si128((const __m128i *)(in0 + x * 2));
+		const __m128i b = _mm_loadu_si128((const __m128i *)(in1 + x * 2));
+		const __m128i a_even = _mm_and_si128(a, low_byte), a_odd = _mm_srli_epi16(a, 8);
+		const __m128i b_even = _mm_and_si128(b, low_byte), b_odd = _mm_srli_epi16(b, 8);
+		const __m128i lo = downsample_lanes(_mm_unpacklo_epi16(a_even, zero), _mm_unpacklo_epi16(a_odd, zero),
+			_mm_unpacklo_epi16(b_even, zero), _mm_unpacklo_epi16(b_odd, zero));
+		const __m128i hi = downsample_lanes(_mm_unpackhi_epi16(a_even, zero), _mm_unpackhi_epi16(a_odd, zero),
+			_mm_unpackhi_epi16(b_even, zero), _mm_unpackhi_epi16(b_odd, zero));
+		const __m128i pixels = _mm_packs_epi32(lo, hi);
+		_mm_storel_epi64((__m128i *)(out + x), _mm_packus_epi16(pixels, pixels));
+	}
+#endif
+	for (; x < width; x++)
+		out[x] = downsample_channel(in0[x * 2], in0[x * 2 + 1], in1[x * 2], in1[x * 2 + 1]);
+}
+
+void build_mip_chains(const std::vector<mip_chain_t *> &chains, const patch_t &patch)
+{
+	if (chains.empty()) return;
+	const int levels = (int)chains[0]->levels.size();
+	const int coarsest = levels - 1;
+	const int coarsest_size = patch.size >> coarsest;
+	// a chunk covers about 64k pixels of level 0
+	const int grain = std::max(1, 65536 / std::max(patch.size << coarsest, 1));
+	jobsystem_t::shared().parallel_for(0, coarsest_size, grain, [&](int block_begin, int block_end)
+	{
+		// level 1 is filtered from the interleaved level 0 through a row in the interleaved layout
+		std::vector<color_t> row(patch.size >> 1);
+		for (int block = block_begin; block < block_end; block++)
+		{
+			for (int i = 1; i < levels; i++)
+			{
+				const int size = patch.size >> i;
+				const int px = patch.x >> i;
+				const int py = patch.y >> i;
+				const int rows = 1 << (coarsest - i);
+				for (int y = block * rows; y < (block + 1) * rows; y++)
+				{
+					for (size_t c = 0; c < chains.size(); c++)
+					{
+						const planar_image_view_t &output = chains[c]->levels[i];
+						const int out_offset = (py + y) * output.stride + px;
+						if (i == 1)
+						{
+							const image_view_t &input = chains[c]->base;
+							const color_t *in0 = input.row((py + y) * 2) + px * 2;
+							downsample_row(in0, in0 + input.stride, row.data(), size);
+							deinterleave_row(row.data(), output.planes[0] + out_offset, output.planes[1] + out_offset, output.planes[2] + out_offset, size);
+							continue;
+						}
+						const planar_image_view_t &input = chains[c]->levels[i - 1];
+						const int in_offset = ((py + y) * 2) * input.stride + px * 2;
+						for (int channel = 0; channel < 3; channel++)
+						{
+							const unsigned char *in0 = input.planes[channel] + in_offset;
+							downsample_plane_row(in0, in0 + input.stride, output.planes[channel] + out_offset, size);
+						}
+					}
+				}
+			}
+		}
+	});
+}
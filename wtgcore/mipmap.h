@@ -0,0 +1,38 @@
+#pragma once
+
+#include <vector>
+#include "common_types.h"
+#include "planar_image.h"
+
+// the box filter of one channel of the four pixels covered by one pixel of the next mip level.
+// it's done in floats through get_vector3f and get_color, which truncate, so the levels are the ones the filter always made.
+inline unsigned char downsample_channel(int a, int b, int c, int d)
+{
+	const float v = a / 255.0f + b / 255.0f + c / 255.0f + d / 255.0f;
+	return (unsigned char)_color_from_float(v * 0.25f);
+}
+
+inline color_t downsample_pixel(color_t a, color_t b, color_t c, color_t d)
+{
+	return color_t(downsample_channel(a.r, b.r, c.r, d.r), downsample_channel(a.g, b.g, c.g, d.g), downsample_channel(a.b, b.b, c.b, d.b));
+}
+
+// out[x] is the box filter of in0[2x], in0[2x + 1], in1[2x] and in1[2x + 1], where in0 and in1 are two rows of the finer level.
+// the vector kernels give exactly the results of downsample_pixel.
+void downsample_row(const color_t *in0, const color_t *in1, color_t *out, int width);
+
+// out[x] is the box filter of in0[2x], in0[2x + 1], in1[2x] and in1[2x + 1], for a single plane of a planar image
+void downsample_plane_row(const unsigned char *in0, const unsigned char *in1, unsigned char *out, int width);
+
+// a mip chain whose level 0 is an interleaved image, and whose coarser levels are planar for the vector kernels.
+// levels[0] is left empty.
+struct mip_chain_t
+{
+	image_view_t base;
+	std::vector<planar_image_view_t> levels;
+};
+
+// builds the levels 1 to levels.size() - 1 of every chain, within the given patch of level 0, in one pass.
+// the patch is walked in blocks of the rows making one row of the coarsest level, so the rows of a level are still in cache
+// when the next level is made of them. the blocks are split among the workers.
+void build_mip_chains(const std::vector<mip_chain_t *> &chains, const patch_t &patch);
@@ -0,0 +1,165 @@
+#pragma once
+
+#include "common_types.h"
+
+// a square patch of a planar image, addressed relative to its corner
+struct planar_patch_view_t
+{
+	unsigned char *planes[3]; // the corner pixel of the patch in the r, g and b planes
+	int stride; // bytes between two rows of a plane
+	int size;
+
+	planar_patch_view_t() :planes(), stride(0), size(0) {}
+
+	unsigned char *row(int channel, int y) const { return planes[channel] + y * stride; }
+	color_t get_pixel(int x, int y) const
+	{
+		const int i = y * stride + x;
+		return color_t(planes[0][i], planes[1][i], planes[2][i]);
+	}
+};
+
+// the pixels of an image stored as separate r, g and b planes, without owning them.
+// every row of a plane starts on a cache line, so kernels working on one channel at a time run on whole vectors.
+struct planar_image_view_t
+{
+	unsigned char *planes[3];
+	int stride;
+	int resolution;
+
+	planar_image_view_t() :planes(), stride(0), resolution(0) {}
+
+	color_t get_pixel(int x, int y) const
+	{
+		const int i = y * stride + x;
+		return color_t(planes[0][i], planes[1][i], planes[2][i]);
+	}
+
+	void set_pixel(int x, int y, color_t color)
+	{
+		const int i = y * stride + x;
+		planes[0][i] = color.r;
+		planes[1][i] = color.g;
+		planes[2][i] = color.b;
+	}
+
+	color_t get_pixel_in_patch(const patch_t &patch, int x, int y) const
+	{
+		return get_pixel(patch.x + x, patch.y + y);
+	}
+
+	planar_patch_view_t get_patch(const patch_t &patch) const
+	{
+		planar_patch_view_t view;
+		for (int c = 0; c < 3; c++)
+			view.planes[c] = planes[c] + patch.y * stride + patch.x;
+		view.stride = stride;
+		view.size = patch.size;
+		return view;
+	}
+};
+
+// a planar image owning its planes, which are freed with it. like generic_image_t, it can be moved but not copied,
+// and the planes come from the heap or from an image_arena_t.
+struct planar_image_t : public planar_image_view_t
+{
+	planar_image_t() {}
+	explicit planar_image_t(int resolution) { init(resolution); }
+	planar_image_t(planar_image_t &&other) :planar_image_view_t(other), memory(std::move(other.memory)) { other.release(); }
+	planar_image_t(const planar_image_t &) = delete;
+
+	planar_image_t &operator = (planar_image_t &&other)
+	{
+		if (this == &other) return *this;
+		planar_image_view_t::operator = (other);
+		memory = std::move(other.memory);
+		other.release();
+		return *this;
+	}
+	planar_image_t &operator = (const planar_image_t &) = delete;
+
+	static int row_stride(int resolution) { return (int)image_arena_t::aligned_size(resolution); }
+	static size_t storage_size(int resolution) { return (size_t)row_stride(resolution) * resolution * 3; }
+
+	void init(int resolution)
+	{
+		memory.reset(new unsigned char[storage_size(resolution) + image_arena_t::alignment]);
+		unsigned char *base = memory.get();
+		set_planes(base + (image_arena_t::alignment - (size_t)base % image_arena_t::alignment) % image_arena_t::alignment, resolution);
+	}
+
+	// the planes belong to the arena, which must outlive them. the image is left empty when the arena is out of memory.
+	void init(int resolution, image_arena_t &arena)
+	{
+		memory.reset();
+		unsigned char *base = static_cast<unsigned char *>(arena.allocate(storage_size(resolution)));
+		if (base)
+			set_planes(base, resolution);
+		else
+			release();
+	}
+
+	void clear()
+	{
+		memory.reset();
+		release();
+	}
+
+	planar_image_view_t view() const { return *this; }
+
+private:
+	void set_planes(unsigned char *base, int resolution)
+	{
+		this->resolution = resolution;
+		stride = row_stride(resolution);
+		for (int c = 0; c < 3; c++)
+			planes[c] = base + (size_t)stride * resolution * c;
+	}
+
+	void release()
+	{
+		for (int c = 0; c < 3; c++)
+			planes[c] = NULL;
+		stride = 0;
+		resolution = 0;
+	}
+
+	std::unique_ptr<unsigned char[]> memory;
+};
+
+// split a row of interleaved pixels into the planes
+inline void deinterleave_row(const color_t *in, unsigned char *r, unsigned char *g, unsigned char *b, int width)
+{
+	for (int x = 0; x < width; x++)
+	{
+		r[x] = in[x].r;
+		g[x] = in[x].g;
+		b[x] = in[x].b;
+	}
+}
+
+// merge a row of the planes into interleaved pixels
+inline void interleave_row(const unsigned char *r, const unsigned char *g, const unsigned char *b, color_t *out, int width)
+{
+	for (int x = 0; x < width; x++)
+		out[x] = color_t(r[x], g[x], b[x]);
+}
+
+// the whole image to planes and back, both of the same resolution
+inline void convert_image(const image_view_t &src, planar_image_view_t dst)
+{
+	for (int y = 0; y < src.resolution; y++)
+	{
+		const size_t offset = (size_t)y * dst.stride;
+		deinterleave_row(src.row(y), dst.planes[0] + offset, dst.planes[1] + offset, dst.planes[2] + offset, src.resolution);
+	}
+}
+
+inline void convert_image(const planar_image_view_t &src, image_view_t dst)
+{
+	for (int y = 0; y < src.resolution; y++)
+	{
+		const size_t offset = (size_t)y * src.stride;
+		interleave_row(src.planes[0] + offset, src.planes[1] + offset, src.planes[2] + offset, dst.row(y), src.resolution);
+	}
+}
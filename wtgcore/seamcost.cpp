@@ -0,0 +1,181 @@
+#include "pch.h"
+#include "seamcost.h"
+
+// the pixels in the runs of a patch as float planes, indexed by node
+struct planar_patch_t
+{
+	std::vector<float> r, g, b;
+
+	void init(const image_patch_view_t &patch, const pixel_runs_t &runs)
+	{
+		allocate(runs.node_count);
+		for (size_t i = 0; i < runs.runs.size(); i++)
+		{
+			const pixel_runs_t::run_t &run = runs.runs[i];
+			const color_t *in = patch.row(run.y) + run.x;
+			for (int x = 0; x < run.count; x++)
+			{
+				r[run.first_node + x] = in[x].r / 255.0f;
+				g[run.first_node + x] = in[x].g / 255.0f;
+				b[run.first_node + x] = in[x].b / 255.0f;
+			}
+		}
+	}
+
+	// the planes are converted a run at a time
+	void init(const planar_patch_view_t &patch, const pixel_runs_t &runs)
+	{
+		allocate(runs.node_count);
+		float *planes[] = { r.data(), g.data(), b.data() };
+		for (size_t i = 0; i < runs.runs.size(); i++)
+		{
+			const pixel_runs_t::run_t &run = runs.runs[i];
+			for (int c = 0; c < 3; c++)
+				normalize_row(patch.row(c, run.y) + run.x, run.count, planes[c] + run.first_node);
+		}
+	}
+
+private:
+	void allocate(int node_count)
+	{
+		r.resize(node_count);
+		g.resize(node_count);
+		b.resize(node_count);
+	}
+
+	// out[i] = in[i] / 255
+	static void normalize_row(const unsigned char *in, int count, float *out)
+	{
+		int i = 0;
+#ifdef WTG_SIMD_SSE2
+		const __m128i zero = _mm_setzero_si128();
+		const __m128 scale = _mm_set1_ps(255.0f);
+		for (; i + 16 <= count; i += 16)
+		{
+			__m128i bytes = _mm_loadu_si128((const __m128i *)(in + i));
+			__m128i words[] = { _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero) };
+			for (int k = 0; k < 2; k++)
+			{
+				_mm_storeu_ps(out + i + k * 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(words[k], zero)), scale));
+				_mm_storeu_ps(out + i + k * 8 + 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(words[k], zero)), scale));
+			}
+		}
+#endif
+		for (; i < count; i++)
+			out[i] = in[i] / 255.0f;
+	}
+};
+
+// out[i] = distance(p[begin + i], q[begin + i + offset]), where p and q are colors in planar layout.
+template <typename seam_cost_t>
+static void color_distances(const seam_cost_t &seam_cost, const planar_patch_t &p, const planar_patch_t &q, int begin, int offset, int count, float *out)
+{
+	const float *pr = p.r.data() + begin, *pg = p.g.data() + begin, *pb = p.b.data() + begin;
+	const float *qr = q.r.data() + begin + offset, *qg = q.g.data() + begin + offset, *qb = q.b.data() + begin + offset;
+	int i = 0;
+#ifdef WTG_SIMD_FLOATV
+	for (; i + floatv_width <= count; i += floatv_width)
+	{
+		floatv_t dr = floatv_sub(floatv_load(pr + i), floatv_load(qr + i));
+		floatv_t dg = floatv_sub(floatv_load(pg + i), floatv_load(qg + i));
+		floatv_t db = floatv_sub(floatv_load(pb + i), floatv_load(qb + i));
+		floatv_store(out + i, seam_cost.distance(dr, dg, db));
+	}
+#endif
+	for (; i < count; i++)
+		out[i] = seam_cost.distance(pr[i] - qr[i], pg[i] - qg[i], pb[i] - qb[i]);
+}
+
+// cost[i] = diff[i] + diff[i + offset]
+static void summed_costs(const float *diff, int offset, int count, float *cost)
+{
+	int i = 0;
+#ifdef WTG_SIMD_FLOATV
+	for (; i + floatv_width <= count; i += floatv_width)
+		floatv_store(cost + i, floatv_add(floatv_load(diff + i), floatv_load(diff + i + offset)));
+#endif
+	for (; i < count; i++)
+		cost[i] = diff[i] + diff[i + offset];
+}
+
+// cost[i] = (diff[i] + diff[i + offset]) / (gradient_a[i] + gradient_b[i] + 1e-3)
+static void normalized_costs(const float *diff, const float *gradient_a, const float *gradient_b, int offset, int count, float *cost)
+{
+	int i = 0;
+#ifdef WTG_SIMD_FLOATV
+	const floatv_t epsilon = floatv_set1(1e-3f);
+	for (; i + floatv_width <= count; i += floatv_width)
+	{
+		floatv_t c = floatv_add(floatv_load(diff + i), floatv_load(diff + i + offset));
+		floatv_t g = floatv_add(floatv_load(gradient_a + i), floatv_load(gradient_b + i));
+		floatv_store(cost + i, floatv_div(c, floatv_add(g, epsilon)));
+	}
+#endif
+	for (; i < count; i++)
+		cost[i] = (diff[i] + diff[i + offset]) / (gradient_a[i] + gradient_b[i] + 1e-3f);
+}
+
+template <typename patch_view_t, typename seam_cost_t>
+void compute_seam_costs(const patch_view_t &patch_a, const patch_view_t &patch_b, const pixel_runs_t &runs, seam_cost_t seam_cost, seam_costs_t &costs)
+{
+	const int node_count = runs.node_count;
+	planar_patch_t a, b;
+	a.init(patch_a, runs);
+	b.init(patch_b, runs);
+
+	// the difference of the two patches is shared by the edges on both sides of a pixel
+	std::vector<float> diff(node_count), gradient_a, gradient_b;
+	color_distances(seam_cost, a, b, 0, 0, node_count, diff.data());
+	if (seam_cost_t::gradient_normalized)
+	{
+		gradient_a.resize(node_count);
+		gradient_b.resize(node_count);
+	}
+
+	costs.horizontal.assign(node_count, 0.0f);
+	costs.vertical.assign(node_count, 0.0f);
+	// the costs of count edges from the node at begin to the one offset after it
+	auto edge_costs = [&](int begin, int offset, int count, float *cost)
+	{
+		if (seam_cost_t::gradient_normalized)
+		{
+			color_distances(seam_cost, a, a, begin, offset, count, gradient_a.data() + begin);
+			color_distances(seam_cost, b, b, begin, offset, count, gradient_b.data() + begin);
+			normalized_costs(diff.data() + begin, gradient_a.data() + begin, gradient_b.data() + begin, offset, count, cost + begin);
+		}
+		else
+			summed_costs(diff.data() + begin, offset, count, cost + begin);
+	};
+	// the nodes of a run are consecutive, so the horizontal neighbor of a node is the next one.
+	// when the runs are whole rows, the pixels of the whole patch are done at once.
+	const int size = patch_a.size;
+	if (node_count == size * size)
+	{
+		edge_costs(0, 1, node_count - 1, costs.horizontal.data());
+		edge_costs(0, size, node_count - size, costs.vertical.data());
+		return;
+	}
+	for (size_t i = 0; i < runs.runs.size(); i++)
+	{
+		const pixel_runs_t::run_t &run = runs.runs[i];
+		if (run.count > 1) edge_costs(run.first_node, 1, run.count - 1, costs.horizontal.data());
+	}
+	// the vertical neighbors of a span are consecutive too, at the same distance
+	for (int y = 0; y < size - 1; y++)
+	{
+		runs.for_each_vertical_overlap(y, [&](int x, int count, const pixel_runs_t::run_t &run, const pixel_runs_t::run_t &next_run)
+		{
+			const int node = run.first_node + x - run.x;
+			edge_costs(node, next_run.first_node + x - next_run.x - node, count, costs.vertical.data());
+		});
+	}
+}
+
+template void compute_seam_costs(const image_patch_view_t &, const image_patch_view_t &, const pixel_runs_t &, seam_cost_normalized_l2_t, seam_costs_t &);
+template void compute_seam_costs(const image_patch_view_t &, const image_patch_view_t &, const pixel_runs_t &, seam_cost_ssd_t, seam_costs_t &);
+template void compute_seam_costs(const image_patch_view_t &, const image_patch_view_t &, const pixel_runs_t &, seam_cost_luminance_t, seam_costs_t &);
+template void compute_seam_costs(const image_patch_view_t &, const image_patch_view_t &, const pixel_runs_t &, seam_cost_perceptual_t, seam_costs_t &);
+template void compute_seam_costs(const planar_patch_view_t &, const planar_patch_view_t &, const pixel_runs_t &, seam_cost_normalized_l2_t, seam_costs_t &);
+template void compute_seam_costs(const planar_patch_view_t &, const planar_patch_view_t &, const pixel_runs_t &, seam_cost_ssd_t, seam_costs_t &);
+template void compute_seam_costs(const planar_patch_view_t &, const planar_patch_view_t &, const pixel_runs_t &, seam_cost_luminance_t, seam_costs_t &);
+template void compute_seam_costs(const planar_patch_view_t &, const planar_patch_view_t &, const pixel_runs_t &, seam_cost_perceptual_t, seam_costs_t &);
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <vector>
+#include "common_types.h"
+#include "planar_image.h"
+#include "simd.h"
+
+// the pixels of a patch which a graph is built on, as runs of neighboring pixels along the rows, row by row.
+// the pixels are numbered in that order, so the nodes of a run are consecutive.
+struct pixel_runs_t
+{
+	struct run_t
+	{
+		int x;
+		int y;
+		int count;
+		int first_node;
+	};
+	std::vector<run_t> runs;
+	std::vector<int> row_runs; // the first run of every row, and the number of runs at the end
+	int node_count;
+
+	// calls function(x, count, run, next_run) for every span of pixels of row y whose neighbors in row y + 1 are in the runs too
+	template <typename function_t>
+	void for_each_vertical_overlap(int y, function_t function) const
+	{
+		int i = row_runs[y], j = row_runs[y + 1];
+		const int i_end = row_runs[y + 1], j_end = row_runs[y + 2];
+		while (i < i_end && j < j_end)
+		{
+			const run_t &run = runs[i], &next_run = runs[j];
+			const int begin = std::max(run.x, next_run.x);
+			const int end = std::min(run.x + run.count, next_run.x + next_run.count);
+			if (begin < end) function(begin, end - begin, run, next_run);
+			if (run.x + run.count < next_run.x + next_run.count) i++;
+			else j++;
+		}
+	}
+};
+
+// the cost of cutting between the neighboring pixels in the runs of two overlapping patches, indexed by the node of a pixel.
+// horizontal[node] is the cost between (x, y) and (x + 1, y), vertical[node] is between (x, y) and (x, y + 1).
+// entries of pixels whose neighbor is not in the runs are meaningless.
+struct seam_costs_t
+{
+	std::vector<float> horizontal;
+	std::vector<float> vertical;
+};
+
+// seam costs are policy functors, giving the distance between two colors from their channel differences,
+// in a scalar and a vector version. the cost of an edge is the sum of the distances of the two patches on both pixels,
+// divided by the color gradient along the edge (the distances within each patch) if gradient_normalized is true.
+
+// a variant of the cost from the paper "Graphcut Textures: Image and Video Synthesis Using Graph Cuts".
+struct seam_cost_normalized_l2_t
+{
+	static const bool gradient_normalized = true;
+	float distance(float dr, float dg, float db) const { return std::sqrt(dr * dr + dg * dg + db * db); }
+#ifdef WTG_SIMD_FLOATV
+	floatv_t distance(floatv_t dr, floatv_t dg, floatv_t db) const
+	{
+		return floatv_sqrt(floatv_add(floatv_add(floatv_mul(dr, dr), floatv_mul(dg, dg)), floatv_mul(db, db)));
+	}
+#endif
+};
+
+// sum of squared differences, which strongly avoids cutting through any visible mismatch.
+struct seam_cost_ssd_t
+{
+	static const bool gradient_normalized = false;
+	float distance(float dr, float dg, float db) const { return dr * dr + dg * dg + db * db; }
+#ifdef WTG_SIMD_FLOATV
+	floatv_t distance(floatv_t dr, floatv_t dg, floatv_t db) const
+	{
+		return floatv_add(floatv_add(floatv_mul(dr, dr), floatv_mul(dg, dg)), floatv_mul(db, db));
+	}
+#endif
+};
+
+// only the difference of luminance (rec. 601 luma) counts, for textures where hue varies but structure matters.
+struct seam_cost_luminance_t
+{
+	static const bool gradient_normalized = true;
+	float distance(float dr, float dg, float db) const { return std::abs(0.299f * dr + 0.587f * dg + 0.114f * db); }
+#ifdef WTG_SIMD_FLOATV
+	floatv_t distance(floatv_t dr, floatv_t dg, floatv_t db) const
+	{
+		floatv_t luma = floatv_add(floatv_add(floatv_mul(floatv_set1(0.299f), dr), floatv_mul(floatv_set1(0.587f), dg)), floatv_mul(floatv_set1(0.114f), db));
+		return floatv_abs(luma);
+	}
+#endif
+};
+
+// euclidean distance with channels weighted by their contribution to the perceived brightness.
+struct seam_cost_perceptual_t
+{
+	static const bool gradient_normalized = true;
+	float distance(float dr, float dg, float db) const { return std::sqrt(0.299f * dr * dr + 0.587f * dg * dg + 0.114f * db * db); }
+#ifdef WTG_SIMD_FLOATV
+	floatv_t distance(floatv_t dr, floatv_t dg, floatv_t db) const
+	{
+		floatv_t r = floatv_mul(floatv_mul(floatv_set1(0.299f), dr), dr);
+		floatv_t g = floatv_mul(floatv_mul(floatv_set1(0.587f), dg), dg);
+		floatv_t b = floatv_mul(floatv_mul(floatv_set1(0.114f), db), db);
+		return floatv_sqrt(floatv_add(floatv_add(r, g), b));
+	}
+#endif
+};
+
+// computes the costs for all the pixels in the runs at once on planar float data, a run at a time.
+// it's instantiated for each of the seam costs above in seamcost.cpp, for patches of interleaved and of planar images.
+template <typename patch_view_t, typename seam_cost_t>
+void compute_seam_costs(const patch_view_t &patch_a, const patch_view_t &patch_b, const pixel_runs_t &runs, seam_cost_t seam_cost, seam_costs_t &costs);
+
+enum seam_cost_metric_t
+{
+	seam_cost_metric_normalized_l2,
+	seam_cost_metric_ssd,
+	seam_cost_metric_luminance,
+	seam_cost_metric_perceptual,
+};
+
+// calls function with the seam cost functor selected at run time, so that the callee is instantiated for each of them.
+template <typename function_t>
+void dispatch_seam_cost(seam_cost_metric_t metric, function_t function)
+{
+	switch (metric)
+	{
+	case seam_cost_metric_ssd: function(seam_cost_ssd_t()); break;
+	case seam_cost_metric_luminance: function(seam_cost_luminance_t()); break;
+	case seam_cost_metric_perceptual: function(seam_cost_perceptual_t()); break;
+	default: function(seam_cost_normalized_l2_t()); break;
+	}
+}
@@ -0,0 +1,424 @@
+#include "pch.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+#include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include "server.h"
+
+#ifdef _WIN32
+typedef SOCKET socket_t;
+inline void close_socket(socket_t s) { closesocket(s); }
+inline void shutdown_socket(socket_t s) { shutdown(s, SD_BOTH); }
+inline int process_id() { return (int)GetCurrentProcessId(); }
+const char *const region_name_root = "Local\\wtgcore-";
+const int send_flags = 0;
+#else
+typedef int socket_t;
+const socket_t INVALID_SOCKET = -1;
+inline void close_socket(socket_t s) { close(s); }
+inline void shutdown_socket(socket_t s) { shutdown(s, SHUT_RDWR); }
+inline int process_id() { return (int)getpid(); }
+const char *const region_name_root = "/wtgcore-";
+#ifdef MSG_NOSIGNAL
+const int send_flags = MSG_NOSIGNAL; // a closed client must not kill the server with sigpipe
+#else
+const int send_flags = 0;
+#endif
+#endif
+
+void split_arguments(const std::string &line, std::vector<std::string> &arguments)
+{
+	arguments.clear();
+	size_t i = 0;
+	while (i < line.size())
+	{
+		while (i < line.size() && isspace((unsigned char)line[i])) i++;
+		if (i == line.size()) break;
+		std::string argument;
+		bool quoted = false;
+		for (; i < line.size() && (quoted || !isspace((unsigned char)line[i])); i++)
+		{
+			if (line[i] == '"') quoted = !quoted;
+			else argument += line[i];
+		}
+		arguments.push_back(argument);
+	}
+}
+
+unsigned char *server_result_t::add_image(const char *label, int resolution, int channels)
+{
+	regions.emplace_back();
+	region_t &region = regions.back();
+	region.label = label;
+	region.resolution = resolution;
+	region.channels = channels;
+	const std::string name = name_prefix + "-" + std::to_string(regions.size() - 1);
+	if (!region.memory.create(name.c_str(), (size_t)resolution * resolution * channels))
+	{
+		std::cerr << "create shared memory " << name << " failed\n";
+		regions.pop_back();
+		return NULL;
+	}
+	return region.memory.data();
+}
+
+namespace
+{
+	struct connection_t
+	{
+		socket_t socket;
+		// guards the writes to the socket, and its closing
+		std::mutex write_mutex;
+		bool socket_closed;
+		// set when its reader is about to end, so the thread can be joined
+		std::atomic<bool> reader_finished;
+		// the members below are guarded by the mutex of the server
+		bool closed;
+		std::map<std::string, server_result_t> results;
+
+		explicit connection_t(socket_t socket) :socket(socket), socket_closed(false), reader_finished(false), closed(false) {}
+	};
+
+	struct request_t
+	{
+		std::shared_ptr<connection_t> connection;
+		std::string id;
+		int priority;
+		unsigned long long sequence;
+		std::vector<std::string> arguments;
+		std::atomic<bool> cancelled;
+
+		request_t() :priority(0), sequence(0), cancelled(false) {}
+	};
+}
+
+class server_t
+{
+public:
+	server_t(const request_validator_t &validator, const request_handler_t &handler)
+		:validator(validator), handler(handler), stopping(false), next_sequence(0), next_region(0) {}
+	int run(const char *socket_path);
+
+private:
+	void serve_connection(std::shared_ptr<connection_t> connection);
+	void handle_line(const std::shared_ptr<connection_t> &connection, const std::string &line);
+	void drop_connection(const std::shared_ptr<connection_t> &connection);
+	void run_requests();
+	void stop();
+	void send_line(connection_t &connection, const std::string &line);
+	bool is_id_in_use(const std::shared_ptr<connection_t> &connection, const std::string &id) const;
+
+	const request_validator_t &validator;
+	const request_handler_t &handler;
+	std::string socket_path;
+	std::mutex mutex;
+	std::condition_variable condition;
+	bool stopping;
+	unsigned long long next_sequence;
+	unsigned long long next_region;
+	std::vector<std::shared_ptr<request_t>> queue;
+	std::shared_ptr<request_t> running;
+	std::vector<std::shared_ptr<connection_t>> connections;
+};
+
+int server_t::run(const char *path)
+{
+	socket_path = path;
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (socket_path.size() >= sizeof(address.sun_path))
+	{
+		std::cerr << "the socket path is too long\n";
+		return -1;
+	}
+	memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+#ifdef _WIN32
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0)
+	{
+		std::cerr << "winsock startup failed\n";
+		return -1;
+	}
+#endif
+	// a socket file left by a server which didn't stop cleanly is replaced
+	remove(socket_path.c_str());
+	socket_t listen_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listen_socket == INVALID_SOCKET || bind(listen_socket, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listen_socket, 16) != 0)
+	{
+		std::cerr << "listen on " << socket_path << " failed\n";
+		if (listen_socket != INVALID_SOCKET) close_socket(listen_socket);
+		return -1;
+	}
+	std::cout << "serving on " << socket_path << std::endl;
+
+	std::thread runner(&server_t::run_requests, this);
+	// the reader of every connection, with the connection telling when it's finished
+	std::vector<std::pair<std::thread, std::shared_ptr<connection_t>>> readers;
+	while (true)
+	{
+		socket_t s = accept(listen_socket, NULL, NULL);
+		// the readers of the closed connections are joined as new ones come, so a long running server doesn't pile them up
+		for (size_t i = 0; i < readers.size();)
+		{
+			if (!readers[i].second->reader_finished)
+			{
+				i++;
+				continue;
+			}
+			readers[i].first.join();
+			readers.erase(readers.begin() + i);
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping)
+		{
+			if (s != INVALID_SOCKET) close_socket(s);
+			break;
+		}
+		if (s == INVALID_SOCKET) continue;
+		std::shared_ptr<connection_t> connection = std::make_shared<connection_t>(s);
+		connections.push_back(connection);
+		readers.emplace_back(std::thread(&server_t::serve_connection, this, connection), connection);
+	}
+	close_socket(listen_socket);
+	remove(socket_path.c_str());
+
+	// the readers are woken up by shutting their sockets down, and they drop their connections
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (size_t i = 0; i < connections.size(); i++)
+			shutdown_socket(connections[i]->socket);
+	}
+	for (size_t i = 0; i < readers.size(); i++)
+		readers[i].first.join();
+	runner.join();
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return 0;
+}
+
+void server_t::serve_connection(std::shared_ptr<connection_t> connection)
+{
+	std::string buffer;
+	char chunk[4096];
+	while (true)
+	{
+		const int received = (int)recv(connection->socket, chunk, sizeof(chunk), 0);
+		if (received <= 0) break;
+		buffer.append(chunk, received);
+		size_t end;
+		while ((end = buffer.find('\n')) != std::string::npos)
+		{
+			std::string line = buffer.substr(0, end);
+			buffer.erase(0, end + 1);
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			handle_line(connection, line);
+		}
+	}
+	drop_connection(connection);
+	connection->reader_finished = true;
+}
+
+bool server_t::is_id_in_use(const std::shared_ptr<connection_t> &connection, const std::string &id) const
+{
+	if (running && running->connection == connection && running->id == id) return true;
+	for (size_t i = 0; i < queue.size(); i++)
+		if (queue[i]->connection == connection && queue[i]->id == id) return true;
+	return connection->results.count(id) > 0;
+}
+
+void server_t::handle_line(const std::shared_ptr<connection_t> &connection, const std::string &line)
+{
+	std::vector<std::string> arguments;
+	split_arguments(line, arguments);
+	if (arguments.empty()) return;
+	const std::string &command = arguments[0];
+	if (command == "submit" && arguments.size() >= 4)
+	{
+		std::shared_ptr<request_t> request = std::make_shared<request_t>();
+		request->connection = connection;
+		request->id = arguments[1];
+		request->priority = std::atoi(arguments[2].c_str());
+		request->arguments.assign(arguments.begin() + 3, arguments.end());
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (is_id_in_use(connection, request->id))
+			{
+				send_line(*connection, "failed " + request->id);
+				return;
+			}
+		}
+		if (!validator(request->arguments))
+		{
+			send_line(*connection, "failed " + request->id);
+			return;
+		}
+		// only this thread adds requests of the connection, so the id stays free in between,
+		// and the request is answered as queued before it can be done
+		send_line(*connection, "queued " + request->id);
+		std::lock_guard<std::mutex> lock(mutex);
+		request->sequence = next_sequence++;
+		queue.push_back(request);
+		condition.notify_one();
+	}
+	else if (command == "cancel" && arguments.size() == 2)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		for (size_t i = 0; i < queue.size(); i++)
+		{
+			if (queue[i]->connection != connection || queue[i]->id != arguments[1]) continue;
+			queue.erase(queue.begin() + i);
+			lock.unlock();
+			send_line(*connection, "cancelled " + arguments[1]);
+			return;
+		}
+		// a running request is answered by the runner, once it stops
+		if (running && running->connection == connection && running->id == arguments[1])
+		{
+			running->cancelled = true;
+			return;
+		}
+		lock.unlock();
+		send_line(*connection, "unknown " + arguments[1]);
+	}
+	else if (command == "release" && arguments.size() == 2)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		const bool released = connection->results.erase(arguments[1]) > 0;
+		lock.unlock();
+		send_line(*connection, (released ? "released " : "unknown ") + arguments[1]);
+	}
+	else if (command == "shutdown" && arguments.size() == 1)
+		stop();
+	else
+		send_line(*connection, "invalid " + line);
+}
+
+void server_t::drop_connection(const std::shared_ptr<connection_t> &connection)
+{
+	std::map<std::string, server_result_t> results;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		connection->closed = true;
+		for (size_t i = 0; i < queue.size();)
+		{
+			if (queue[i]->connection == connection) queue.erase(queue.begin() + i);
+			else i++;
+		}
+		if (running && running->connection == connection) running->cancelled = true;
+		results.swap(connection->results);
+		for (size_t i = 0; i < connections.size(); i++)
+		{
+			if (connections[i] != connection) continue;
+			connections.erase(connections.begin() + i);
+			break;
+		}
+	}
+	std::lock_guard<std::mutex> write_lock(connection->write_mutex);
+	close_socket(connection->socket);
+	connection->socket_closed = true;
+}
+
+void server_t::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (stopping) return;
+		stopping = true;
+		queue.clear();
+		if (running) running->cancelled = true;
+	}
+	condition.notify_all();
+	// accept is woken up by a connection to the server itself
+	socket_t s = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (s == INVALID_SOCKET) return;
+	sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+	connect(s, (const sockaddr *)&address, sizeof(address));
+	close_socket(s);
+}
+
+void server_t::run_requests()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	while (true)
+	{
+		condition.wait(lock, [this]() { return stopping || !queue.empty(); });
+		if (stopping) break;
+		// the highest priority first, and the oldest within a priority
+		size_t best = 0;
+		for (size_t i = 1; i < queue.size(); i++)
+		{
+			if (queue[i]->priority > queue[best]->priority || (queue[i]->priority == queue[best]->priority && queue[i]->sequence < queue[best]->sequence))
+				best = i;
+		}
+		running = queue[best];
+		queue.erase(queue.begin() + best);
+		std::shared_ptr<request_t> request = running;
+		server_result_t result(region_name_root + std::to_string(process_id()) + "-" + std::to_string(next_region++));
+		lock.unlock();
+
+		const bool succeeded = handler(request->arguments, request->cancelled, result);
+
+		lock.lock();
+		running.reset();
+		connection_t &connection = *request->connection;
+		if (connection.closed) continue;
+		std::string reply;
+		if (request->cancelled)
+			reply = "cancelled " + request->id;
+		else if (!succeeded)
+			reply = "failed " + request->id;
+		else
+		{
+			reply = "done " + request->id;
+			for (size_t i = 0; i < result.regions.size(); i++)
+			{
+				const server_result_t::region_t &region = result.regions[i];
+				reply += " " + region.label + " " + region.memory.get_name() + " " + std::to_string(region.resolution) + " " + std::to_string(region.channels);
+			}
+			connection.results.emplace(request->id, std::move(result));
+		}
+		lock.unlock();
+		send_line(connection, reply);
+		lock.lock();
+	}
+}
+
+void server_t::send_line(connection_t &connection, const std::string &line)
+{
+	std::lock_guard<std::mutex> lock(connection.write_mutex);
+	if (connection.socket_closed) return;
+	const std::string message = line + "\n";
+	size_t sent = 0;
+	while (sent < message.size())
+	{
+		const int count = (int)send(connection.socket, message.c_str() + sent, (int)(message.size() - sent), send_flags);
+		if (count <= 0) return;
+		sent += count;
+	}
+}
+
+int serve(const char *socket_path, const request_validator_t &validator, const request_handler_t &handler)
+{
+	server_t server(validator, handler);
+	return server.run(socket_path);
+}
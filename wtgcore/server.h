@@ -0,0 +1,56 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include "fileio.h"
+
+// splits a line into arguments at the spaces outside of double quotes, for batch manifests and server requests
+void split_arguments(const std::string &line, std::vector<std::string> &arguments);
+
+// the images a request answers with, each in its own region of shared memory
+class server_result_t
+{
+public:
+	explicit server_result_t(const std::string &name_prefix) :name_prefix(name_prefix) {}
+
+	// a region for resolution * resolution pixels of channels bytes, top row first, or null if it can't be created.
+	// the label names the image in the reply.
+	unsigned char *add_image(const char *label, int resolution, int channels);
+
+private:
+	friend class server_t;
+	struct region_t
+	{
+		std::string label;
+		int resolution;
+		int channels;
+		shared_memory_t memory;
+	};
+	std::string name_prefix;
+	std::vector<region_t> regions;
+};
+
+// runs a request on its arguments, e.g. --tiles <resolution> <input-path> ..., and fills the result.
+// cancelled is set when the client cancels the request while it runs, the handler may stop early then.
+typedef std::function<bool(const std::vector<std::string> &arguments, const std::atomic<bool> &cancelled, server_result_t &result)> request_handler_t;
+
+// checks the arguments of a request before it's queued, a request which can't run is answered as failed right away.
+// it's called on the threads of the connections, while the handler may be running.
+typedef std::function<bool(const std::vector<std::string> &arguments)> request_validator_t;
+
+// listens on a unix domain socket, and runs the requests of all the clients one at a time, each using all the workers.
+// the queued requests are taken highest priority first, and in the order they came within a priority.
+// the clients send lines, and get lines back, split into arguments like the lines of a batch manifest:
+//   submit <id> <priority> <arguments>   queues a request, answered by "queued <id>", or "failed <id>" if the validator rejects it
+//   cancel <id>    drops a queued request, or stops a running one at its next tile
+//   release <id>   removes the shared memory of a finished request once the client has opened it, answered by "released <id>"
+//   shutdown       cancels everything and stops the server
+// a request ends with one of
+//   done <id> [<label> <shared-memory-name> <resolution> <channels>]...
+//   failed <id>
+//   cancelled <id>
+// an id without a request is answered by "unknown <id>", and a line which isn't a command by "invalid <line>".
+// the ids are chosen by the clients, per connection. the requests and results of a connection are dropped when it's closed.
+int serve(const char *socket_path, const request_validator_t &validator, const request_handler_t &handler);
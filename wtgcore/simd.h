@@ -0,0 +1,41 @@
+#pragma once
+
+// the widest float vector the compiler targets: avx when it's enabled (e.g. /arch:AVX2),
+// otherwise sse2, which all x64 compilers and msvc for win32 target by default.
+// kernels written with floatv_t keep a scalar loop for the remainder, and for targets without either.
+#if defined(__AVX__)
+#include <immintrin.h>
+#define WTG_SIMD_AVX
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define WTG_SIMD_SSE2
+#endif
+
+#if defined(WTG_SIMD_AVX)
+#define WTG_SIMD_FLOATV
+typedef __m256 floatv_t;
+const int floatv_width = 8;
+inline floatv_t floatv_load(const float *p) { return _mm256_loadu_ps(p); }
+inline void floatv_store(float *p, floatv_t v) { _mm256_storeu_ps(p, v); }
+inline floatv_t floatv_set1(float x) { return _mm256_set1_ps(x); }
+inline floatv_t floatv_add(floatv_t a, floatv_t b) { return _mm256_add_ps(a, b); }
+inline floatv_t floatv_sub(floatv_t a, floatv_t b) { return _mm256_sub_ps(a, b); }
+inline floatv_t floatv_mul(floatv_t a, floatv_t b) { return _mm256_mul_ps(a, b); }
+inline floatv_t floatv_div(floatv_t a, floatv_t b) { return _mm256_div_ps(a, b); }
+inline floatv_t floatv_sqrt(floatv_t a) { return _mm256_sqrt_ps(a); }
+inline floatv_t floatv_abs(floatv_t a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+#elif defined(WTG_SIMD_SSE2)
+#define WTG_SIMD_FLOATV
+typedef __m128 floatv_t;
+const int floatv_width = 4;
+inline floatv_t floatv_load(const float *p) { return _mm_loadu_ps(p); }
+inline void floatv_store(float *p, floatv_t v) { _mm_storeu_ps(p, v); }
+inline floatv_t floatv_set1(float x) { return _mm_set1_ps(x); }
+inline floatv_t floatv_add(floatv_t a, floatv_t b) { return _mm_add_ps(a, b); }
+inline floatv_t floatv_sub(floatv_t a, floatv_t b) { return _mm_sub_ps(a, b); }
+inline floatv_t floatv_mul(floatv_t a, floatv_t b) { return _mm_mul_ps(a, b); }
+inline floatv_t floatv_div(floatv_t a, floatv_t b) { return _mm_div_ps(a, b); }
+inline floatv_t floatv_sqrt(floatv_t a) { return _mm_sqrt_ps(a); }
+inline floatv_t floatv_abs(floatv_t a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+#endif
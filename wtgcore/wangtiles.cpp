@@ -1,9 +1,15 @@
 #include "pch.h"
 #include <iostream>
 #include <mutex>
+#include <climits>
+#include <cmath>
 #include "wangtiles.h"
 #include "graphcut.h"
 #include "jobsystem.h"
+#include "mipmap.h"
+
+// serializes the progress messages of the jobs
+std::mutex console_mutex;
 
 // generate a random integer in the range [0, max - 1].
 int rand_range(int max)
@@ -23,13 +29,13 @@ int reference_packing_table[] = {
 };
 const int reference_packing_table_size = 4;
 
-void generate_inv_packing_table(int inv_packing_table[], int num_colors)
+bool generate_inv_packing_table(int inv_packing_table[], int num_colors)
 {
 	int packing_table_size = num_colors * num_colors;
 	if (reference_packing_table_size < packing_table_size)
 	{
 		std::cerr << "reference packing table is too small for " << num_colors << " colors\n";
-		exit(-1);
+		return false;
 	}
 	for (int row = 0; row < packing_table_size; row++)
 	{
@@ -40,20 +46,23 @@ void generate_inv_packing_table(int inv_packing_table[], int num_colors)
 			inv_packing_table[reference_packing_table[index_in_reference_table]] = index_in_actual_table;
 		}
 	}
+	return true;
 }
 
 // if corner_tiles is true, we use the alternative for wang tiles as proposed by the paper "An Alternative for Wang Tiles: Colored Edges versus Colored Corners".
 // otherwise we use wang tiles with methods proposed by the paper "Efficient Texture Synthesis Using Strict Wang Tiles".
-wangtiles_t::wangtiles_t(image_t source, int num_colors, bool corner_tiles)
-	:is_corner_tiles(corner_tiles), source_image(source), num_colors(num_colors), debug_tileindex(-1)
+wangtiles_t::wangtiles_t(image_view_t source, int num_colors, bool corner_tiles)
+	:is_corner_tiles(corner_tiles), valid(true), source_image(source), num_colors(num_colors), mip_arena(&own_arena), debug_tileindex(-1), visual_scale(default_visual_scale), multilevel_seams(false), seam_cost(seam_cost_metric_normalized_l2),
+	solver(maxflow_solver_auto), verify_solver(false), reference_solver(maxflow_solver_edmonds_karp), solver_mismatch_count(0), cancel_flag(NULL)
 {
+	// a constructor has no way to fail, so the object is left unusable, and every generation fails on it
 	if (num_colors < 2 || num_colors > 4)
 	{
 		std::cerr << "num_colors must be 2, 3, or 4.\n";
-		exit(-1);
+		valid = false;
 	}
-	if (is_corner_tiles)
-		generate_inv_packing_table(inv_packing_table, num_colors);
+	else if (is_corner_tiles)
+		valid = generate_inv_packing_table(inv_packing_table, num_colors);
 }
 
 
@@ -63,15 +72,16 @@ wangtiles_t::~wangtiles_t()
 
 // for wang tiles, horizontal and vertical colored patches are picked.
 // for corner tiles, only horizontal colored patches are picked to be used as colored corner patches.
-void wangtiles_t::pick_colored_patches()
+bool wangtiles_t::pick_colored_patches()
 {
+	if (!valid) return false;
 	const int num_tiles = num_colors * num_colors;
 	const int resolution = source_image.resolution;
 	const int tile_size = resolution / num_tiles;
-	if (tile_size * num_tiles != source_image.resolution)
+	if (tile_size * num_tiles != source_image.resolution || tile_size < 2)
 	{
-		std::cerr << "input image resolution must be a multiple of num_colors * num_colors\n";
-		exit(-1);
+		std::cerr << "input image resolution must be a multiple of num_colors * num_colors, with tiles of at least 2 pixels\n";
+		return false;
 	}
 	colored_patches_h.clear();
 	colored_patches_v.clear();
@@ -108,179 +118,413 @@ void wangtiles_t::pick_colored_patches()
 		for (int i = 0; i < num_colors; i++)
 			colored_patches_v.push_back(random_non_overlapping_patch(tile_size));
 	}
+	return true;
 }
 
 void wangtiles_t::generate_packed_corners()
+{
+	packed_corners.init(source_image.resolution);
+	std::vector<int> tile_colors;
+	get_tile_colors(tile_colors);
+	jobsystem_t::shared().parallel_for(0, (int)tile_colors.size() / 4, 1, [this, &tile_colors](int begin, int end)
+	{
+		for (int i = begin * 4; i < end * 4; i += 4)
+			composite_tile(tile_colors[i], tile_colors[i + 1], tile_colors[i + 2], tile_colors[i + 3]);
+	});
+}
+
+// the four colors of every tile in the packing, as passed to get_packing_tileindex
+void wangtiles_t::get_tile_colors(std::vector<int> &tile_colors)
+{
+	const int num_tiles = num_colors * num_colors;
+	tile_colors.resize(num_tiles * num_tiles * 4);
+	for (int c0 = 0; c0 < num_colors; c0++) for (int c1 = 0; c1 < num_colors; c1++) for (int c2 = 0; c2 < num_colors; c2++) for (int c3 = 0; c3 < num_colors; c3++)
+	{
+		int *colors = &tile_colors[get_packing_tileindex(c0, c1, c2, c3) * 4];
+		colors[0] = c0;
+		colors[1] = c1;
+		colors[2] = c2;
+		colors[3] = c3;
+	}
+}
+
+// the pixel halfway between two pixels, rounded to the nearest
+inline color_t blend_half(color_t a, color_t b)
+{
+	return color_t((a.r + b.r + 1) >> 1, (a.g + b.g + 1) >> 1, (a.b + b.b + 1) >> 1);
+}
+
+// fill the tile of the given colors in packed_corners, which must be allocated.
+// every row of the tile is made of a few spans, each copied from a row of one colored patch.
+void wangtiles_t::composite_tile(int c0, int c1, int c2, int c3)
 {
 	const int num_tiles = num_colors * num_colors;
 	const int patch_size = colored_patches_h[0].size;
 	const int tile_size = patch_size;
 	const int half_tile_size = tile_size >> 1;
-	const int resolution = source_image.resolution;
-	packed_corners.clear();
-	packed_corners.init(resolution);
+	const int tileindex = get_packing_tileindex(c0, c1, c2, c3);
+	const int row = tileindex / num_tiles;
+	const int col = tileindex - row * num_tiles;
+	patch_t dest_patch;
+	dest_patch.x = col * tile_size;
+	dest_patch.y = row * tile_size;
+	dest_patch.size = tile_size;
+	const image_patch_view_t dest = packed_corners.get_patch(dest_patch);
 
 	if (is_corner_tiles)
 	{
-		color_t *pixels = packed_corners.pixels;
-		for (int cne = 0; cne < num_colors; cne++) for (int cse = 0; cse < num_colors; cse++) for (int csw = 0; csw < num_colors; csw++) for (int cnw = 0; cnw < num_colors; cnw++)
+		// every quadrant is the opposite quadrant of a colored corner patch
+		const int cne = c0, cse = c1, csw = c2, cnw = c3;
+		int corners[4] = { csw, cse, cnw, cne };
+		for (int y = 0; y < tile_size; y++)
 		{
-			int corners[4] = { csw, cse, cnw, cne };
-			int tileindex = get_packing_tileindex(cne, cse, csw, cnw);
-			int row = tileindex / num_tiles;
-			int col = tileindex - row * num_tiles;
-			int ox = col * tile_size;
-			int oy = row * tile_size;
-			for (int y = 0; y < tile_size; y++)
-			{
-				for (int x = 0; x < tile_size; x++)
-				{
-					int y_north_half = y >= half_tile_size ? 1 : 0;
-					int x_east_half = x >= half_tile_size ? 1 : 0;
-					int color = corners[(y_north_half << 1) | x_east_half];
-					const patch_t &source_patch = colored_patches_h[color];
-					int sample_y = y + (1 - y_north_half * 2) * half_tile_size + source_patch.y;
-					int sample_x = x + (1 - x_east_half * 2) * half_tile_size + source_patch.x;
-					color_t sample = source_image.pixels[sample_y * resolution + sample_x];
-					pixels[(y + oy) * resolution + x + ox] = sample;
-				}
-			}
+			int y_north_half = y >= half_tile_size ? 1 : 0;
+			int sample_y = y + (1 - y_north_half * 2) * half_tile_size;
+			const image_patch_view_t west = source_image.get_patch(colored_patches_h[corners[y_north_half << 1]]);
+			const image_patch_view_t east = source_image.get_patch(colored_patches_h[corners[(y_north_half << 1) | 1]]);
+			std::copy_n(west.row(sample_y) + half_tile_size, half_tile_size, dest.row(y));
+			std::copy_n(east.row(sample_y), half_tile_size, dest.row(y) + half_tile_size);
 		}
 	}
 	else
 	{
-		memset(packed_corners.pixels, 0, sizeof(color_t) * resolution * resolution);
-		auto setpixel_additive = [this](const patch_t &patch, int x, int y, color_t color, float weight)
+		// the tile is made of four triangles, one from each colored edge patch, meeting on the diagonals.
+		// a row at distance d from the nearest horizontal edge takes [0, d] from the west patch, [d, tile_size - 1 - d]
+		// from the south or north patch, and [tile_size - 1 - d, tile_size - 1] from the east patch,
+		// where the pixels on the diagonals are shared half and half by two triangles.
+		const int n = c0, e = c1, s = c2, w = c3;
+		const image_patch_view_t ps = source_image.get_patch(colored_patches_h[s]);
+		const image_patch_view_t pn = source_image.get_patch(colored_patches_h[n]);
+		const image_patch_view_t pe = source_image.get_patch(colored_patches_v[e]);
+		const image_patch_view_t pw = source_image.get_patch(colored_patches_v[w]);
+		for (int y = 0; y < tile_size; y++)
 		{
-			vector3f_t src = get_vector3f(packed_corners.get_pixel_in_patch(patch, x, y));
-			vector3f_t dst = get_vector3f(color);
-			packed_corners.set_pixel_in_patch(patch, x, y, get_color(src + dst * weight));
-		};
-		for (int n = 0; n < num_colors; n++) for (int e = 0; e < num_colors; e++) for (int s = 0; s < num_colors; s++) for (int w = 0; w < num_colors; w++)
-		{
-			int tileindex = get_packing_tileindex(n, e, s, w);
-			int row = tileindex / num_tiles;
-			int col = tileindex - row * num_tiles;
-			patch_t dest_patch;
-			dest_patch.x = col * tile_size;
-			dest_patch.y = row * tile_size;
-			dest_patch.size = tile_size;
-
-			const patch_t &ps = colored_patches_h[s];
-			const patch_t &pn = colored_patches_h[n];
-			const patch_t &pe = colored_patches_v[e];
-			const patch_t &pw = colored_patches_v[w];
-
-			// fill the tile by pixels from four colored edge patches
-			// by iterating over contributing pixels on four patches simultaneously.
-			// the row,col notations are from the upper half of south patch's perspective.
-			for (int row = 0; row < half_tile_size; row++)
+			const int d = std::min(y, tile_size - 1 - y);
+			const color_t *west = pw.row(y) + half_tile_size;
+			const color_t *middle = y < half_tile_size ? ps.row(y + half_tile_size) : pn.row(y - half_tile_size);
+			const color_t *east = pe.row(y); // starts at the column half_tile_size of the tile
+			color_t *out = dest.row(y);
+			std::copy_n(west, d, out);
+			out[d] = blend_half(west[d], middle[d]);
+			std::copy_n(middle + d + 1, tile_size - 2 - d * 2, out + d + 1);
+			out[tile_size - 1 - d] = blend_half(middle[tile_size - 1 - d], east[half_tile_size - 1 - d]);
+			std::copy_n(east + half_tile_size - d, d, out + tile_size - d);
+		}
+	}
+}
+
+// rows of a patch handed to one job by the per-pixel passes, so that a chunk covers about 64k pixels
+int pixel_rows_grain(int width)
+{
+	return std::max(1, 65536 / std::max(width, 1));
+}
+
+// upsample the given patch of the input into the output, which has twice the resolution
+template <typename _img_t>
+void upsample_patch(const _img_t &input, _img_t &output, const patch_t &patch)
+{
+	jobsystem_t::shared().parallel_for(patch.y, patch.y + patch.size, pixel_rows_grain(patch.size * 4), [&](int y_begin, int y_end)
+	{
+		for (int y = y_begin; y < y_end; y++)
+		{
+			for (int x = patch.x; x < patch.x + patch.size; x++)
 			{
-				for (int col = row; col < tile_size - row; col++)
-				{
-					float weight = (col == row || col == tile_size - row - 1) ? 0.5f : 1.0f;
-					color_t c = source_image.get_pixel_in_patch(ps, col, row + half_tile_size);
-					setpixel_additive(dest_patch, col, row, c, weight);
-					c = source_image.get_pixel_in_patch(pn, col, half_tile_size - 1 - row);
-					setpixel_additive(dest_patch, col, tile_size - 1 - row, c, weight);
-					c = source_image.get_pixel_in_patch(pe, half_tile_size - 1 - row, col);
-					setpixel_additive(dest_patch, tile_size - 1 - row, col, c, weight);
-					c = source_image.get_pixel_in_patch(pw, half_tile_size + row, col);
-					setpixel_additive(dest_patch, row, col, c, weight);
-				}
+				typename _img_t::_pixel_t c = input.get_pixel(x, y);
+				output.set_pixel(x << 1, y << 1, c);
+				output.set_pixel((x << 1) + 1, y << 1, c);
+				output.set_pixel(x << 1, (y << 1) + 1, c);
+				output.set_pixel((x << 1) + 1, (y << 1) + 1, c);
 			}
 		}
-	}
+	});
 }
 
-image_t downsample(const image_t &input)
+// a guess of how long the max flow of the patch takes, from the total color difference of the two images in the patch.
+// the more the images differ, the more flow there is to push before the cut is found.
+template <typename _view_t>
+float estimate_cut_cost(const _view_t &image_a, const _view_t &image_b, const patch_t &patch)
 {
-	image_t output;
-	output.init(input.resolution >> 1);
-	for (int y = 0; y < output.resolution; y++)
-	{
-		for (int x = 0; x < output.resolution; x++)
-		{
-			vector3f_t v = get_vector3f(input.get_pixel(x << 1, y << 1));
-			v = v + get_vector3f(input.get_pixel((x << 1) + 1, y << 1));
-			v = v + get_vector3f(input.get_pixel(x << 1, (y << 1) + 1));
-			v = v + get_vector3f(input.get_pixel((x << 1) + 1, (y << 1) + 1));
-			color_t c = get_color(v * 0.25f);
-			output.set_pixel(x, y, c);
+	unsigned long long difference = 0;
+	for (int y = 0; y < patch.size; y++)
+	{
+		for (int x = 0; x < patch.size; x++)
+		{
+			color_t a = image_a.get_pixel_in_patch(patch, x, y);
+			color_t b = image_b.get_pixel_in_patch(patch, x, y);
+			difference += std::abs(a.r - b.r) + std::abs(a.g - b.g) + std::abs(a.b - b.b);
 		}
 	}
-	return output;
+	return (float)difference + 1.0f;
 }
 
-template <typename _img_t>
-_img_t upsample(const _img_t &input)
+// mark the pixels of the patch within the given distance (in both axes) to a pixel on the other side of the seam.
+// the returned band has the size of the patch, the pixels around the patch are not looked at.
+mask_t seam_band(const mask_view_t &mask, const patch_t &patch, int radius)
 {
-	_img_t output;
-	output.init(input.resolution << 1);
-	for (int y = 0; y < input.resolution; y++)
+	const int resolution = patch.size;
+	mask_t band(resolution), dilated(resolution);
+	for (int y = 0; y < resolution; y++)
+	{
+		for (int x = 0; x < resolution; x++)
+		{
+			unsigned char v = mask.get_pixel_in_patch(patch, x, y);
+			bool seam = (x > 0 && mask.get_pixel_in_patch(patch, x - 1, y) != v) || (x < resolution - 1 && mask.get_pixel_in_patch(patch, x + 1, y) != v) ||
+				(y > 0 && mask.get_pixel_in_patch(patch, x, y - 1) != v) || (y < resolution - 1 && mask.get_pixel_in_patch(patch, x, y + 1) != v);
+			band.set_pixel(x, y, seam ? 255 : 0);
+		}
+	}
+	// dilate horizontally then vertically
+	for (int y = 0; y < resolution; y++)
+	{
+		for (int x = 0; x < resolution; x++)
+		{
+			unsigned char v = 0;
+			for (int i = std::max(x - radius, 0); i <= std::min(x + radius, resolution - 1) && v == 0; i++)
+				v = band.get_pixel(i, y);
+			dilated.set_pixel(x, y, v);
+		}
+	}
+	for (int y = 0; y < resolution; y++)
 	{
-		for (int x = 0; x < input.resolution; x++)
+		for (int x = 0; x < resolution; x++)
 		{
-			typename _img_t::_pixel_t c = input.get_pixel(x, y);
-			output.set_pixel(x << 1, y << 1, c);
-			output.set_pixel((x << 1) + 1, y << 1, c);
-			output.set_pixel(x << 1, (y << 1) + 1, c);
-			output.set_pixel((x << 1) + 1, (y << 1) + 1, c);
+			unsigned char v = 0;
+			for (int i = std::max(y - radius, 0); i <= std::min(y + radius, resolution - 1) && v == 0; i++)
+				v = dilated.get_pixel(x, i);
+			band.set_pixel(x, y, v);
 		}
 	}
-	return output;
+	return band;
 }
 
-void wangtiles_t::generate_wang_tiles()
+bool wangtiles_t::generate_wang_tiles()
 {
+	if (!valid) return false;
 	const int resolution = source_image.resolution;
-	int visual_scale = 128; // apply computer vision processes under a certain scale
 
-	int num_tiles = num_colors * num_colors;
-	int tile_size = resolution / num_tiles;
-	visual_scale = std::min(visual_scale, tile_size);
+	const int num_tiles = num_colors * num_colors;
+	const int tile_count = num_tiles * num_tiles;
+	const int tile_size = resolution / num_tiles;
+	// apply computer vision processes under a certain scale
+	const int scale = std::min(visual_scale, tile_size);
 
 	// downsample images into specific visual scale
 	int downsample_iterations = 0;
-	std::vector<image_t> source_mips, corners_mips;
-	source_mips.push_back(source_image);
-	corners_mips.push_back(packed_corners);
-	while ((tile_size >> downsample_iterations) > visual_scale)
-	{
-		source_mips.push_back(downsample(source_mips.back()));
-		corners_mips.push_back(downsample(corners_mips.back()));
+	while ((tile_size >> downsample_iterations) > scale)
 		downsample_iterations++;
-	}
-	if (source_mips.back().resolution != visual_scale * num_tiles)
+	if (tile_size < 2 || tile_size * num_tiles != resolution || (tile_size >> downsample_iterations) != scale)
 	{
 		std::cerr << "invalid state\n";
-		exit(-1);
+		return false;
+	}
+	const int levels = downsample_iterations + 1;
+
+	// all the levels of the atlas are allocated up front, and the jobs of a tile only touch that tile in them.
+	// mips[0] is the full resolution, mips[levels - 1] is the visual scale.
+	// the coarser levels of all the chains share one allocation, level 0 is the source and the results.
+	// the coarser levels of the colors are planar, for the vector kernels of the mip build and of the seam costs.
+	packed_corners.init(resolution);
+	packed_corners_mask.init(resolution);
+	size_t arena_size = image_arena_t::mip_chain_size<unsigned char>(resolution, levels);
+	for (int i = 1; i < levels; i++)
+		arena_size += planar_image_t::storage_size(resolution >> i) * 2;
+	if (!mip_arena->reset(arena_size)) return false;
+	std::vector<planar_image_t> source_levels(levels), corners_levels(levels);
+	std::vector<image_t> constraints(levels);
+	std::vector<mask_t> mask_levels(levels);
+	mip_chain_t source_mips, corners_mips;
+	std::vector<mask_view_t> mask_mips(levels);
+	source_mips.base = source_image;
+	corners_mips.base = packed_corners;
+	source_mips.levels.resize(levels);
+	corners_mips.levels.resize(levels);
+	mask_mips[0] = packed_corners_mask;
+	for (int i = 1; i < levels; i++)
+	{
+		source_levels[i].init(resolution >> i, *mip_arena);
+		corners_levels[i].init(resolution >> i, *mip_arena);
+		mask_levels[i].init(resolution >> i, *mip_arena);
+		source_mips.levels[i] = source_levels[i];
+		corners_mips.levels[i] = corners_levels[i];
+		mask_mips[i] = mask_levels[i];
+		if (!source_levels[i].planes[0] || !corners_levels[i].planes[0] || !mask_levels[i].pixels) return false;
 	}
 
-	// perform graphcut in visual scale
-	graphcut_constraints.clear();
-	graphcut_constraints.init(visual_scale);
-	fill_graphcut_constraints(visual_scale, graphcut_constraints);
-	graphcut_textures(corners_mips.back(), source_mips.back(), graphcut_constraints, packed_corners_mask);
+	std::vector<int> tile_colors;
+	get_tile_colors(tile_colors);
+
+	// when there are fewer tiles than workers, the spare workers help solving each tile.
+	// the cuts are queued most expensive first, and once the queue is drained the last cuts are given all the idle workers.
+	const int cut_count = debug_tileindex != -1 ? 1 : tile_count;
+	const int workers_per_cut = std::max(1, jobsystem_t::worker_count() / cut_count);
+	std::vector<algorithm_statistics_t> statistics(levels * tile_count);
+	std::vector<solver_check_t> solver_checks(levels * tile_count);
+
+	jobsystem_t &jobsystem = jobsystem_t::shared();
+	jobgroup_t group;
+	// set by a tile that can't be cut, the jobs left are skipped as when cancelled
+	std::atomic<bool> failed(false);
+	auto is_stopped = [this, &failed]() { return is_cancelled() || failed; };
+	std::mutex progress_mutex;
+	int finished_tiles = 0;
+
+	// the constraints are the same for every tile of a level.
+	// the seam of an upsampled mask is off by at most one pixel of the coarser level,
+	// so it's re-solved within a narrow band, where everything outside the band keeps its side of the cut.
+	std::vector<jobnode_t *> constraints_jobs(levels, NULL);
+	for (int i = 0; i < levels; i++)
+	{
+		if (i != levels - 1 && !multilevel_seams) continue;
+		constraints[i].init(tile_size >> i);
+		constraints_jobs[i] = jobsystem.submit(group, [this, &constraints, tile_size, i]()
+		{
+			fill_graphcut_constraints(tile_size >> i, constraints[i]);
+		});
+	}
 
-	for (int i = 1; i <= downsample_iterations; i++)
+	// every tile is a chain: composite, downsample, cut at the visual scale, then upsample (and refine) level by level.
+	// the last upsample writes the finished tile into the full resolution mask.
+	for (int tileindex = 0; tileindex < tile_count; tileindex++)
 	{
-		source_mips[i].clear();
-		corners_mips[i].clear();
+		const int row = tileindex / num_tiles;
+		const int col = tileindex - row * num_tiles;
+		auto tile_patch = [tile_size, row, col](int level)
+		{
+			patch_t patch;
+			patch.size = tile_size >> level;
+			patch.x = col * patch.size;
+			patch.y = row * patch.size;
+			return patch;
+		};
+		const bool cut = debug_tileindex == -1 || debug_tileindex == tileindex;
+		const int *colors = &tile_colors[tileindex * 4];
 
-		packed_corners_mask = upsample(packed_corners_mask);
+		jobnode_t *job = jobsystem.submit(group, [this, is_stopped, colors]()
+		{
+			if (!is_stopped()) composite_tile(colors[0], colors[1], colors[2], colors[3]);
+		});
+		job = jobsystem.submit_after(group, { job }, [is_stopped, &source_mips, &corners_mips, tile_patch]()
+		{
+			if (!is_stopped()) build_mip_chains({ &source_mips, &corners_mips }, tile_patch(0));
+		});
+		// level 0 is interleaved, the coarser levels are planar
+		auto cut_cost = [&corners_mips, &source_mips, tile_patch, cut](int level)
+		{
+			if (!cut) return 0.0f;
+			if (level == 0) return estimate_cut_cost(corners_mips.base, source_mips.base, tile_patch(level));
+			return estimate_cut_cost(corners_mips.levels[level], source_mips.levels[level], tile_patch(level));
+		};
+		auto cut_level = [&, this, tile_patch, tileindex, tile_count, workers_per_cut](int level, bool refine)
+		{
+			if (is_stopped()) return;
+			algorithm_statistics_t &stat = statistics[level * tile_count + tileindex];
+			solver_check_t &check = solver_checks[level * tile_count + tileindex];
+			bool succeeded;
+			if (level == 0)
+				succeeded = graphcut_tile(corners_mips.base, source_mips.base, constraints[level], mask_mips[level], tile_patch(level), refine, workers_per_cut, stat, check);
+			else
+				succeeded = graphcut_tile(corners_mips.levels[level], source_mips.levels[level], constraints[level], mask_mips[level], tile_patch(level), refine, workers_per_cut, stat, check);
+			if (!succeeded) failed = true;
+		};
+		job = jobsystem.submit_after(group, { job, constraints_jobs[levels - 1] }, [&mask_mips, levels, tile_patch, cut, cut_level]()
+		{
+			const int i = levels - 1;
+			const patch_t patch = tile_patch(i);
+			if (cut)
+				cut_level(i, false);
+			else
+				for (int y = 0; y < patch.size; y++)
+					memset(&mask_mips[i].pixels[(patch.y + y) * mask_mips[i].resolution + patch.x], 0, patch.size);
+		}, [cut_cost, levels]() { return cut_cost(levels - 1); });
+		for (int i = levels - 2; i >= 0; i--)
+		{
+			const bool refine = cut && multilevel_seams;
+			job = jobsystem.submit_after(group, { job, constraints_jobs[i] }, [&mask_mips, i, tile_patch, refine, cut_level]()
+			{
+				upsample_patch(mask_mips[i + 1], mask_mips[i], tile_patch(i + 1));
+				if (refine)
+					cut_level(i, true);
+			}, [cut_cost, refine, i]() { return refine ? cut_cost(i) : 0.0f; });
+		}
+		if (progress)
+		{
+			jobsystem.submit_after(group, { job }, [this, &progress_mutex, &finished_tiles, tile_count]()
+			{
+				std::lock_guard<std::mutex> lock(progress_mutex);
+				progress(++finished_tiles, tile_count);
+			});
+		}
 	}
+	jobsystem.wait(group);
+	if (is_stopped()) return false;
+
+	// report the tiles in the order of the scales they are solved at
+	graphcut_statistics.clear();
+	for (int i = levels - 1; i >= 0; i--)
+	{
+		if (i != levels - 1 && !multilevel_seams) continue;
+		for (int tileindex = 0; tileindex < tile_count; tileindex++)
+		{
+			if (debug_tileindex != -1 && tileindex != debug_tileindex) continue;
+			const algorithm_statistics_t &stat = statistics[i * tile_count + tileindex];
+			std::cout << "found max-flow for tile " << tileindex << " after " << stat.iteration_count << " iterations: " << stat.max_flow << std::endl;
+			if (verify_solver)
+			{
+				// the solvers sum the flow in different orders, so the flows only agree up to the rounding of the floats
+				const solver_check_t &check = solver_checks[i * tile_count + tileindex];
+				const float max_flow_tolerance = 1e-4f * std::max(1.0f, std::abs(check.reference_max_flow));
+				if (std::abs(stat.max_flow - check.reference_max_flow) > max_flow_tolerance)
+				{
+					std::cerr << "max-flow of tile " << tileindex << " differs from the reference solver: " << stat.max_flow << " vs " << check.reference_max_flow << "\n";
+					solver_mismatch_count++;
+				}
+				else if (check.mismatched_pixels > 0)
+					std::cout << "cut mask of tile " << tileindex << " differs from the reference solver in " << check.mismatched_pixels << " pixels, with the same max-flow\n";
+			}
+
+			tile_statistics_t tile_stat;
+			tile_stat.tileindex = tileindex;
+			tile_stat.tile_size = tile_size >> i;
+			tile_stat.graphcut = stat;
+			graphcut_statistics.push_back(tile_stat);
+		}
+	}
+
+	graphcut_constraints = std::move(constraints[levels - 1]);
+	return true;
 }
 
+// a generator of its own for every stripe of the index map, so the stripes don't share the sequence of rand,
+// and a stripe comes out the same whichever worker runs it
+struct indexmap_random_t
+{
+	unsigned long long state;
+
+	// splitmix64 of the seed and the stream, so neighbouring streams start far apart
+	indexmap_random_t(unsigned long long seed, unsigned long long stream)
+	{
+		unsigned long long z = seed + (stream + 1) * 0x9E3779B97F4A7C15ull;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		state = z ^ (z >> 31);
+	}
+
+	// an integer in the range [0, max - 1]
+	int next(int max)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		return (int)(((state >> 32) * (unsigned long long)max) >> 32);
+	}
+};
+
 image_t wangtiles_t::generate_indexmap(int resolution)
 {
-	image_t indexmap;
-	indexmap.init(resolution);
+	if (!valid) return image_t();
+	image_t indexmap(resolution);
 
 	if (is_corner_tiles)
 	{
-		image_t cornermap;
-		cornermap.init(resolution + 1);
+		image_t cornermap(resolution + 1);
 		for (int y = 0; y < resolution; y++)
 		{
 			for (int x = 0; x < resolution; x++)
@@ -307,56 +551,260 @@ image_t wangtiles_t::generate_indexmap(int resolution)
 	}
 	else
 	{
-		std::vector<int> bottom(resolution);
-		std::vector<int> prev_row(resolution);
-		int leftmost_edge = -1;
-		int prev_edge = -1;
-		int s, w, n, e;
-		int retry = 0;
-		const int maxretry = 100;
+		generate_indexmap_rows(resolution, [&](int y_begin, int y_end, const color_t *rows)
+		{
+			memcpy(indexmap.pixels + (size_t)y_begin * resolution, rows, sizeof(color_t) * (size_t)(y_end - y_begin) * resolution);
+		});
+	}
+	return indexmap;
+}
 
-		for (int y = 0; y < resolution; y++)
+// fills a row of edge tiles from the colors of its south edges, picking the other edges, the north ones are returned.
+// the west and east edges wrap around the row. a tile which duplicates a neighbor placed already, on its left,
+// at the wrap on its right, or next to it in the row below if given, is picked again.
+void wangtiles_t::fill_indexmap_row(int resolution, const unsigned char *south, unsigned char *north,
+	const color_t *below, color_t *row, indexmap_random_t &random)
+{
+	int leftmost_edge = -1;
+	int prev_edge = -1;
+	int retry = 0;
+	const int maxretry = 100;
+
+	for (int x = 0; x < resolution; x++)
+	{
+		int s = south[x];
+		int w = x > 0 ? prev_edge : (leftmost_edge = random.next(num_colors));
+		int n = random.next(num_colors);
+		int e = x < resolution - 1 ? random.next(num_colors) : leftmost_edge;
+		int tileindex = get_packing_tileindex(n, e, s, w);
+		bool duplicate = x > 0 && (row[x - 1].r == tileindex || (x == resolution - 1 && row[0].r == tileindex));
+		for (int ox = -1; ox <= 1 && below && !duplicate; ox++)
+			duplicate = below[(x + ox + resolution) % resolution].r == tileindex;
+		if (duplicate && retry++ < maxretry)
 		{
-			for (int x = 0; x < resolution; x++)
+			x--;
+			continue;
+		}
+		if (retry > maxretry)
+		{
+			std::lock_guard<std::mutex> lock(console_mutex);
+			std::cout << "A tile is left duplicated with neighbor after " << maxretry << " retries\n";
+		}
+		retry = 0;
+		row[x] = color_t(tileindex, tileindex, tileindex);
+		north[x] = (unsigned char)n;
+		prev_edge = e;
+	}
+}
+
+// fills a row of edge tiles whose south and north edges are both given, at the seams of the stripes.
+// only the west and east edges are left to pick, too few choices for picking the tiles again one by one,
+// so the edges are picked for the whole row at once, duplicating as few neighbors as possible: those on the left,
+// and those next to it in the rows given below and above. among as good edges, one is picked at random.
+// the edge at the start of the row is picked up front, and the check across the wrap of the row is left out.
+void wangtiles_t::fill_indexmap_seam_row(int resolution, const unsigned char *south, const unsigned char *north,
+	const color_t *below, const color_t *above, color_t *row, indexmap_random_t &random)
+{
+	// the state after a tile is its west and east edges, the state before it is the east edge of its left neighbor
+	const int states = num_colors * num_colors;
+	const int leftmost_edge = random.next(num_colors);
+	std::vector<unsigned char> back((size_t)resolution * states);
+	std::vector<int> cost(states), next_cost(states);
+	const int unreachable = INT_MAX;
+
+	auto tile_at = [&](int x, int w, int e) { return get_packing_tileindex(north[x], e, south[x], w); };
+	auto duplicates_rows = [&](int x, int tileindex)
+	{
+		for (int ox = -1; ox <= 1; ox++)
+		{
+			int nx = (x + ox + resolution) % resolution;
+			if ((below && below[nx].r == tileindex) || (above && above[nx].r == tileindex)) return true;
+		}
+		return false;
+	};
+
+	for (int x = 0; x < resolution; x++)
+	{
+		const bool last = x == resolution - 1;
+		std::fill(next_cost.begin(), next_cost.end(), unreachable);
+		for (int w = 0; w < num_colors; w++)
+		{
+			if (x == 0 && w != leftmost_edge) continue;
+			for (int e = 0; e < num_colors; e++)
 			{
-				s = y == 0 ? (bottom[x] = random_color()) : prev_row[x];
-				w = x > 0 ? prev_edge : (leftmost_edge = random_color());
-				n = y < resolution - 1 ? random_color() : bottom[x];
-				e = x < resolution - 1 ? random_color() : leftmost_edge;
-				int tileindex = get_packing_tileindex(n, e, s, w);
-				// check if this tile duplicates a neighbor
-				bool duplicate = false;
-				for (int i = 0; i < 9; i++)
+				if (last && e != leftmost_edge) continue;
+				const int tileindex = tile_at(x, w, e);
+				const int own_cost = duplicates_rows(x, tileindex) ? 1 : 0;
+				const int state = w * num_colors + e;
+				if (x == 0)
 				{
-					int ox = i % 3 - 1;
-					int oy = i / 3 - 1;
-					if (ox == 0 && oy == 0) continue;
-					if (y < resolution - 1 && oy > 0) continue;
-					if (y == 0 && oy < 0) continue;
-					if (x == 0 && oy == 0 && ox < 0) continue;
-					if (x < resolution - 1 && oy == 0 && ox > 0) continue;
-					int neighbor = indexmap.get_pixel_wrapping(x + ox, y + oy).r;
-					if (neighbor == tileindex) 
-					{
-						duplicate = true;
-						break;
-					}
+					next_cost[state] = own_cost;
+					continue;
 				}
-				if (duplicate && retry++ < maxretry)
+				int ties = 0;
+				for (int left_w = 0; left_w < num_colors; left_w++)
 				{
-					x--;
-					continue;
+					const int left_state = left_w * num_colors + w;
+					if (cost[left_state] == unreachable) continue;
+					const int total = cost[left_state] + (own_cost || tile_at(x - 1, left_w, w) == tileindex ? 1 : 0);
+					if (total < next_cost[state]) ties = 0;
+					if (total <= next_cost[state] && random.next(++ties) == 0)
+					{
+						next_cost[state] = total;
+						back[(size_t)x * states + state] = (unsigned char)left_w;
+					}
 				}
-				if (retry > maxretry)
-					std::cout << "A tile is left duplicated with neighbor after " << maxretry << " retries\n";
-				retry = 0;
-				indexmap.set_pixel(x, y, color_t(tileindex, tileindex, tileindex));
-				prev_row[x] = n;
-				prev_edge = e;
 			}
 		}
+		cost.swap(next_cost);
+	}
+
+	int best = -1;
+	int ties = 0;
+	for (int state = 0; state < states; state++)
+	{
+		if (cost[state] == unreachable) continue;
+		if (best < 0 || cost[state] < cost[best]) ties = 0;
+		if ((best < 0 || cost[state] <= cost[best]) && random.next(++ties) == 0)
+			best = state;
+	}
+	if (cost[best] > 0)
+	{
+		std::lock_guard<std::mutex> lock(console_mutex);
+		std::cout << cost[best] << " tiles are left duplicated with neighbors at a seam of the stripes\n";
+	}
+	for (int x = resolution - 1; x >= 0; x--)
+	{
+		const int w = best / num_colors;
+		const int e = best % num_colors;
+		const int tileindex = tile_at(x, w, e);
+		row[x] = color_t(tileindex, tileindex, tileindex);
+		if (x > 0) best = back[(size_t)x * states + best] * num_colors + w;
+	}
+}
+
+// the map is cut into stripes of rows, the edges between the stripes are picked up front from their own streams,
+// so every stripe is generated on its own, all but its first row, and its last row is a seam row meeting the edges above.
+// the first row of a stripe is generated last, once the row below it is known, as a seam row checked against both rows.
+// the stripes are generated a window at a time from the top down, and handed out as soon as their first rows are done.
+void wangtiles_t::generate_indexmap_rows(int resolution, const indexmap_rows_t &write_rows)
+{
+	if (!valid) return;
+	if (is_corner_tiles)
+	{
+		image_t indexmap = generate_indexmap(resolution);
+		write_rows(0, resolution, indexmap.pixels);
+		return;
+	}
+
+	// about four million tiles a stripe, as the seams between the stripes are left with more duplicated tiles,
+	// and at least two rows, so the first row of a stripe isn't its last
+	const int stripe_rows = std::max(2, (1 << 22) / resolution);
+	const int stripe_count = std::max(1, resolution / stripe_rows);
+	auto stripe_begin = [&](int stripe) { return (int)((long long)stripe * resolution / stripe_count); };
+
+	// the seed of every stream, from rand, so srand still picks the map
+	const unsigned long long seed = ((unsigned long long)rand() << 32) ^ ((unsigned long long)rand() << 16) ^ (unsigned long long)rand();
+
+	// the stripes of the window, and the lowest stripe of the window before, waiting for the one below it
+	jobsystem_t &jobsystem = jobsystem_t::shared();
+	const int window = std::max(1, jobsystem_t::worker_count());
+	struct stripe_t
+	{
+		std::vector<color_t> rows;
+		std::vector<unsigned char> first_row_north;
+	};
+	std::vector<stripe_t> stripes(window + 1);
+	auto get_stripe = [&](int stripe) -> stripe_t & { return stripes[stripe % stripes.size()]; };
+	// the last row of the map, below the first row as the map wraps
+	std::vector<color_t> top_row(resolution);
+
+	// the south edges of the first row of a stripe, which are the north edges of the last row of the stripe below
+	auto get_boundary_edges = [&](int stripe, std::vector<unsigned char> &edges)
+	{
+		indexmap_random_t random(seed, 3 * (unsigned long long)(stripe % stripe_count));
+		edges.resize(resolution);
+		for (int x = 0; x < resolution; x++)
+			edges[x] = (unsigned char)random.next(num_colors);
+	};
+
+	auto generate_stripe = [&](int index)
+	{
+		const int y_begin = stripe_begin(index);
+		const int y_end = stripe_begin(index + 1);
+		stripe_t &stripe = get_stripe(index);
+		stripe.rows.resize((size_t)(y_end - y_begin) * resolution);
+		if (y_end - y_begin == 1)
+		{
+			get_boundary_edges(index + 1, stripe.first_row_north);
+			return;
+		}
+		indexmap_random_t random(seed, 3 * (unsigned long long)index + 1);
+		stripe.first_row_north.resize(resolution);
+		for (int x = 0; x < resolution; x++)
+			stripe.first_row_north[x] = (unsigned char)random.next(num_colors);
+		std::vector<unsigned char> south = stripe.first_row_north;
+		std::vector<unsigned char> north(resolution);
+		for (int y = y_begin + 1; y < y_end; y++)
+		{
+			const bool last_row = y == y_end - 1;
+			if (last_row) get_boundary_edges(index + 1, north);
+			color_t *row = stripe.rows.data() + (size_t)(y - y_begin) * resolution;
+			const color_t *below = y > y_begin + 1 ? row - resolution : NULL;
+			if (last_row)
+				fill_indexmap_seam_row(resolution, south.data(), north.data(), below, NULL, row, random);
+			else
+				fill_indexmap_row(resolution, south.data(), north.data(), below, row, random);
+			south.swap(north);
+		}
+	};
+
+	auto finish_stripe = [&](int index)
+	{
+		const int rows = stripe_begin(index + 1) - stripe_begin(index);
+		stripe_t &stripe = get_stripe(index);
+		std::vector<unsigned char> south;
+		get_boundary_edges(index, south);
+		const color_t *below = top_row.data();
+		if (index > 0)
+		{
+			const stripe_t &stripe_below = get_stripe(index - 1);
+			below = stripe_below.rows.data() + stripe_below.rows.size() - resolution;
+		}
+		// a map of a single row is below and above itself
+		if (rows == 1 && stripe_count == 1) below = NULL;
+		const color_t *above = rows > 1 ? stripe.rows.data() + resolution : NULL;
+		indexmap_random_t random(seed, 3 * (unsigned long long)index + 2);
+		fill_indexmap_seam_row(resolution, south.data(), stripe.first_row_north.data(), below, above, stripe.rows.data(), random);
+	};
+
+	int waiting = -1;
+	for (int top = stripe_count - 1; top >= 0; top -= window)
+	{
+		const int bottom = std::max(0, top - window + 1);
+		jobsystem.parallel_for(bottom, top + 1, 1, [&](int begin, int end)
+		{
+			for (int index = begin; index < end; index++)
+				generate_stripe(index);
+		});
+		if (top == stripe_count - 1)
+		{
+			const stripe_t &stripe = get_stripe(top);
+			std::copy(stripe.rows.end() - resolution, stripe.rows.end(), top_row.begin());
+		}
+
+		// the lowest stripe of the window waits for the next window, unless it's the bottom of the map
+		const int finish_begin = bottom > 0 ? bottom + 1 : 0;
+		const int finish_end = waiting >= 0 ? waiting + 1 : top + 1;
+		jobsystem.parallel_for(finish_begin, finish_end, 1, [&](int begin, int end)
+		{
+			for (int index = begin; index < end; index++)
+				finish_stripe(index);
+		});
+		for (int index = finish_end - 1; index >= finish_begin; index--)
+			write_rows(stripe_begin(index), stripe_begin(index + 1), get_stripe(index).rows.data());
+		waiting = bottom > 0 ? bottom : -1;
 	}
-	return indexmap;
 }
 
 template <typename _t>
@@ -376,10 +824,10 @@ image_t wangtiles_t::generate_palette(const int resolution)
 {
 	const int num_tiles = num_colors * num_colors;
 	const int tile_size = resolution / num_tiles;
-	if (tile_size * num_tiles != resolution)
+	if (!valid || tile_size * num_tiles != resolution)
 	{
 		std::cerr << "resolution must be a multiple of num_colors * num_colors\n";
-		exit(-1);
+		return image_t();
 	}
 
 	if (is_corner_tiles)
@@ -391,36 +839,42 @@ image_t wangtiles_t::generate_palette(const int resolution)
 		const vector3f_t edgecolor_h[] = { get_vector3f(color_t(30, 129, 43)), get_vector3f(color_t(168, 44, 34)) };
 		const vector3f_t edgecolor_v[] = { get_vector3f(color_t(24, 98, 169)), get_vector3f(color_t(236, 178, 0)) };
 
-		image_t palette;
-		palette.init(resolution);
-		for (int n = 0; n < num_colors; n++) for (int e = 0; e < num_colors; e++) for (int s = 0; s < num_colors; s++) for (int w = 0; w < num_colors; w++)
+		image_t palette(resolution);
+		std::vector<int> tile_colors;
+		get_tile_colors(tile_colors);
+		// every row of the palette crosses a row of tiles
+		jobsystem_t::shared().parallel_for(0, resolution, pixel_rows_grain(resolution), [&](int y_begin, int y_end)
 		{
-			int tileindex = get_packing_tileindex(n, e, s, w);
-			int row = tileindex / num_tiles;
-			int col = tileindex - row * num_tiles;
-			patch_t dest_patch;
-			dest_patch.x = col * tile_size;
-			dest_patch.y = row * tile_size;
-			dest_patch.size = tile_size;
-
-			for (int y = 0; y < tile_size; y++)
+			for (int py = y_begin; py < y_end; py++)
 			{
-				for (int x = 0; x < tile_size; x++)
+				const int row = py / tile_size;
+				const int y = py - row * tile_size;
+				for (int col = 0; col < num_tiles; col++)
 				{
-					float factor_h = (x + 0.5f) / tile_size;
-					float factor_v = (y + 0.5f) / tile_size;
-					vector3f_t color_h = smoothlerp(edgecolor_h[w], edgecolor_h[e], factor_h);
-					vector3f_t color_v = smoothlerp(edgecolor_v[s], edgecolor_v[n], factor_v);
-					factor_h = std::min(factor_h, 1.0f - factor_h);
-					factor_v = std::min(factor_v, 1.0f - factor_v);
-					float normalize_base = factor_h + factor_v;
-					factor_h /= normalize_base;
-					factor_v /= normalize_base;
-					vector3f_t color = factor_h < factor_v ? smoothlerp(color_h, color_v, factor_h) : smoothlerp(color_v, color_h, factor_v);
-					palette.set_pixel_in_patch(dest_patch, x, y, get_color(color));
+					const int *colors = &tile_colors[(row * num_tiles + col) * 4];
+					const int n = colors[0], e = colors[1], s = colors[2], w = colors[3];
+					patch_t dest_patch;
+					dest_patch.x = col * tile_size;
+					dest_patch.y = row * tile_size;
+					dest_patch.size = tile_size;
+
+					for (int x = 0; x < tile_size; x++)
+					{
+						float factor_h = (x + 0.5f) / tile_size;
+						float factor_v = (y + 0.5f) / tile_size;
+						vector3f_t color_h = smoothlerp(edgecolor_h[w], edgecolor_h[e], factor_h);
+						vector3f_t color_v = smoothlerp(edgecolor_v[s], edgecolor_v[n], factor_v);
+						factor_h = std::min(factor_h, 1.0f - factor_h);
+						factor_v = std::min(factor_v, 1.0f - factor_v);
+						float normalize_base = factor_h + factor_v;
+						factor_h /= normalize_base;
+						factor_v /= normalize_base;
+						vector3f_t color = factor_h < factor_v ? smoothlerp(color_h, color_v, factor_h) : smoothlerp(color_v, color_h, factor_v);
+						palette.set_pixel_in_patch(dest_patch, x, y, get_color(color));
+					}
 				}
 			}
-		}
+		});
 		return palette;
 	}
 }
@@ -483,12 +937,25 @@ int wangtiles_t::random_color()
 	return rand_range(num_colors);
 }
 
-void wangtiles_t::fill_graphcut_constraints(const int tile_size, image_t &graphcut_constraints)
+void wangtiles_t::fill_graphcut_constraints(const int tile_size, image_view_t graphcut_constraints)
 {
 	const int half_tile_size = tile_size >> 1;
+	const int padding = tile_size / 7;
+	jobsystem_t &jobsystem = jobsystem_t::shared();
 
-	for (int i = 0; i < tile_size * tile_size; i++)
-		graphcut_constraints.pixels[i] = CONSTRAINT_COLOR_FREE;
+	jobsystem.parallel_for(0, tile_size, pixel_rows_grain(tile_size), [&](int y_begin, int y_end)
+	{
+		std::fill_n(&graphcut_constraints.pixels[y_begin * tile_size], (y_end - y_begin) * tile_size, CONSTRAINT_COLOR_FREE);
+	});
+	// additional constraints, they overwrite the must-have constraints
+	auto fill_additional_constraints = [&]()
+	{
+		jobsystem.parallel_for(padding, tile_size - padding, pixel_rows_grain(tile_size), [&](int y_begin, int y_end)
+		{
+			for (int y = y_begin; y < y_end; y++)
+				std::fill_n(&graphcut_constraints.pixels[y * tile_size + padding], tile_size - padding * 2, CONSTRAINT_COLOR_SINK);
+		});
+	};
 
 	if (is_corner_tiles)
 	{
@@ -510,11 +977,7 @@ void wangtiles_t::fill_graphcut_constraints(const int tile_size, image_t &graphc
 			graphcut_constraints.set_pixel(half_tile_size, p, CONSTRAINT_COLOR_SINK);
 		}
 
-		// additional constraints
-		int padding = tile_size / 7;
-		for (int y = padding; y < tile_size - padding; y++)
-			for (int x = padding; x < tile_size - padding; x++)
-				graphcut_constraints.set_pixel(x, y, CONSTRAINT_COLOR_SINK);
+		fill_additional_constraints();
 	}
 	else
 	{
@@ -532,52 +995,81 @@ void wangtiles_t::fill_graphcut_constraints(const int tile_size, image_t &graphc
 			graphcut_constraints.set_pixel(p, tile_size - 1 - p, CONSTRAINT_COLOR_SINK);
 		}
 
-		// additional constraints
-		int padding = tile_size / 7;
-		for (int y = padding; y < tile_size - padding; y++)
-			for (int x = padding; x < tile_size - padding; x++)
-				graphcut_constraints.set_pixel(x, y, CONSTRAINT_COLOR_SINK);
+		fill_additional_constraints();
 	}
 }
 
-void wangtiles_t::graphcut_textures(image_t image_a, image_t image_b, image_t constraints, mask_t &out_mask)
+// cut the tile of the given patch into the mask.
+// when refining, the cut already in the mask is solved again in a band around its seam,
+// where pixels out of the band are pinned to the side of the cut they are on.
+// false when the graph can't be built for the patch.
+template <typename _view_t>
+bool wangtiles_t::graphcut_tile(const _view_t &image_a, const _view_t &image_b, const image_view_t &constraints, mask_view_t mask, const patch_t &patch,
+	bool refine, int workers, algorithm_statistics_t &statistics, solver_check_t &check)
 {
-	const int resolution = image_a.resolution;
+	const int tile_size = patch.size;
+	const int band_radius = 3;
 	const int num_tiles = num_colors * num_colors;
-	const int tile_size = resolution / num_tiles;
 
-	out_mask.clear();
-	out_mask.init(resolution);
+	console_mutex.lock();
+	std::cout << "calculating graphcut for tile " << (patch.y / tile_size) * num_tiles + patch.x / tile_size << " of " << num_tiles * num_tiles << "\n";
+	console_mutex.unlock();
 
-	jobsystem_t jobsystem;
-	std::mutex mutex;
-	std::vector<algorithm_statistics_t> statistics(num_tiles * num_tiles);
-	for (int row = 0; row < num_tiles; row++)
+	image_view_t tile_constraints = constraints;
+	image_t refined_constraints;
+	if (refine)
 	{
-		for (int col = 0; col < num_tiles; col++)
+		mask_t band = seam_band(mask, patch, band_radius);
+		refined_constraints.init(tile_size);
+		tile_constraints = refined_constraints;
+		for (int y = 0; y < tile_size; y++)
 		{
-			int tileindex = row * num_tiles + col;
-			if (debug_tileindex != -1 && tileindex != debug_tileindex) continue;
-			jobsystem.addjob([=, &mutex, &statistics]()
+			for (int x = 0; x < tile_size; x++)
 			{
-				mutex.lock();
-				std::cout << "calculating graphcut for tile " << tileindex << " of " << num_tiles * num_tiles << "\n";
-				mutex.unlock();
-				patch_t patch;
-				patch.size = tile_size;
-				patch.x = col * tile_size;
-				patch.y = row * tile_size;
-				graphcut_t graphcut(image_a, patch, image_b, patch, constraints);
-				graphcut.compute_cut_mask(out_mask, patch, statistics[tileindex]);
-			});
+				color_t c = constraints.get_pixel(x, y);
+				if (c == CONSTRAINT_COLOR_FREE && band.get_pixel(x, y) == 0)
+					c = mask.get_pixel_in_patch(patch, x, y) ? CONSTRAINT_COLOR_SOURCE : CONSTRAINT_COLOR_SINK;
+				tile_constraints.set_pixel(x, y, c);
+			}
 		}
 	}
-	jobsystem.startjobs();
-	jobsystem.wait();
-
-	for (int i = 0; i < statistics.size(); i++)
+	// the workers beyond this thread are claimed from the idle ones once the graph is built, all of them when no other job
+	// is waiting for a thread. the claimed workers run nothing else until they are returned, and only push-relabel splits a patch,
+	// so they are returned right away when auto picks another solver for too few of them.
+	jobsystem_t &jobsystem = jobsystem_t::shared();
+	bool succeeded = false;
+	dispatch_seam_cost(seam_cost, [&](auto cost)
 	{
-		auto stat = statistics[i];
-		std::cout << "found max-flow for tile " << i << " after " << stat.iteration_count << " iterations: " << stat.max_flow << std::endl;
+		graphcut_t graphcut(image_a.get_patch(patch), image_b.get_patch(patch), tile_constraints, cost);
+		graphcut.set_solver(solver);
+		std::vector<int> helpers;
+		if (solver == maxflow_solver_auto || solver == maxflow_solver_push_relabel)
+			helpers = jobsystem.claim_idle_workers((jobsystem.is_drained() ? jobsystem.get_worker_count() : workers) - 1);
+		if (solver == maxflow_solver_auto && (int)helpers.size() + 1 < graphcut_t::auto_push_relabel_workers)
+		{
+			jobsystem.return_workers(helpers);
+			helpers.clear();
+		}
+		graphcut.set_helper_workers(helpers);
+		succeeded = graphcut.compute_cut_mask(mask.get_patch(patch), statistics);
+		jobsystem.return_workers(helpers);
+	});
+	if (!succeeded) return false;
+	if (verify_solver)
+	{
+		mask_t reference_mask(tile_size);
+		algorithm_statistics_t reference_statistics;
+		dispatch_seam_cost(seam_cost, [&](auto cost)
+		{
+			graphcut_t graphcut(image_a.get_patch(patch), image_b.get_patch(patch), tile_constraints, cost);
+			graphcut.set_solver(reference_solver);
+			succeeded = graphcut.compute_cut_mask(mask_patch_view_t(reference_mask.pixels, tile_size, tile_size), reference_statistics);
+		});
+		if (!succeeded) return false;
+		check.reference_max_flow = reference_statistics.max_flow;
+		for (int y = 0; y < tile_size; y++)
+			for (int x = 0; x < tile_size; x++)
+				if (reference_mask.get_pixel(x, y) != mask.get_pixel_in_patch(patch, x, y)) check.mismatched_pixels++;
 	}
+	return true;
 }
@@ -1,38 +1,106 @@
 #pragma once
 
 #include <vector>
+#include <functional>
+#include <atomic>
 #include "common_types.h"
+#include "seamcost.h"
+#include "graphcut.h"
+
+struct tile_statistics_t
+{
+	int tileindex;
+	int tile_size; // the scale the tile is cut at
+	algorithm_statistics_t graphcut;
+};
+
+// a tile solved again by the reference solver: its max flow, and the pixels where its cut mask differs
+struct solver_check_t
+{
+	float reference_max_flow;
+	int mismatched_pixels;
+
+	solver_check_t() :reference_max_flow(0), mismatched_pixels(0) {}
+};
+
+struct indexmap_random_t;
 
 class wangtiles_t
 {
 public:
-	wangtiles_t(image_t source, int num_colors, bool corner_tiles);
+	static const int default_visual_scale = 128;
+
+	// the source pixels are not copied, they must outlive the object
+	wangtiles_t(image_view_t source, int num_colors, bool corner_tiles);
 	~wangtiles_t();
 
 	void set_debug_tileindex(int tileindex) { debug_tileindex = tileindex; }
+	// re-solve the cut around the seam at every finer mip level, instead of only upsampling the mask
+	void set_multilevel_seams(bool enabled) { multilevel_seams = enabled; }
+	void set_seam_cost(seam_cost_metric_t metric) { seam_cost = metric; }
+	// the size the tiles are cut at, a power of two. the finer levels are upsampled (and refined) from the cut.
+	// tiles smaller than it are cut at their own size.
+	void set_visual_scale(int scale) { visual_scale = scale; }
+	void set_solver(maxflow_solver_t solver) { this->solver = solver; }
+	// solve every tile a second time with the reference solver, and report tiles whose max flows differ.
+	// cuts of the same cost may still differ in some pixels, those are only reported as information.
+	void set_solver_verification(maxflow_solver_t reference) { verify_solver = true; reference_solver = reference; }
+	// called from the workers as the tiles of generate_wang_tiles are finished, one call at a time
+	void set_progress_callback(std::function<void(int finished, int total)> callback) { progress = std::move(callback); }
+	// once the flag is set, the jobs of generate_wang_tiles left are skipped, and the results are incomplete
+	void set_cancel_flag(const std::atomic<bool> *flag) { cancel_flag = flag; }
+	bool is_cancelled() const { return cancel_flag && *cancel_flag; }
+	// an arena kept by the caller, so the memory of the mip chains is reused by the next objects
+	void set_mip_arena(image_arena_t &arena) { mip_arena = &arena; }
 
-	void pick_colored_patches();
+	// false when the colors or the resolution of the source don't make tiles of at least 2 pixels
+	bool pick_colored_patches();
 	void generate_packed_corners();
-	void generate_wang_tiles();
+	// composites the packed corners as well, so generate_packed_corners does not need to be called before.
+	// every tile runs as its own chain of jobs, and tiles do not wait for each other between the stages.
+	// false when the tiles can't be cut, the memory can't be allocated, or it's cancelled, the results are incomplete then.
+	bool generate_wang_tiles();
 
-	image_t get_packed_corners() { return packed_corners; }
-	mask_t get_packed_corners_mask() { return packed_corners_mask; }
-	image_t get_graphcut_constraints() { return graphcut_constraints; }
+	// the results can be moved out, the object leaves them empty then
+	image_t &get_packed_corners() { return packed_corners; }
+	mask_t &get_packed_corners_mask() { return packed_corners_mask; }
+	image_t &get_graphcut_constraints() { return graphcut_constraints; }
+	// one entry per solved tile, in the order of the scales they are solved at
+	const std::vector<tile_statistics_t> &get_graphcut_statistics() const { return graphcut_statistics; }
+	// number of tiles where the solver and the reference solver disagree on the max flow
+	int get_solver_mismatch_count() const { return solver_mismatch_count; }
 
 	image_t generate_indexmap(int resolution);
+	// the index map in stripes of rows, generated by all the workers and handed to write_rows as they're finished,
+	// so only a few stripes are held at once whatever the resolution. write_rows is called on the calling thread,
+	// with the stripes from the top of the map down, the rows of a stripe bottom row first as in an image_t.
+	// the map only depends on the seed of rand, not on the number of workers. corner tiles are given as one stripe.
+	typedef std::function<void(int y_begin, int y_end, const color_t *rows)> indexmap_rows_t;
+	void generate_indexmap_rows(int resolution, const indexmap_rows_t &write_rows);
+	// empty when the resolution isn't a multiple of the tiles in a row
 	image_t generate_palette(int resolution);
 
 private:
 	patch_t random_non_overlapping_patch(int patch_size);
 	int get_packing_tileindex(int n, int e, int s, int w);
 	int random_color();
-	void fill_graphcut_constraints(const int tile_size, image_t &constraints);
-	void graphcut_textures(image_t image_a, image_t image_b, image_t constraints, mask_t &out_mask);
+	void fill_indexmap_row(int resolution, const unsigned char *south, unsigned char *north,
+		const color_t *below, color_t *row, indexmap_random_t &random);
+	void fill_indexmap_seam_row(int resolution, const unsigned char *south, const unsigned char *north,
+		const color_t *below, const color_t *above, color_t *row, indexmap_random_t &random);
+	void fill_graphcut_constraints(const int tile_size, image_view_t constraints);
+	void get_tile_colors(std::vector<int> &tile_colors);
+	void composite_tile(int c0, int c1, int c2, int c3);
+	// the images are interleaved or planar
+	template <typename _view_t>
+	bool graphcut_tile(const _view_t &image_a, const _view_t &image_b, const image_view_t &constraints, mask_view_t mask, const patch_t &patch,
+		bool refine, int workers, algorithm_statistics_t &statistics, solver_check_t &check);
 
 private:
 	bool is_corner_tiles;
+	bool valid; // the colors are supported
 
-	image_t source_image;
+	image_view_t source_image;
 	int num_colors;
 	int inv_packing_table[256];
 
@@ -41,7 +109,20 @@ private:
 	image_t packed_corners;
 	mask_t packed_corners_mask;
 	image_t graphcut_constraints;
+	std::vector<tile_statistics_t> graphcut_statistics;
+	// the mip chains of generate_wang_tiles, kept between the calls, in own_arena unless set_mip_arena is called
+	image_arena_t own_arena;
+	image_arena_t *mip_arena;
 
 	int debug_tileindex;
+	int visual_scale;
+	bool multilevel_seams;
+	seam_cost_metric_t seam_cost;
+	maxflow_solver_t solver;
+	bool verify_solver;
+	maxflow_solver_t reference_solver;
+	int solver_mismatch_count;
+	std::function<void(int, int)> progress;
+	const std::atomic<bool> *cancel_flag;
 };
 
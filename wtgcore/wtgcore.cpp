@@ -3,153 +3,560 @@
 
 #include "pch.h"
 #include <iostream>
+#include <fstream>
+#include <string>
 #include <ctime>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <atomic>
 #include "common_types.h"
 #include "wangtiles.h"
+#include "jobsystem.h"
+#include "feather.h"
+#include "fileio.h"
+#include "imagefile.h"
+#include "server.h"
  
 #define NUM_COLORS		2
 #define CORNER_TILES	false
 
-color_t *readfile(const char *path, int resolution)
+// rows copied by one job while reading or writing a file, about 64k pixels
+int file_rows_grain(int resolution)
 {
-	FILE *f;
-	if (fopen_s(&f, path, "rb")) return NULL;
-	size_t pixel_count = resolution * resolution;
-	color_t *data = new color_t[pixel_count];
-	// python image is in reversed row order (top row first)
-	color_t *pbuffer = data + pixel_count - resolution;
-	for (int i = 0; i < resolution; i++)
+	return std::max(1, 65536 / resolution);
+}
+
+// png and qoi files are decoded, and their rows flipped as they come
+bool readimagefile(const char *path, image_file_format_t format, image_t &image, int resolution)
+{
+	decode_rows_t rows;
+	rows.begin = [&](int width, int height)
 	{
-		size_t r = fread((void *)pbuffer, sizeof(color_t), resolution, f);
-		if (r != resolution)
+		if (width != resolution || height != resolution)
 		{
-			fclose(f);
-			delete data;
-			return NULL;
+			std::cerr << "the input image is " << width << "x" << height << ", the resolution is " << resolution << "\n";
+			return false;
 		}
-		pbuffer -= resolution;
+		image.init(resolution);
+		return true;
+	};
+	rows.write_row = [&](int y, const color_t *row)
+	{
+		memcpy(image.pixels + (size_t)(resolution - 1 - y) * resolution, row, sizeof(color_t) * resolution);
+	};
+	const bool succeeded = format == image_file_format_png ? read_png(path, rows) : read_qoi(path, rows);
+	if (!succeeded) image.clear();
+	return succeeded;
+}
+
+bool writeimagefile(const char *path, image_file_format_t format, const encode_rows_t &rows)
+{
+	return format == image_file_format_png ? write_png(path, rows) : write_qoi(path, rows);
+}
+
+// the source image, either mapped straight from a raw file, or decoded from an image file
+struct input_image_t
+{
+	mapped_file_t mapping;
+	image_t decoded;
+	image_view_t view;
+};
+
+bool readfile(const char *path, input_image_t &input, int resolution)
+{
+	const image_file_format_t format = image_file_format(path);
+	if (format != image_file_format_raw)
+	{
+		if (!readimagefile(path, format, input.decoded, resolution)) return false;
+		input.view = input.decoded.view();
+		return true;
 	}
-	fclose(f);
-	return data;
+	if (!input.mapping.open_read(path)) return false;
+	const size_t row_bytes = sizeof(color_t) * resolution;
+	if (input.mapping.size() < row_bytes * resolution)
+	{
+		input.mapping.close();
+		return false;
+	}
+	// python image is in reversed row order (top row first), so the view starts at the last row of the file and steps back,
+	// and the pixels are read from the mapping without a copy. the mapping is read-only, nothing writes to the source image.
+	color_t *last_row = (color_t *)(input.mapping.data() + row_bytes * (resolution - 1));
+	input.view = image_view_t(last_row, resolution, -resolution);
+	return true;
 }
 
-bool writefile(const char *path, const color_t *data, int resolution)
+// python image is in reversed row order (top row first), so the rows are flipped as they're copied out
+void copy_rows_flipped(const color_t *data, int resolution, unsigned char *output)
 {
-	FILE *f;
-	if (fopen_s(&f, path, "wb")) return false;
-	size_t pixel_count = resolution * resolution;
-	// python image is in reversed row order (top row first)
-	const color_t *pbuffer = data + pixel_count - resolution;
-	for (int i = 0; i < resolution; i++)
+	const size_t row_bytes = sizeof(color_t) * resolution;
+	jobsystem_t::shared().parallel_for(0, resolution, file_rows_grain(resolution), [&](int y_begin, int y_end)
 	{
-		size_t r = fwrite((const void *)pbuffer, sizeof(color_t), resolution, f);
-		if (r != resolution)
+		for (int y = y_begin; y < y_end; y++)
+			memcpy(output + row_bytes * y, data + (size_t)(resolution - 1 - y) * resolution, row_bytes);
+	});
+}
+
+void interleave_rows_flipped(const color_t *data, const unsigned char *alpha, int resolution, unsigned char *output)
+{
+	const size_t row_bytes = 4 * (size_t)resolution;
+	jobsystem_t::shared().parallel_for(0, resolution, file_rows_grain(resolution), [&](int y_begin, int y_end)
+	{
+		for (int y = y_begin; y < y_end; y++)
 		{
-			fclose(f);
-			return false;
+			const size_t offset = (size_t)(resolution - 1 - y) * resolution;
+			interleave_rgba_row(data + offset, alpha + offset, output + row_bytes * y, resolution);
 		}
-		pbuffer -= resolution;
+	});
+}
+
+bool writefile(const char *path, const color_t *data, int resolution)
+{
+	const image_file_format_t format = image_file_format(path);
+	if (format != image_file_format_raw)
+	{
+		encode_rows_t rows = { resolution, resolution, 3, [&](int y, unsigned char *row)
+		{
+			memcpy(row, data + (size_t)(resolution - 1 - y) * resolution, sizeof(color_t) * resolution);
+		} };
+		return writeimagefile(path, format, rows);
 	}
-	fclose(f);
+	mapped_file_t file;
+	if (!file.create(path, sizeof(color_t) * resolution * resolution)) return false;
+	copy_rows_flipped(data, resolution, file.writable_data());
 	return true;
 }
 
 bool writefile(const char *path, const color_t *data, const unsigned char *alpha, int resolution)
 {
-	FILE *f;
-	if (fopen_s(&f, path, "wb")) return false;
-	size_t pixel_count = resolution * resolution;
-	// python image is in reversed row order (top row first)
-	const color_t *pbuffer = data + pixel_count - resolution;
-	const unsigned char *palpha = alpha + pixel_count - resolution;
-	for (int i = 0; i < resolution; i++)
+	const image_file_format_t format = image_file_format(path);
+	if (format != image_file_format_raw)
 	{
-		size_t r = 0;
-		for (int j = 0; j < resolution; j++)
-		{
-			r += fwrite((const void *)(pbuffer + j), sizeof(color_t), 1, f);
-			r += fwrite((const void *)(palpha + j), sizeof(unsigned char), 1, f);
-		}
-		if (r != resolution * 2)
+		encode_rows_t rows = { resolution, resolution, 4, [&](int y, unsigned char *row)
 		{
-			fclose(f);
-			return false;
-		}
-		pbuffer -= resolution;
-		palpha -= resolution;
+			const size_t offset = (size_t)(resolution - 1 - y) * resolution;
+			interleave_rgba_row(data + offset, alpha + offset, row, resolution);
+		} };
+		return writeimagefile(path, format, rows);
 	}
-	fclose(f);
+	mapped_file_t file;
+	if (!file.create(path, 4 * (size_t)resolution * resolution)) return false;
+	interleave_rows_flipped(data, alpha, resolution, file.writable_data());
 	return true;
 }
 
+// the statistics of every tile, followed by their aggregation
+bool writestatistics(const char *path, const std::vector<tile_statistics_t> &statistics)
+{
+	FILE *f;
+	if (fopen_s(&f, path, "w")) return false;
+	algorithm_statistics_t total;
+	fprintf(f, "{\n\t\"tiles\": [");
+	for (size_t i = 0; i < statistics.size(); i++)
+	{
+		const algorithm_statistics_t &stat = statistics[i].graphcut;
+		fprintf(f, "%s\n\t\t{ \"tile\": %d, \"tile_size\": %d, \"iterations\": %u, \"max_flow\": %g, "
+			"\"construction_ms\": %.3f, \"solve_ms\": %.3f, \"visited_nodes\": %llu, \"augmenting_paths\": %u, "
+			"\"average_path_length\": %.2f, \"max_path_length\": %u, \"edge_count\": %u, \"graph_memory_bytes\": %zu }",
+			i > 0 ? "," : "", statistics[i].tileindex, statistics[i].tile_size, stat.iteration_count, stat.max_flow,
+			stat.construction_seconds * 1000.0, stat.solve_seconds * 1000.0, stat.visited_nodes, stat.augmenting_paths,
+			stat.average_augmenting_path_length(), stat.max_augmenting_path_length, stat.edge_count, stat.graph_memory);
+
+		total.iteration_count += stat.iteration_count;
+		total.max_flow += stat.max_flow;
+		total.construction_seconds += stat.construction_seconds;
+		total.solve_seconds += stat.solve_seconds;
+		total.visited_nodes += stat.visited_nodes;
+		total.augmenting_paths += stat.augmenting_paths;
+		total.augmenting_path_length += stat.augmenting_path_length;
+		total.max_augmenting_path_length = std::max(total.max_augmenting_path_length, stat.max_augmenting_path_length);
+		total.edge_count += stat.edge_count;
+		total.graph_memory = std::max(total.graph_memory, stat.graph_memory);
+	}
+	fprintf(f, "\n\t],\n\t\"total\": { \"tiles\": %zu, \"iterations\": %u, \"max_flow\": %g, "
+		"\"construction_ms\": %.3f, \"solve_ms\": %.3f, \"visited_nodes\": %llu, \"augmenting_paths\": %u, "
+		"\"average_path_length\": %.2f, \"max_path_length\": %u, \"edge_count\": %u, \"peak_graph_memory_bytes\": %zu }\n}\n",
+		statistics.size(), total.iteration_count, total.max_flow,
+		total.construction_seconds * 1000.0, total.solve_seconds * 1000.0, total.visited_nodes, total.augmenting_paths,
+		total.average_augmenting_path_length(), total.max_augmenting_path_length, total.edge_count, total.graph_memory);
+	bool succeeded = ferror(f) == 0;
+	fclose(f);
+	return succeeded;
+}
+
 struct resultset_t
 {
 	image_t packed_corners;
+	// feathered when the sigma is above zero
 	mask_t packed_corners_mask;
+	image_t composite;
 	image_t graphcut_constraints;
+	std::vector<tile_statistics_t> graphcut_statistics;
+	int solver_mismatch_count;
+	// false when the tiles can't be generated, or it's cancelled, the images are empty then
+	bool succeeded;
+
+	resultset_t() :solver_mismatch_count(0), succeeded(false) {}
 };
 
-resultset_t processimage(image_t image, int debug_tileindex)
+struct tiles_options_t
+{
+	int debug_tileindex;
+	int visual_scale;
+	bool multilevel_seams;
+	seam_cost_metric_t seam_cost;
+	maxflow_solver_t solver;
+	bool verify_solver;
+	maxflow_solver_t reference_solver;
+	const char *statistics_path;
+	float feather_sigma;
+	const char *composite_path;
+	bool make_composite;
+	int num_colors;
+	bool corner_tiles;
+	// without a seed the patches are picked from the sequence seeded with the time
+	bool seeded;
+	unsigned int seed;
+
+	tiles_options_t()
+		:debug_tileindex(-1), visual_scale(wangtiles_t::default_visual_scale), multilevel_seams(false), seam_cost(seam_cost_metric_normalized_l2),
+		solver(maxflow_solver_auto), verify_solver(false), reference_solver(maxflow_solver_edmonds_karp), statistics_path(NULL),
+		feather_sigma(0), composite_path(NULL), make_composite(false), num_colors(NUM_COLORS), corner_tiles(CORNER_TILES), seeded(false), seed(0) { }
+};
+
+// the arguments of --tiles, and of every entry of a batch
+struct tiles_job_t
+{
+	int resolution;
+	const char *inputpath;
+	const char *outputpath;
+	const char *outputpath_constraints;
+	tiles_options_t options;
+};
+
+// the patches are picked with rand, whose sequence is shared by the entries of a batch
+std::mutex random_mutex;
+
+// the arena and the cancel flag are optional, a server keeps the arena between the requests
+resultset_t processimage(const image_view_t &image, const tiles_options_t &options, image_arena_t *arena = NULL, const std::atomic<bool> *cancelled = NULL)
 {
 	resultset_t result;
 
-	wangtiles_t wangtiles(image, NUM_COLORS, CORNER_TILES);
-	wangtiles.set_debug_tileindex(debug_tileindex);
-	wangtiles.pick_colored_patches();
-	wangtiles.generate_packed_corners();
-	wangtiles.generate_wang_tiles();
+	wangtiles_t wangtiles(image, options.num_colors, options.corner_tiles);
+	wangtiles.set_debug_tileindex(options.debug_tileindex);
+	wangtiles.set_multilevel_seams(options.multilevel_seams);
+	wangtiles.set_seam_cost(options.seam_cost);
+	wangtiles.set_visual_scale(options.visual_scale);
+	wangtiles.set_solver(options.solver);
+	if (options.verify_solver) wangtiles.set_solver_verification(options.reference_solver);
+	if (arena) wangtiles.set_mip_arena(*arena);
+	wangtiles.set_cancel_flag(cancelled);
+	{
+		std::lock_guard<std::mutex> lock(random_mutex);
+		if (options.seeded) srand(options.seed);
+		if (!wangtiles.pick_colored_patches()) return result;
+	}
+	if (!wangtiles.generate_wang_tiles()) return result;
+
+	result.packed_corners = std::move(wangtiles.get_packed_corners());
+	result.packed_corners_mask = std::move(wangtiles.get_packed_corners_mask());
+	result.graphcut_constraints = std::move(wangtiles.get_graphcut_constraints());
+	result.graphcut_statistics = wangtiles.get_graphcut_statistics();
+	result.solver_mismatch_count = wangtiles.get_solver_mismatch_count();
 
-	result.packed_corners = wangtiles.get_packed_corners();
-	result.packed_corners_mask = wangtiles.get_packed_corners_mask();
-	result.graphcut_constraints = wangtiles.get_graphcut_constraints();
+	// the mask of the packed corners is feathered in place of the hard cut, and the final tiles are the corners composited over the input
+	const int resolution = image.resolution;
+	mask_t feathered_mask;
+	if (options.make_composite) result.composite.init(resolution);
+	if (options.feather_sigma > 0) feathered_mask.init(resolution);
+	if (options.feather_sigma > 0 || options.make_composite)
+		feather_composite(image, result.packed_corners, result.packed_corners_mask, options.feather_sigma, result.composite.view(), feathered_mask.view());
+	if (options.feather_sigma > 0) result.packed_corners_mask = std::move(feathered_mask);
+	result.succeeded = true;
 	return result;
 }
 
 int print_usage_on_error()
 {
-	const char *usage_msg = "Usage:  wtgcore --tiles <resolution> <input-path> <output-path> <output-constraints-path> [<debug-tile-index>]\n"
+	const char *usage_msg = "Usage:  wtgcore --tiles <resolution> <input-path> <output-path> <output-constraints-path> [<debug-tile-index>] [--multilevel] [--seam-cost l2|ssd|luminance|perceptual]\n"
+							"                [--solver auto|bk|dinic|pushrelabel|ek] [--verify-solver auto|bk|dinic|pushrelabel|ek] [--stats <output-json-path>]\n"
+							"                [--workers <count>] [--feather <sigma>] [--composite <output-tiles-path>] [--colors 2|4] [--corner-tiles] [--seed <seed>]\n"
+							"                [--scale <pixels>]\n"
+							"     |  wtgcore --batch <manifest-path> [--workers <count>] [--concurrent-entries <count>]\n"
 							"     |  wtgcore --index <resolution> <output-path>\n"
-							"     |  wtgcore --palette <resolution> <output-path>\n";
+							"     |  wtgcore --palette <resolution> <output-path>\n"
+							"     |  wtgcore --serve <socket-path> [--workers <count>]\n"
+							"paths ending in .png or .qoi are images in those formats, any other path holds the raw pixels, top row first.\n"
+							"every line of a batch manifest holds the arguments of --tiles but --workers, paths with spaces are quoted, lines starting with # are skipped.\n"
+							"requests to a server hold the arguments of --tiles without the output paths and --workers, of --index or of --palette without the output path,\n"
+							"and the results are returned in shared memory, see server.h.\n";
 	std::cerr << usage_msg;
 	return -1;
 }
 
-int generate_tiles_entry(int argc, const char *argv[])
+bool parse_solver(const char *name, maxflow_solver_t &solver)
 {
-	if (argc < 6) return print_usage_on_error();
-	int resolution = std::atoi(argv[2]);
-	if (resolution <= 0 || (resolution & (resolution - 1)) != 0)
+	if (strcmp(name, "auto") == 0) solver = maxflow_solver_auto;
+	else if (strcmp(name, "bk") == 0) solver = maxflow_solver_boykov_kolmogorov;
+	else if (strcmp(name, "dinic") == 0) solver = maxflow_solver_dinic;
+	else if (strcmp(name, "pushrelabel") == 0) solver = maxflow_solver_push_relabel;
+	else if (strcmp(name, "ek") == 0) solver = maxflow_solver_edmonds_karp;
+	else return false;
+	return true;
+}
+
+enum tiles_arguments_t
+{
+	tiles_arguments_command_line,
+	tiles_arguments_batch_entry,
+	tiles_arguments_request, // the results go to shared memory, there are no output paths
+};
+
+// parses <resolution> <input-path> <output-path> <output-constraints-path> and the options, from argv[0].
+// the number of workers is shared by all the entries of a batch and all the requests, so it's only taken from the command line.
+bool parse_tiles_arguments(int argc, const char *argv[], tiles_arguments_t kind, tiles_job_t &job)
+{
+	const int positional_count = kind == tiles_arguments_request ? 2 : 4;
+	if (argc < positional_count) return false;
+	job.resolution = std::atoi(argv[0]);
+	if (job.resolution <= 0 || (job.resolution & (job.resolution - 1)) != 0)
 	{
 		std::cerr << "resolution is invalid, must be a POT\n";
-		return -1;
+		return false;
+	}
+	job.inputpath = argv[1];
+	job.outputpath = kind == tiles_arguments_request ? NULL : argv[2];
+	job.outputpath_constraints = kind == tiles_arguments_request ? NULL : argv[3];
+	tiles_options_t &options = job.options;
+	options.make_composite = kind == tiles_arguments_request;
+	for (int i = positional_count; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--multilevel") == 0)
+			options.multilevel_seams = true;
+		else if (strcmp(argv[i], "--seam-cost") == 0 && i + 1 < argc)
+		{
+			const char *metric = argv[++i];
+			if (strcmp(metric, "l2") == 0) options.seam_cost = seam_cost_metric_normalized_l2;
+			else if (strcmp(metric, "ssd") == 0) options.seam_cost = seam_cost_metric_ssd;
+			else if (strcmp(metric, "luminance") == 0) options.seam_cost = seam_cost_metric_luminance;
+			else if (strcmp(metric, "perceptual") == 0) options.seam_cost = seam_cost_metric_perceptual;
+			else return false;
+		}
+		else if (strcmp(argv[i], "--solver") == 0 && i + 1 < argc)
+		{
+			if (!parse_solver(argv[++i], options.solver)) return false;
+		}
+		else if (strcmp(argv[i], "--verify-solver") == 0 && i + 1 < argc)
+		{
+			if (!parse_solver(argv[++i], options.reference_solver)) return false;
+			options.verify_solver = true;
+		}
+		else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc)
+			options.statistics_path = argv[++i];
+		else if (strcmp(argv[i], "--feather") == 0 && i + 1 < argc)
+		{
+			options.feather_sigma = (float)std::atof(argv[++i]);
+			if (options.feather_sigma < 0) return false;
+		}
+		else if (strcmp(argv[i], "--composite") == 0 && i + 1 < argc && kind != tiles_arguments_request)
+		{
+			options.composite_path = argv[++i];
+			options.make_composite = true;
+		}
+		else if (strcmp(argv[i], "--colors") == 0 && i + 1 < argc)
+		{
+			// the tiles are cut at power of two sizes, so there are 2 or 4 colors, making 4 or 16 tiles in a row
+			options.num_colors = std::atoi(argv[++i]);
+			if (options.num_colors != 2 && options.num_colors != 4) return false;
+		}
+		else if (strcmp(argv[i], "--corner-tiles") == 0)
+			options.corner_tiles = true;
+		else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc)
+		{
+			// the size the tiles are cut at, a power of two as every mip level halves the tiles
+			options.visual_scale = std::atoi(argv[++i]);
+			if (options.visual_scale < 2 || (options.visual_scale & (options.visual_scale - 1)) != 0) return false;
+		}
+		else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+		{
+			options.seed = (unsigned int)std::strtoul(argv[++i], NULL, 10);
+			options.seeded = true;
+		}
+		else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc && kind == tiles_arguments_command_line)
+		{
+			int workers = std::atoi(argv[++i]);
+			if (workers <= 0) return false;
+			jobsystem_t::set_shared_worker_count(workers);
+		}
+		else if (argv[i][0] != '-')
+			options.debug_tileindex = std::atoi(argv[i]);
+		else
+			return false;
 	}
-	const char *inputpath = argv[3];
-	const char *outputpath = argv[4];
-	const char *outputpath_constraints = argv[5];
-	int debug_tileindex = -1;
-	if (argc > 6) debug_tileindex = std::atoi(argv[6]);
+	if (options.corner_tiles && options.num_colors != 2)
+	{
+		std::cerr << "corner tiles only have 2 colors\n";
+		return false;
+	}
+	// the graphcut needs tiles of at least 2 pixels
+	const int num_tiles = options.num_colors * options.num_colors;
+	if (job.resolution < num_tiles * 2)
+	{
+		std::cerr << "resolution must be at least " << num_tiles * 2 << " for " << options.num_colors << " colors\n";
+		return false;
+	}
+	return true;
+}
 
-	image_t input;
-	input.resolution = resolution;
-	if (!(input.pixels = readfile(inputpath, resolution)))
+int run_tiles(const tiles_job_t &job)
+{
+	const tiles_options_t &options = job.options;
+	const int resolution = job.resolution;
+	input_image_t input;
+	if (!readfile(job.inputpath, input, resolution))
 	{
 		std::cerr << "read input file failed\n";
 		return -1;
 	}
-	resultset_t result = processimage(input, debug_tileindex);
-	if (!writefile(outputpath, result.packed_corners.pixels, result.packed_corners_mask.pixels, resolution))
+	resultset_t result = processimage(input.view, options);
+	if (!result.succeeded)
+	{
+		std::cerr << "generate tiles failed\n";
+		return -1;
+	}
+	if (!writefile(job.outputpath, result.packed_corners.pixels, result.packed_corners_mask.pixels, resolution))
 	{
 		std::cerr << "write output file failed\n";
 		return -1;
 	}
-	if (!writefile(outputpath_constraints, result.graphcut_constraints.pixels, result.graphcut_constraints.resolution))
+	if (options.composite_path && !writefile(options.composite_path, result.composite.pixels, resolution))
+	{
+		std::cerr << "write composite file failed\n";
+		return -1;
+	}
+	if (!writefile(job.outputpath_constraints, result.graphcut_constraints.pixels, result.graphcut_constraints.resolution))
 	{
 		std::cerr << "write graphcut constraints file failed\n";
 		return -1;
 	}
+	if (options.statistics_path && !writestatistics(options.statistics_path, result.graphcut_statistics))
+	{
+		std::cerr << "write statistics file failed\n";
+		return -1;
+	}
+	if (result.solver_mismatch_count > 0)
+	{
+		std::cerr << "the solver disagrees with the reference solver on " << result.solver_mismatch_count << " tiles\n";
+		return -1;
+	}
 	return 0;
 }
 
+int generate_tiles_entry(int argc, const char *argv[])
+{
+	tiles_job_t job;
+	if (!parse_tiles_arguments(argc - 2, argv + 2, tiles_arguments_command_line, job)) return print_usage_on_error();
+	return run_tiles(job);
+}
+
+struct batch_entry_t
+{
+	int line;
+	std::vector<std::string> arguments;
+	tiles_job_t job;
+	int result;
+};
+
+bool readmanifest(const char *path, std::vector<batch_entry_t> &entries)
+{
+	std::ifstream file(path);
+	if (!file) return false;
+	std::string line;
+	for (int number = 1; std::getline(file, line); number++)
+	{
+		batch_entry_t entry;
+		entry.line = number;
+		entry.result = -1;
+		split_arguments(line, entry.arguments);
+		if (entry.arguments.empty() || entry.arguments[0][0] == '#') continue;
+		entries.push_back(std::move(entry));
+	}
+	// the jobs point into the arguments, so they're parsed once the entries don't move anymore
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		std::vector<const char *> argv;
+		for (size_t j = 0; j < entries[i].arguments.size(); j++)
+			argv.push_back(entries[i].arguments[j].c_str());
+		if (!parse_tiles_arguments((int)argv.size(), argv.data(), tiles_arguments_batch_entry, entries[i].job))
+		{
+			std::cerr << "the manifest entry at line " << entries[i].line << " is invalid\n";
+			return false;
+		}
+	}
+	return !file.bad();
+}
+
+// every entry is run like --tiles, several at once, and their jobs go to the same pool.
+// a waiting entry runs the queued jobs of the others, so the workers left idle by the last tiles of a large texture
+// are filled by the tiles of smaller ones. the number of entries at once bounds the images held in memory.
+int generate_batch_entry(int argc, const char *argv[])
+{
+	if (argc < 3) return print_usage_on_error();
+	const char *manifestpath = argv[2];
+	int concurrent_entries = 4;
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+		{
+			int workers = std::atoi(argv[++i]);
+			if (workers <= 0) return print_usage_on_error();
+			jobsystem_t::set_shared_worker_count(workers);
+		}
+		else if (strcmp(argv[i], "--concurrent-entries") == 0 && i + 1 < argc)
+		{
+			concurrent_entries = std::atoi(argv[++i]);
+			if (concurrent_entries <= 0) return print_usage_on_error();
+		}
+		else
+			return print_usage_on_error();
+	}
+
+	std::vector<batch_entry_t> entries;
+	if (!readmanifest(manifestpath, entries))
+	{
+		std::cerr << "read manifest file failed\n";
+		return -1;
+	}
+
+	const auto start_time = std::chrono::steady_clock::now();
+	std::atomic<int> next_entry(0);
+	auto run_entries = [&]()
+	{
+		for (int i = next_entry++; i < (int)entries.size(); i = next_entry++)
+			entries[i].result = run_tiles(entries[i].job);
+	};
+	std::vector<std::thread> threads;
+	for (int i = 1; i < std::min(concurrent_entries, (int)entries.size()); i++)
+		threads.emplace_back(run_entries);
+	run_entries();
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+
+	int failed_count = 0;
+	double pixels = 0;
+	for (size_t i = 0; i < entries.size(); i++)
+	{
+		pixels += (double)entries[i].job.resolution * entries[i].job.resolution;
+		if (entries[i].result == 0) continue;
+		std::cerr << "the manifest entry at line " << entries[i].line << " failed\n";
+		failed_count++;
+	}
+	std::cout << entries.size() << " entries are finished in " << seconds << " seconds, "
+		<< pixels / 1000000.0 / std::max(seconds, 1e-6) << " megapixels per second\n";
+	return failed_count > 0 ? -1 : 0;
+}
+
 int generate_indexmap_entry(int argc, const char *argv[])
 {
 	if (argc != 4) return print_usage_on_error();
@@ -161,23 +568,60 @@ int generate_indexmap_entry(int argc, const char *argv[])
 	}
 	const char *outputpath = argv[3];
 
-	wangtiles_t wangtiles(image_t(), NUM_COLORS, CORNER_TILES); // create a wangtiles object with a dummy source image
-	image_t indexmap = wangtiles.generate_indexmap(resolution);
+	wangtiles_t wangtiles(image_view_t(), NUM_COLORS, CORNER_TILES); // create a wangtiles object with a dummy source image
+	std::vector<long long> statistics(16);
+	auto count_tiles = [&](const color_t *pixels, size_t count)
+	{
+		for (size_t i = 0; i < count; i++)
+			statistics[pixels[i].r]++;
+	};
 
-	// print statistics
-	std::vector<int> statistics(16);
-	for (int i = 0; i < resolution * resolution; i++)
+	bool succeeded = true;
+	if (image_file_format(outputpath) != image_file_format_raw)
 	{
-		statistics[indexmap.pixels[i].r]++;
+		// the encoders read the rows in their own order, so the map is held whole for them.
+		// an index map in an image file carries the tile index in the alpha too, for the shaders sampling it
+		image_t indexmap = wangtiles.generate_indexmap(resolution);
+		count_tiles(indexmap.pixels, (size_t)resolution * resolution);
+		encode_rows_t rows = { resolution, resolution, 4, [&](int y, unsigned char *row)
+		{
+			const color_t *pixels = indexmap.pixels + (size_t)(resolution - 1 - y) * resolution;
+			for (int x = 0; x < resolution; x++)
+			{
+				row[4 * x + 0] = pixels[x].r;
+				row[4 * x + 1] = pixels[x].g;
+				row[4 * x + 2] = pixels[x].b;
+				row[4 * x + 3] = pixels[x].r;
+			}
+		} };
+		succeeded = writeimagefile(outputpath, image_file_format(outputpath), rows);
 	}
-	for (int i = 0; i < statistics.size(); i++)
-		std::cout << "number of tile " << i << " generated: " << statistics[i] << std::endl;
-
-	if (!writefile(outputpath, indexmap.pixels, resolution))
+	else
+	{
+		// the stripes come from the top of the map down, so the rows are written out as they're generated,
+		// and huge maps never have to fit in memory
+		FILE *f;
+		if (fopen_s(&f, outputpath, "wb")) succeeded = false;
+		else
+		{
+			wangtiles.generate_indexmap_rows(resolution, [&](int y_begin, int y_end, const color_t *rows)
+			{
+				count_tiles(rows, (size_t)(y_end - y_begin) * resolution);
+				for (int y = y_end - 1; y >= y_begin && succeeded; y--)
+					succeeded = fwrite(rows + (size_t)(y - y_begin) * resolution, sizeof(color_t), resolution, f) == (size_t)resolution;
+			});
+			if (fclose(f)) succeeded = false;
+		}
+	}
+	if (!succeeded)
 	{
 		std::cerr << "write output file failed\n";
 		return -1;
 	}
+
+	// print statistics
+	for (size_t i = 0; i < statistics.size(); i++)
+		std::cout << "number of tile " << i << " generated: " << statistics[i] << std::endl;
 	return 0;
 }
 
@@ -192,8 +636,9 @@ int generate_palette_entry(int argc, const char *argv[])
 	}
 	const char *outputpath = argv[3];
 
-	wangtiles_t wangtiles(image_t(), NUM_COLORS, CORNER_TILES); // create a wangtiles object with a dummy source image
+	wangtiles_t wangtiles(image_view_t(), NUM_COLORS, CORNER_TILES); // create a wangtiles object with a dummy source image
 	image_t palette = wangtiles.generate_palette(resolution);
+	if (!palette.pixels) return print_usage_on_error();
 
 	if (!writefile(outputpath, palette.pixels, resolution))
 	{
@@ -203,18 +648,133 @@ int generate_palette_entry(int argc, const char *argv[])
 	return 0;
 }
 
+// the mip chains of the requests, which run one at a time, so the server allocates them once
+image_arena_t server_arena;
+
+// a request of the server, parsed from its arguments
+struct server_request_t
+{
+	std::vector<const char *> argv; // points into the arguments
+	bool tiles;
+	bool index;
+	tiles_job_t job;
+	int resolution;
+
+	server_request_t() :tiles(false), index(false), resolution(0) {}
+};
+
+bool parse_request(const std::vector<std::string> &arguments, server_request_t &request)
+{
+	std::vector<const char *> &argv = request.argv;
+	for (size_t i = 0; i < arguments.size(); i++)
+		argv.push_back(arguments[i].c_str());
+	const int argc = (int)argv.size();
+	if (argc >= 1 && strcmp(argv[0], "--tiles") == 0)
+	{
+		request.tiles = true;
+		if (!parse_tiles_arguments(argc - 1, argv.data() + 1, tiles_arguments_request, request.job)) return false;
+		request.resolution = request.job.resolution;
+		return true;
+	}
+	request.index = argc == 2 && strcmp(argv[0], "--index") == 0;
+	const bool palette = argc == 2 && strcmp(argv[0], "--palette") == 0;
+	if (!request.index && !palette) return false;
+	request.resolution = std::atoi(argv[1]);
+	const int num_tiles = NUM_COLORS * NUM_COLORS;
+	if (request.resolution <= 0 || (palette && request.resolution % num_tiles != 0))
+	{
+		std::cerr << "resolution is invalid\n";
+		return false;
+	}
+	return true;
+}
+
+bool validate_request(const std::vector<std::string> &arguments)
+{
+	server_request_t request;
+	return parse_request(arguments, request);
+}
+
+bool handle_request(const std::vector<std::string> &arguments, const std::atomic<bool> &cancelled, server_result_t &result)
+{
+	server_request_t request;
+	if (!parse_request(arguments, request)) return false;
+	const int resolution = request.resolution;
+	if (request.tiles)
+	{
+		const tiles_job_t &job = request.job;
+		input_image_t input;
+		if (!readfile(job.inputpath, input, resolution))
+		{
+			std::cerr << "read input file failed\n";
+			return false;
+		}
+		resultset_t tiles = processimage(input.view, job.options, &server_arena, &cancelled);
+		if (!tiles.succeeded) return false;
+		unsigned char *corners = result.add_image("corners", resolution, 4);
+		unsigned char *composite = result.add_image("composite", resolution, 3);
+		const int constraints_resolution = tiles.graphcut_constraints.resolution;
+		unsigned char *constraints = result.add_image("constraints", constraints_resolution, 3);
+		if (!corners || !composite || !constraints) return false;
+		interleave_rows_flipped(tiles.packed_corners.pixels, tiles.packed_corners_mask.pixels, resolution, corners);
+		copy_rows_flipped(tiles.composite.pixels, resolution, composite);
+		copy_rows_flipped(tiles.graphcut_constraints.pixels, constraints_resolution, constraints);
+		return tiles.solver_mismatch_count == 0;
+	}
+	wangtiles_t wangtiles(image_view_t(), NUM_COLORS, CORNER_TILES); // create a wangtiles object with a dummy source image
+	image_t image;
+	if (request.index)
+	{
+		std::lock_guard<std::mutex> lock(random_mutex);
+		image = wangtiles.generate_indexmap(resolution);
+	}
+	else
+		image = wangtiles.generate_palette(resolution);
+	if (!image.pixels) return false;
+	unsigned char *output = result.add_image(request.index ? "indexmap" : "palette", resolution, 3);
+	if (!output) return false;
+	copy_rows_flipped(image.pixels, resolution, output);
+	return true;
+}
+
+int generate_serve_entry(int argc, const char *argv[])
+{
+	if (argc < 3) return print_usage_on_error();
+	const char *socket_path = argv[2];
+	for (int i = 3; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc)
+		{
+			int workers = std::atoi(argv[++i]);
+			if (workers <= 0) return print_usage_on_error();
+			jobsystem_t::set_shared_worker_count(workers);
+		}
+		else
+			return print_usage_on_error();
+	}
+	// the workers are started before the first request
+	jobsystem_t::shared();
+	return serve(socket_path, validate_request, handle_request);
+}
+
 int main(int argc, const char *argv[])
 {
 	srand((unsigned int)time(NULL));
 	bool generate_indexmap = argc > 1 && strcmp(argv[1], "--index") == 0;
 	bool generate_tiles = argc > 1 && strcmp(argv[1], "--tiles") == 0;
 	bool generate_palette = argc > 1 && strcmp(argv[1], "--palette") == 0;
+	bool generate_batch = argc > 1 && strcmp(argv[1], "--batch") == 0;
+	bool serve_requests = argc > 1 && strcmp(argv[1], "--serve") == 0;
 	if (generate_indexmap)
 		return generate_indexmap_entry(argc, argv);
 	else if (generate_tiles)
 		return generate_tiles_entry(argc, argv);
 	else if (generate_palette)
 		return generate_palette_entry(argc, argv);
+	else if (generate_batch)
+		return generate_batch_entry(argc, argv);
+	else if (serve_requests)
+		return generate_serve_entry(argc, argv);
 	else
 		return print_usage_on_error();
 }
@@ -0,0 +1,228 @@
+#include "pch.h"
+#include <iostream>
+#include <mutex>
+#include <ctime>
+#include "wtgcore_api.h"
+#include "common_types.h"
+#include "wangtiles.h"
+#include "jobsystem.h"
+#include "feather.h"
+#include "fileio.h"
+
+namespace
+{
+	// the random patches and colors come from rand, so the calls are run one at a time
+	std::mutex api_mutex;
+	bool workers_started = false;
+
+	// the shared pool is started by the first call that generates anything
+	void start_workers()
+	{
+		workers_started = true;
+		jobsystem_t::shared();
+	}
+
+	void seed_random(unsigned int seed)
+	{
+		srand(seed != 0 ? seed : (unsigned int)time(NULL));
+	}
+
+	// rows copied by one job, about 64k pixels
+	int rows_grain(int resolution)
+	{
+		return std::max(1, 65536 / resolution);
+	}
+
+	bool is_pot(int value)
+	{
+		return value > 0 && (value & (value - 1)) == 0;
+	}
+
+	// the tiles are cut at power of two sizes, so the tiles per row must be a power of two as well,
+	// and the graphcut needs tiles of at least 2 pixels
+	bool check_tiles(int resolution, int num_colors, int corner_tiles)
+	{
+		if (num_colors != 2 && num_colors != 4)
+		{
+			std::cerr << "num_colors must be 2 or 4\n";
+			return false;
+		}
+		if (corner_tiles && num_colors != 2)
+		{
+			std::cerr << "corner tiles only have 2 colors\n";
+			return false;
+		}
+		if (!is_pot(resolution) || resolution < num_colors * num_colors * 2)
+		{
+			std::cerr << "resolution is invalid, must be a POT of at least num_colors * num_colors * 2\n";
+			return false;
+		}
+		return true;
+	}
+
+	// the images of wtgcore are bottom row first, the buffers of the callers are top row first
+	void copy_flipped_rows(const color_t *pixels, int resolution, unsigned char *output)
+	{
+		const size_t row_bytes = sizeof(color_t) * resolution;
+		jobsystem_t::shared().parallel_for(0, resolution, rows_grain(resolution), [&](int y_begin, int y_end)
+		{
+			for (int y = y_begin; y < y_end; y++)
+				memcpy(output + row_bytes * y, pixels + (size_t)(resolution - 1 - y) * resolution, row_bytes);
+		});
+	}
+
+	void copy_flipped_rows(const unsigned char *pixels, int resolution, unsigned char *output)
+	{
+		jobsystem_t::shared().parallel_for(0, resolution, rows_grain(resolution), [&](int y_begin, int y_end)
+		{
+			for (int y = y_begin; y < y_end; y++)
+				memcpy(output + (size_t)resolution * y, pixels + (size_t)(resolution - 1 - y) * resolution, resolution);
+		});
+	}
+}
+
+int wtg_api_version(void)
+{
+	return WTG_API_VERSION;
+}
+
+int wtg_set_worker_count(int count)
+{
+	std::lock_guard<std::mutex> lock(api_mutex);
+	if (count < 0) return WTG_INVALID_ARGUMENT;
+	if (workers_started) return WTG_WORKERS_STARTED;
+	jobsystem_t::set_shared_worker_count(count);
+	return WTG_OK;
+}
+
+void wtg_tiles_options_init(wtg_tiles_options *options)
+{
+	memset(options, 0, sizeof(wtg_tiles_options));
+	options->struct_size = sizeof(wtg_tiles_options);
+	options->num_colors = 2;
+	options->seam_cost = WTG_SEAM_COST_L2;
+	options->solver = WTG_SOLVER_AUTO;
+	options->verify_solver = WTG_SOLVER_AUTO;
+	options->debug_tileindex = -1;
+}
+
+int wtg_constraints_resolution(int resolution, const wtg_tiles_options *options)
+{
+	if (!options || options->struct_size < sizeof(wtg_tiles_options)) return WTG_INVALID_ARGUMENT;
+	if (!check_tiles(resolution, options->num_colors, options->corner_tiles)) return WTG_INVALID_ARGUMENT;
+	// the constraints are kept at the visual scale of generate_wang_tiles
+	const int tile_size = resolution / (options->num_colors * options->num_colors);
+	return std::min(tile_size, (int)wangtiles_t::default_visual_scale);
+}
+
+int wtg_generate_tiles(const unsigned char *source, int resolution, ptrdiff_t source_row_bytes,
+	const wtg_tiles_options *options, const wtg_tiles_output *output)
+{
+	if (!source || !options || !output) return WTG_INVALID_ARGUMENT;
+	if (options->struct_size < sizeof(wtg_tiles_options) || output->struct_size < sizeof(wtg_tiles_output))
+	{
+		std::cerr << "the options or output of wtg_generate_tiles are from a newer header\n";
+		return WTG_INVALID_ARGUMENT;
+	}
+	if (!check_tiles(resolution, options->num_colors, options->corner_tiles)) return WTG_INVALID_ARGUMENT;
+	if (source_row_bytes == 0) source_row_bytes = (ptrdiff_t)sizeof(color_t) * resolution;
+	if (source_row_bytes < (ptrdiff_t)sizeof(color_t) * resolution || source_row_bytes % sizeof(color_t) != 0)
+	{
+		std::cerr << "the source rows must hold the whole row, in a multiple of 3 bytes\n";
+		return WTG_INVALID_ARGUMENT;
+	}
+	const int num_tiles = options->num_colors * options->num_colors;
+	const int tile_count = num_tiles * num_tiles;
+	if (options->debug_tileindex < -1 || options->debug_tileindex >= tile_count
+		|| options->seam_cost < WTG_SEAM_COST_L2 || options->seam_cost > WTG_SEAM_COST_PERCEPTUAL
+		|| options->solver < WTG_SOLVER_AUTO || options->solver > WTG_SOLVER_EDMONDS_KARP
+		|| options->verify_solver < WTG_SOLVER_AUTO || options->verify_solver > WTG_SOLVER_EDMONDS_KARP
+		|| options->feather_sigma < 0)
+		return WTG_INVALID_ARGUMENT;
+
+	std::lock_guard<std::mutex> lock(api_mutex);
+	start_workers();
+	seed_random(options->seed);
+
+	// the source is read in place, the view starts at its last row and steps back, as with a mapped raw file
+	const ptrdiff_t stride = source_row_bytes / (ptrdiff_t)sizeof(color_t);
+	const color_t *last_row = (const color_t *)(source + source_row_bytes * (resolution - 1));
+	image_view_t source_view((color_t *)last_row, resolution, (int)-stride);
+
+	// the enums of the api index these, in the same order
+	const maxflow_solver_t solvers[] = { maxflow_solver_auto, maxflow_solver_boykov_kolmogorov, maxflow_solver_dinic, maxflow_solver_push_relabel, maxflow_solver_edmonds_karp };
+	const seam_cost_metric_t metrics[] = { seam_cost_metric_normalized_l2, seam_cost_metric_ssd, seam_cost_metric_luminance, seam_cost_metric_perceptual };
+	wangtiles_t wangtiles(source_view, options->num_colors, options->corner_tiles != 0);
+	wangtiles.set_debug_tileindex(options->debug_tileindex);
+	wangtiles.set_multilevel_seams(options->multilevel_seams != 0);
+	wangtiles.set_seam_cost(metrics[options->seam_cost]);
+	wangtiles.set_solver(solvers[options->solver]);
+	if (options->verify_solver != WTG_SOLVER_AUTO) wangtiles.set_solver_verification(solvers[options->verify_solver]);
+	if (options->progress)
+	{
+		wtg_progress_callback progress = options->progress;
+		void *user_data = options->progress_user_data;
+		wangtiles.set_progress_callback([progress, user_data](int finished, int total) { progress(user_data, finished, total); });
+	}
+	if (!wangtiles.pick_colored_patches() || !wangtiles.generate_wang_tiles()) return WTG_FAILED;
+
+	image_t &packed_corners = wangtiles.get_packed_corners();
+	mask_t &packed_corners_mask = wangtiles.get_packed_corners_mask();
+	image_t composite;
+	mask_t feathered_mask;
+	if (output->composite) composite.init(resolution);
+	if (options->feather_sigma > 0) feathered_mask.init(resolution);
+	if (options->feather_sigma > 0 || output->composite)
+		feather_composite(source_view, packed_corners, packed_corners_mask, options->feather_sigma, composite.view(), feathered_mask.view());
+	const mask_t &mask = options->feather_sigma > 0 ? feathered_mask : packed_corners_mask;
+
+	if (output->corners) copy_flipped_rows(packed_corners.pixels, resolution, output->corners);
+	if (output->mask) copy_flipped_rows(mask.pixels, resolution, output->mask);
+	if (output->composite) copy_flipped_rows(composite.pixels, resolution, output->composite);
+	if (output->corners_rgba)
+	{
+		const size_t row_bytes = 4 * (size_t)resolution;
+		jobsystem_t::shared().parallel_for(0, resolution, rows_grain(resolution), [&](int y_begin, int y_end)
+		{
+			for (int y = y_begin; y < y_end; y++)
+			{
+				const size_t offset = (size_t)(resolution - 1 - y) * resolution;
+				interleave_rgba_row(packed_corners.pixels + offset, mask.pixels + offset, output->corners_rgba + row_bytes * y, resolution);
+			}
+		});
+	}
+	if (output->constraints)
+	{
+		const image_t &constraints = wangtiles.get_graphcut_constraints();
+		copy_flipped_rows(constraints.pixels, constraints.resolution, output->constraints);
+	}
+	return wangtiles.get_solver_mismatch_count() > 0 ? WTG_SOLVER_MISMATCH : WTG_OK;
+}
+
+int wtg_generate_indexmap(int resolution, int num_colors, int corner_tiles, unsigned int seed, unsigned char *indexmap)
+{
+	if (!indexmap || resolution <= 0) return WTG_INVALID_ARGUMENT;
+	if (num_colors < 2 || num_colors > 4 || (corner_tiles && num_colors != 2)) return WTG_INVALID_ARGUMENT;
+
+	std::lock_guard<std::mutex> lock(api_mutex);
+	start_workers();
+	seed_random(seed);
+	wangtiles_t wangtiles(image_view_t(), num_colors, corner_tiles != 0); // a wangtiles object with a dummy source image
+	image_t image = wangtiles.generate_indexmap(resolution);
+	if (!image.pixels) return WTG_FAILED;
+	copy_flipped_rows(image.pixels, resolution, indexmap);
+	return WTG_OK;
+}
+
+int wtg_generate_palette(int resolution, unsigned char *palette)
+{
+	if (!palette || resolution <= 0 || resolution % 4 != 0) return WTG_INVALID_ARGUMENT;
+
+	std::lock_guard<std::mutex> lock(api_mutex);
+	start_workers();
+	wangtiles_t wangtiles(image_view_t(), 2, false); // a wangtiles object with a dummy source image
+	image_t image = wangtiles.generate_palette(resolution);
+	if (!image.pixels) return WTG_FAILED;
+	copy_flipped_rows(image.pixels, resolution, palette);
+	return WTG_OK;
+}
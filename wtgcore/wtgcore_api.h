@@ -0,0 +1,119 @@
+#pragma once
+
+/*
+ * the c interface of libwtgcore, for embedding the generator without running wtgcore.
+ * all the images are given by the caller, the pixels are rows of bytes, top row first like python images,
+ * rgb images have 3 bytes per pixel, rgba images 4 bytes, and masks 1 byte.
+ * the outputs are tightly packed, the source may have padding after each row.
+ * structs only grow at their end, and the functions filling them check the size they are given,
+ * so a caller built against an older header keeps working.
+ */
+
+#include <stddef.h>
+
+#if defined(_WIN32)
+#	if defined(WTG_BUILD_LIBRARY)
+#		define WTG_API __declspec(dllexport)
+#	else
+#		define WTG_API __declspec(dllimport)
+#	endif
+#else
+#	define WTG_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WTG_API_VERSION 1
+
+enum
+{
+	WTG_OK = 0,
+	WTG_INVALID_ARGUMENT = -1,
+	// the number of workers is set after the first generation started the pool
+	WTG_WORKERS_STARTED = -2,
+	// the tiles are generated, but the solver disagrees with the reference solver on some of them
+	WTG_SOLVER_MISMATCH = -3,
+	// the arguments are valid, but the tiles can't be generated, e.g. the memory can't be allocated
+	WTG_FAILED = -4,
+};
+
+enum
+{
+	WTG_SEAM_COST_L2 = 0,
+	WTG_SEAM_COST_SSD = 1,
+	WTG_SEAM_COST_LUMINANCE = 2,
+	WTG_SEAM_COST_PERCEPTUAL = 3,
+};
+
+enum
+{
+	WTG_SOLVER_AUTO = 0,
+	WTG_SOLVER_BOYKOV_KOLMOGOROV = 1,
+	WTG_SOLVER_DINIC = 2,
+	WTG_SOLVER_PUSH_RELABEL = 3,
+	WTG_SOLVER_EDMONDS_KARP = 4,
+};
+
+// called as the tiles are finished, from any of the worker threads, but never from two threads at once
+typedef void (*wtg_progress_callback)(void *user_data, int finished_tiles, int total_tiles);
+
+typedef struct wtg_tiles_options
+{
+	size_t struct_size; // sizeof(wtg_tiles_options), set by wtg_tiles_options_init
+	int num_colors;
+	int corner_tiles;
+	// 0 seeds the random patches with the time
+	unsigned int seed;
+	int multilevel_seams;
+	int seam_cost;
+	int solver;
+	// a solver other than WTG_SOLVER_AUTO solves every tile a second time as the reference
+	int verify_solver;
+	// 0 keeps the hard cut of the mask
+	float feather_sigma;
+	// -1 cuts all the tiles
+	int debug_tileindex;
+	wtg_progress_callback progress;
+	void *progress_user_data;
+} wtg_tiles_options;
+
+// the buffers to fill, any of them may be null
+typedef struct wtg_tiles_output
+{
+	size_t struct_size; // sizeof(wtg_tiles_output)
+	// the packed corners, resolution * resolution rgb
+	unsigned char *corners;
+	// the cut mask of the packed corners, feathered if asked, resolution * resolution bytes
+	unsigned char *mask;
+	// the packed corners with the mask as alpha, resolution * resolution rgba, the same as the output file of wtgcore
+	unsigned char *corners_rgba;
+	// the final tiles, the packed corners composited over the source, resolution * resolution rgb
+	unsigned char *composite;
+	// the graphcut constraints for debugging, wtg_constraints_resolution squared rgb
+	unsigned char *constraints;
+} wtg_tiles_output;
+
+WTG_API int wtg_api_version(void);
+// the number of workers of the pool, before anything is generated. 0 uses all the hardware threads.
+WTG_API int wtg_set_worker_count(int count);
+
+WTG_API void wtg_tiles_options_init(wtg_tiles_options *options);
+WTG_API int wtg_constraints_resolution(int resolution, const wtg_tiles_options *options);
+
+// source_row_bytes is the distance between the rows of the source, 0 for rows without padding.
+// the source is only read, and not copied, it must not change during the call.
+// the calls may come from any threads, they are run one at a time.
+WTG_API int wtg_generate_tiles(const unsigned char *source, int resolution, ptrdiff_t source_row_bytes,
+	const wtg_tiles_options *options, const wtg_tiles_output *output);
+
+// the tile index of every pixel, resolution * resolution rgb with the index in all the channels.
+// 0 seeds with the time.
+WTG_API int wtg_generate_indexmap(int resolution, int num_colors, int corner_tiles, unsigned int seed, unsigned char *indexmap);
+// the palette of the edge colors of every tile, resolution * resolution rgb, only for wang tiles with 2 colors
+WTG_API int wtg_generate_palette(int resolution, unsigned char *palette);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,180 @@
+import os
+import ctypes
+
+"""
+The python binding of libwtgcore, the tiles are generated in this process, without wtgcore and temp files.
+The images are passed as buffers, anything with the buffer protocol: bytes, bytearray, memoryview, numpy arrays,
+the bytes of PIL images. The source is read in place, and the outputs are written straight into writable buffers,
+so nothing is copied between python and the library.
+All the images are rows of bytes, top row first, like PIL images.
+"""
+
+library_paths = [
+	os.path.join(os.path.dirname(__file__), 'wtgcore/x64/Release/libwtgcore.dll'),
+	os.path.join(os.path.dirname(__file__), 'wtgcore/libwtgcore.so'),
+]
+
+WTG_OK = 0
+WTG_INVALID_ARGUMENT = -1
+WTG_WORKERS_STARTED = -2
+WTG_SOLVER_MISMATCH = -3
+WTG_FAILED = -4
+
+seam_costs = {"l2": 0, "ssd": 1, "luminance": 2, "perceptual": 3}
+solvers = {"auto": 0, "bk": 1, "dinic": 2, "pushrelabel": 3, "ek": 4}
+
+progress_callback_t = ctypes.CFUNCTYPE(None, ctypes.c_void_p, ctypes.c_int, ctypes.c_int)
+
+class tiles_options_t(ctypes.Structure):
+	_fields_ = [
+		("struct_size", ctypes.c_size_t),
+		("num_colors", ctypes.c_int),
+		("corner_tiles", ctypes.c_int),
+		("seed", ctypes.c_uint),
+		("multilevel_seams", ctypes.c_int),
+		("seam_cost", ctypes.c_int),
+		("solver", ctypes.c_int),
+		("verify_solver", ctypes.c_int),
+		("feather_sigma", ctypes.c_float),
+		("debug_tileindex", ctypes.c_int),
+		("progress", progress_callback_t),
+		("progress_user_data", ctypes.c_void_p),
+	]
+
+class tiles_output_t(ctypes.Structure):
+	_fields_ = [
+		("struct_size", ctypes.c_size_t),
+		("corners", ctypes.c_void_p),
+		("mask", ctypes.c_void_p),
+		("corners_rgba", ctypes.c_void_p),
+		("composite", ctypes.c_void_p),
+		("constraints", ctypes.c_void_p),
+	]
+
+class WtgError(Exception):
+	pass
+
+library = None
+
+def load(path = None):
+	global library
+	if library is not None:
+		return library
+	paths = [path] if path else [os.environ["WTGCORE_LIBRARY"]] if "WTGCORE_LIBRARY" in os.environ else library_paths
+	for p in paths:
+		if os.path.exists(p):
+			library = ctypes.CDLL(p)
+			break
+	if library is None:
+		raise WtgError("libwtgcore is not found")
+	library.wtg_api_version.restype = ctypes.c_int
+	library.wtg_set_worker_count.argtypes = [ctypes.c_int]
+	library.wtg_tiles_options_init.argtypes = [ctypes.POINTER(tiles_options_t)]
+	library.wtg_constraints_resolution.argtypes = [ctypes.c_int, ctypes.POINTER(tiles_options_t)]
+	library.wtg_generate_tiles.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_ssize_t, ctypes.POINTER(tiles_options_t), ctypes.POINTER(tiles_output_t)]
+	library.wtg_generate_indexmap.argtypes = [ctypes.c_int, ctypes.c_int, ctypes.c_int, ctypes.c_uint, ctypes.c_void_p]
+	library.wtg_generate_palette.argtypes = [ctypes.c_int, ctypes.c_void_p]
+	if library.wtg_api_version() != 1:
+		raise WtgError("libwtgcore has api version %d, the binding is for version 1" % library.wtg_api_version())
+	return library
+
+def available():
+	try:
+		load()
+		return True
+	except (WtgError, OSError):
+		return False
+
+def check(status):
+	if status == WTG_SOLVER_MISMATCH:
+		raise WtgError("the solver disagrees with the reference solver")
+	if status == WTG_FAILED:
+		raise WtgError("the tiles can't be generated")
+	if status < 0:
+		raise WtgError("libwtgcore returns error %d" % status)
+	return status
+
+# the address of a buffer, without copying it. ctypes takes the address of bytes as they are,
+# other buffers have to be writable to be mapped by ctypes, see readable_buffer.
+def buffer_address(buffer, size, writable = False):
+	if isinstance(buffer, bytes) and not writable:
+		if len(buffer) < size:
+			raise WtgError("the buffer has %d bytes, %d are needed" % (len(buffer), size))
+		return ctypes.cast(ctypes.c_char_p(buffer), ctypes.c_void_p).value
+	view = memoryview(buffer)
+	if view.readonly:
+		raise WtgError("the buffer is read-only")
+	if view.nbytes < size:
+		raise WtgError("the buffer has %d bytes, %d are needed" % (view.nbytes, size))
+	return ctypes.addressof((ctypes.c_ubyte * view.nbytes).from_buffer(buffer))
+
+# read-only buffers other than bytes are copied once into bytes
+def readable_buffer(buffer):
+	if isinstance(buffer, bytes) or not memoryview(buffer).readonly:
+		return buffer
+	return memoryview(buffer).tobytes()
+
+def set_worker_count(count):
+	check(load().wtg_set_worker_count(count))
+
+def tiles_options(num_colors = 2, corner_tiles = False, seed = 0, multilevel_seams = False, seam_cost = "l2", solver = "auto",
+	verify_solver = None, feather_sigma = 0.0, debug_tileindex = -1, progress = None):
+	options = tiles_options_t()
+	load().wtg_tiles_options_init(ctypes.byref(options))
+	options.num_colors = num_colors
+	options.corner_tiles = 1 if corner_tiles else 0
+	options.seed = seed
+	options.multilevel_seams = 1 if multilevel_seams else 0
+	options.seam_cost = seam_costs[seam_cost]
+	options.solver = solvers[solver]
+	options.verify_solver = solvers[verify_solver] if verify_solver else 0
+	options.feather_sigma = feather_sigma
+	options.debug_tileindex = debug_tileindex
+	if progress:
+		# kept by the options, so it lives as long as they are used
+		options.progress_callback = progress_callback_t(lambda user_data, finished, total: progress(finished, total))
+		options.progress = options.progress_callback
+	return options
+
+def constraints_resolution(resolution, options):
+	return check(load().wtg_constraints_resolution(resolution, ctypes.byref(options)))
+
+"""
+Generates the tiles of a square rgb source, the options are those of tiles_options.
+The outputs are written into the given buffers, those not given are allocated as bytearrays,
+and the ones in wanted are returned in a dict: corners, mask, corners_rgba, composite, constraints.
+"""
+def generate_tiles(source, resolution, source_row_bytes = 0, wanted = ("corners_rgba", "composite"), buffers = None, **kwargs):
+	options = tiles_options(**kwargs)
+	buffers = buffers or {}
+	sizes = {
+		"corners": resolution * resolution * 3,
+		"mask": resolution * resolution,
+		"corners_rgba": resolution * resolution * 4,
+		"composite": resolution * resolution * 3,
+		"constraints": constraints_resolution(resolution, options) ** 2 * 3,
+	}
+	results = {}
+	output = tiles_output_t()
+	output.struct_size = ctypes.sizeof(tiles_output_t)
+	for name in set(wanted) | set(buffers.keys()):
+		buffer = buffers[name] if name in buffers else bytearray(sizes[name])
+		setattr(output, name, buffer_address(buffer, sizes[name], True))
+		results[name] = buffer
+	row_bytes = source_row_bytes if source_row_bytes else resolution * 3
+	source = readable_buffer(source)
+	source_address = buffer_address(source, row_bytes * (resolution - 1) + resolution * 3)
+	check(load().wtg_generate_tiles(source_address, resolution, source_row_bytes, ctypes.byref(options), ctypes.byref(output)))
+	return results
+
+def generate_indexmap(resolution, num_colors = 2, corner_tiles = False, seed = 0, buffer = None):
+	if buffer is None:
+		buffer = bytearray(resolution * resolution * 3)
+	check(load().wtg_generate_indexmap(resolution, num_colors, 1 if corner_tiles else 0, seed, buffer_address(buffer, resolution * resolution * 3, True)))
+	return buffer
+
+def generate_palette(resolution, buffer = None):
+	if buffer is None:
+		buffer = bytearray(resolution * resolution * 3)
+	check(load().wtg_generate_palette(resolution, buffer_address(buffer, resolution * resolution * 3, True)))
+	return buffer
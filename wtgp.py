@@ -14,6 +14,13 @@ def main():
 	resolution = int(sys.argv[1])
 	output_path = sys.argv[2]
 
+	# png and qoi are written by wtgcore itself
+	if os.path.splitext(output_path)[1].lower() in (".png", ".qoi"):
+		p = Popen([core_executable, "--palette", str(resolution), output_path])
+		if p.wait() != 0:
+			raise Exception("wtgcore returns error")
+		return
+
 	tmpoutput = os.path.abspath(".\\output_p.img")
 	command = [core_executable, "--palette", str(resolution), tmpoutput]
 	p = Popen(command)